@@ -0,0 +1,360 @@
+// Microbenchmarks for the per-record hot path. Prints one JSON document (stdout or --out)
+// so runs can be diffed and compared over time.
+//
+//   bench_anonymizer [--filter substr] [--min-time seconds] [--records n] [--seed n] [--out file]
+
+#include <capnp/message.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <kj/io.h>
+#include "http_log.capnp.h"
+
+#include "aggregate.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "transform.h"
+#include "util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    std::string filter;
+    double minTime = 0.5; // seconds per benchmark
+    std::size_t records = 20'000;
+    std::uint32_t seed = 42;
+    std::string out;
+};
+
+// Keeps results observable so the optimizer cannot drop the measured work
+volatile std::uint64_t g_sink = 0;
+
+// ---------------------------------------------------------------------------
+// Corpus: realistic HttpLogRecords (long media URLs, mixed status/cache/method, some IPv6)
+
+struct Corpus {
+    std::vector<std::string> addrs;
+    std::vector<std::string> urls;
+    std::vector<std::string> jsonRows;
+    std::vector<kj::Array<capnp::word>> aligned;       // serialized records, word aligned
+    std::vector<unsigned char> unalignedArena;          // same records at odd addresses
+    std::vector<std::pair<std::size_t, std::size_t>> unaligned; // (offset, len)
+    std::vector<std::string> packedBatches;            // same records, kBatchRecords per packed HttpLogBatch
+    std::size_t payloadBytes = 0;
+    std::size_t packedBytes = 0;
+};
+
+constexpr std::size_t kBatchRecords = 100;
+
+Corpus makeCorpus(std::size_t n, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    auto pick = [&](auto const& v) -> decltype(v[0]) { return v[rng() % v.size()]; };
+    auto range = [&](std::uint64_t lo, std::uint64_t hi) { return lo + rng() % (hi - lo + 1); };
+
+    const std::vector<std::uint16_t> statuses = {200, 200, 200, 200, 206, 301, 304, 400, 403, 404, 500, 502, 503, 504};
+    const std::vector<std::string> caches = {"HIT", "HIT", "MISS", "EXPIRED", "STALE", "BYPASS", "REVALIDATED"};
+    const std::vector<std::string> methods = {"GET", "GET", "GET", "HEAD", "POST", "OPTIONS"};
+    const std::vector<std::string> exts = {".mp4", ".m3u8", ".ts", ".jpg", ".webp", ".js", ".css", ".json"};
+
+    Corpus c;
+    c.urls.reserve(n);
+    c.addrs.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        // addresses: mostly IPv4, some IPv6
+        std::string addr;
+        if (rng() % 10 == 0) {
+            char buf[64];
+            std::snprintf(buf, sizeof(buf), "2001:db8:%x:%x::%x", unsigned(rng() & 0xffff),
+                          unsigned(rng() & 0xffff), unsigned(rng() & 0xffff));
+            addr = buf;
+        } else {
+            addr = std::to_string(range(1, 223)) + "." + std::to_string(range(0, 255)) + "." +
+                   std::to_string(range(0, 255)) + "." + std::to_string(range(0, 255));
+        }
+        c.addrs.push_back(addr);
+
+        // URLs: media paths with long signed query strings; a few need JSON escaping
+        std::string url = "/media/" + std::to_string(range(1, 99999)) + "/";
+        const std::size_t segments = range(1, 6);
+        for (std::size_t s = 0; s < segments; ++s) url += "segment_" + std::to_string(rng() % 100000) + "/";
+        url += "chunk-" + std::to_string(rng() % 10000) + pick(exts);
+        if (rng() % 2) {
+            url += "?token=";
+            const std::size_t tokenLen = range(32, 512);
+            for (std::size_t t = 0; t < tokenLen; ++t) url += "abcdefghijklmnopqrstuvwxyz0123456789"[rng() % 36];
+            url += "&expires=" + std::to_string(range(1700000000, 1800000000));
+        }
+        if (rng() % 50 == 0) url += "&q=\"quoted\\path\"\t";
+        c.urls.push_back(url);
+
+        capnp::MallocMessageBuilder message;
+        auto root = message.initRoot<HttpLogRecord>();
+        root.setTimestampEpochMilli(1710000000000ULL + i * 7);
+        root.setResourceId(range(1, 5000));
+        root.setBytesSent(range(200, 8'000'000));
+        root.setRequestTimeMilli(range(1, 30'000));
+        root.setResponseStatus(pick(statuses));
+        root.setCacheStatus(pick(caches).c_str());
+        root.setMethod(pick(methods).c_str());
+        root.setRemoteAddr(addr.c_str());
+        root.setUrl(url.c_str());
+        kj::Array<capnp::word> flat = capnp::messageToFlatArray(message);
+        c.payloadBytes += flat.size() * sizeof(capnp::word);
+        c.aligned.push_back(std::move(flat));
+    }
+
+    for (auto const& w : c.aligned) {
+        const std::size_t len = w.size() * sizeof(capnp::word);
+        // one byte past a word boundary, as payloads inside a fetch buffer often are
+        const std::size_t off = ((c.unalignedArena.size() + 7) & ~std::size_t{7}) + 1;
+        c.unalignedArena.resize(off + len);
+        std::memcpy(c.unalignedArena.data() + off, w.begin(), len);
+        c.unaligned.emplace_back(off, len);
+    }
+
+    // what a batching producer sends: HttpLogBatch envelopes, packed
+    for (std::size_t first = 0; first < c.aligned.size(); first += kBatchRecords) {
+        const std::size_t count = std::min(kBatchRecords, c.aligned.size() - first);
+        capnp::MallocMessageBuilder message;
+        auto records = message.initRoot<HttpLogBatch>().initRecords(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            capnp::FlatArrayMessageReader reader(c.aligned[first + i]);
+            records.setWithCaveats(i, reader.getRoot<HttpLogRecord>());
+        }
+        kj::VectorOutputStream out;
+        capnp::writePackedMessage(out, message);
+        c.packedBatches.emplace_back(reinterpret_cast<const char*>(out.getArray().begin()), out.getArray().size());
+        c.packedBytes += c.packedBatches.back().size();
+    }
+
+    // JSONEachRow rows for join_rows
+    auto enc = makeEncoder(InsertFormat::JSONEachRow);
+    RecordDecoder decoder;
+    for (auto const& w : c.aligned) {
+        transformPayload(w.begin(), w.size() * sizeof(capnp::word), decoder, *enc);
+        std::string row = enc->finish().toString();
+        row.pop_back(); // join_rows adds the newline
+        c.jsonRows.push_back(std::move(row));
+    }
+    return c;
+}
+
+// ---------------------------------------------------------------------------
+// Harness: repeats `pass` (which processes `opsPerPass` items / `bytesPerPass` bytes)
+// until `minTime` has elapsed, after one warm-up pass.
+
+struct Result {
+    std::string name;
+    std::uint64_t passes = 0;
+    std::uint64_t ops = 0;
+    double seconds = 0;
+    std::uint64_t bytes = 0;
+};
+
+Result measure(const std::string& name, const Options& opt, std::size_t opsPerPass, std::size_t bytesPerPass,
+               const std::function<void()>& pass) {
+    using Clock = std::chrono::steady_clock;
+    pass();
+    Result r;
+    r.name = name;
+    const auto start = Clock::now();
+    do {
+        pass();
+        ++r.passes;
+        r.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (r.seconds < opt.minTime);
+    r.ops = r.passes * opsPerPass;
+    r.bytes = r.passes * bytesPerPass;
+    return r;
+}
+
+void writeJson(std::ostream& os, const Options& opt, const Corpus& c, const std::vector<Result>& results) {
+    char date[32];
+    const std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    os << "{\n  \"context\": {\n"
+       << "    \"date\": \"" << date << "\",\n"
+#if defined(__clang__)
+       << "    \"compiler\": \"clang " << __clang_version__ << "\",\n"
+#elif defined(__GNUC__)
+       << "    \"compiler\": \"gcc " << __VERSION__ << "\",\n"
+#endif
+#ifdef NDEBUG
+       << "    \"build_type\": \"release\",\n"
+#else
+       << "    \"build_type\": \"debug\",\n"
+#endif
+       << "    \"records\": " << c.aligned.size() << ",\n"
+       << "    \"payload_bytes\": " << c.payloadBytes << ",\n"
+       << "    \"packed_batch_bytes\": " << c.packedBytes << ",\n"
+       << "    \"seed\": " << opt.seed << ",\n"
+       << "    \"min_time_s\": " << opt.minTime << "\n  },\n"
+       << "  \"benchmarks\": [";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        auto const& r = results[i];
+        const double nsPerOp = r.seconds * 1e9 / static_cast<double>(r.ops);
+        os << (i ? "," : "") << "\n    {\"name\": \"" << escape_json(r.name) << "\", \"iterations\": " << r.ops
+           << ", \"real_time_s\": " << r.seconds << ", \"ns_per_op\": " << nsPerOp
+           << ", \"ops_per_s\": " << static_cast<double>(r.ops) / r.seconds
+           << ", \"bytes_per_s\": " << static_cast<double>(r.bytes) / r.seconds << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--filter") opt.filter = value();
+        else if (arg == "--min-time") opt.minTime = std::stod(value());
+        else if (arg == "--records") opt.records = std::stoul(value());
+        else if (arg == "--seed") opt.seed = static_cast<std::uint32_t>(std::stoul(value()));
+        else if (arg == "--out") opt.out = value();
+        else {
+            std::cerr << "usage: bench_anonymizer [--filter substr] [--min-time s] [--records n] "
+                         "[--seed n] [--out file]\n";
+            return false;
+        }
+    }
+    return opt.records > 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    try {
+        if (!parseArgs(argc, argv, opt)) return 2;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+
+    const Corpus c = makeCorpus(opt.records, opt.seed);
+    const std::size_t n = c.aligned.size();
+    std::size_t addrBytes = 0, urlBytes = 0, rowBytes = 0;
+    for (auto const& a : c.addrs) addrBytes += a.size();
+    for (auto const& u : c.urls) urlBytes += u.size();
+    for (auto const& r : c.jsonRows) rowBytes += r.size() + 1;
+
+    std::vector<Result> results;
+    auto run = [&](const std::string& name, std::size_t ops, std::size_t bytes, const std::function<void()>& pass) {
+        if (!opt.filter.empty() && name.find(opt.filter) == std::string::npos) return;
+        results.push_back(measure(name, opt, ops, bytes, pass));
+        std::cerr << name << ": " << results.back().seconds * 1e9 / static_cast<double>(results.back().ops)
+                  << " ns/op\n";
+    };
+
+    run("anonymize_ip", n, addrBytes, [&] {
+        for (auto const& a : c.addrs) g_sink += anonymize_ip(a).size();
+    });
+
+    run("anonymize_ip_fixed", n, addrBytes, [&] {
+        for (auto const& a : c.addrs) g_sink += anonymize_ip_fixed(a).size;
+    });
+
+    run("escape_json/url", n, urlBytes, [&] {
+        for (auto const& u : c.urls) g_sink += escape_json(u).size();
+    });
+
+    // append path once per scan kernel the CPU supports
+    const std::string defaultKernel = escape_json_kernel();
+    for (const char* kernel : {"scalar", "sse2", "avx2"}) {
+        if (!set_escape_json_kernel(kernel)) continue;
+        std::string out;
+        run(std::string("escape_json_append/url/") + kernel, n, urlBytes, [&] {
+            for (auto const& u : c.urls) {
+                out.clear();
+                escape_json_append(out, u);
+                g_sink += out.size();
+            }
+        });
+    }
+    set_escape_json_kernel(defaultKernel);
+
+    run("join_rows", n, rowBytes, [&] { g_sink += join_rows(c.jsonRows).size(); });
+
+    auto readAll = [](const HttpLogRecord::Reader& r) {
+        return r.getTimestampEpochMilli() + r.getResourceId() + r.getBytesSent() + r.getRequestTimeMilli() +
+               r.getResponseStatus() + r.getCacheStatus().size() + r.getMethod().size() +
+               r.getRemoteAddr().size() + r.getUrl().size();
+    };
+    {
+        RecordDecoder decoder;
+        run("decode/aligned", n, c.payloadBytes, [&] {
+            for (auto const& w : c.aligned) {
+                capnp::FlatArrayMessageReader reader(decoder.words(w.begin(), w.size() * sizeof(capnp::word)),
+                                                     decoder.options());
+                g_sink += readAll(reader.getRoot<HttpLogRecord>());
+            }
+        });
+        run("decode/unaligned_copy", n, c.payloadBytes, [&] {
+            for (auto const& [off, len] : c.unaligned) {
+                capnp::FlatArrayMessageReader reader(decoder.words(c.unalignedArena.data() + off, len),
+                                                     decoder.options());
+                g_sink += readAll(reader.getRoot<HttpLogRecord>());
+            }
+        });
+    }
+
+    for (auto format : {InsertFormat::JSONEachRow, InsertFormat::RowBinary, InsertFormat::Native}) {
+        RecordDecoder decoder;
+        auto encoder = makeEncoder(format);
+        run(std::string("transform/") + insertFormatName(format), n, c.payloadBytes, [&] {
+            for (auto const& [off, len] : c.unaligned)
+                transformPayload(c.unalignedArena.data() + off, len, decoder, *encoder);
+            g_sink += encoder->finish().size();
+        });
+    }
+
+    // the same records in packed envelopes: fewer, smaller payloads, plus the unpacking
+    {
+        RecordDecoder decoder;
+        auto encoder = makeEncoder(InsertFormat::RowBinary);
+        run("transform/packed_batch/RowBinary", n, c.packedBytes, [&] {
+            for (auto const& batch : c.packedBatches)
+                transformPayload(batch.data(), batch.size(), decoder, *encoder);
+            g_sink += encoder->finish().size();
+        });
+    }
+
+    // INSERT_AGGREGATE: rows summed per key instead of encoded
+    {
+        RecordDecoder decoder;
+        AggregatingEncoder encoder(InsertFormat::RowBinary);
+        run("transform/aggregate", n, c.payloadBytes, [&] {
+            for (auto const& [off, len] : c.unaligned)
+                transformPayload(c.unalignedArena.data() + off, len, decoder, encoder);
+            g_sink += encoder.takeMap()->size();
+        });
+    }
+
+    if (opt.out.empty()) {
+        writeJson(std::cout, opt, c, results);
+    } else {
+        std::ofstream out(opt.out);
+        writeJson(out, opt, c, results);
+        if (!out) {
+            std::cerr << "failed to write " << opt.out << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,727 @@
+// End-to-end load harness that needs no services: a librdkafka mock cluster stands in for
+// Kafka, and in-process HTTP servers stand in for the rate-limited ClickHouse proxy (one
+// accepted request per window per lane, 503 otherwise, like nginx `limit_req` without
+// burst; a repeated insert_deduplication_token is accepted and ignored, like ClickHouse).
+// The real KafkaConsumer, Pipeline and ClickHouseSink run in between. Synthetic
+// HttpLogRecords are produced at a target rate; every row the fake ClickHouse accepts is
+// matched to its Kafka partition/offset (INSERT_KAFKA_COLUMNS=1).
+//
+// Prints one JSON document (stdout or --out): sustained rows/s, end-to-end latency
+// quantiles (Kafka CreateTime -> insert accepted), peak RSS of the whole process, lost and
+// duplicated records. Exits 1 if a record was lost or duplicated, or the rate is below
+// --min-rate.
+//
+// --kill-every runs the consumer as a child process and SIGKILLs it every n seconds, so it
+// dies between inserts and their commits and restarts from the committed offsets. Those
+// rows are inserted again under a different batch (at-least-once): duplicates are then
+// reported but only a lost record fails the run.
+//
+// --join-at starts a second consumer (child process) in the group n seconds into the load,
+// revoking partitions from the in-process one; with a BATCH_MAX the sink reaches well
+// before the next window, the revocation arrives while it sits at its limit. The run also
+// fails if that hand-off took clearly longer than REBALANCE_TIMEOUT_SECONDS. Rows the
+// hand-off could not insert in time are replayed by the new owner (duplicates allowed).
+//
+//   load_anonymizer [--rate n] [--seconds n] [--partitions n] [--brokers n] [--lanes n]
+//                   [--window seconds] [--drain seconds] [--min-rate n] [--seed n]
+//                   [--kill-every seconds] [--join-at seconds] [--out file] [--verbose]
+//
+// PIPELINE_*, BATCH_*, MEMORY_BUDGET_MB, INSERT_DEDUP... are read from the environment
+// as usual; the Kafka/ClickHouse endpoints, INSERT_FORMAT and FLUSH_SECONDS are set here.
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include "http_log.capnp.h"
+
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+
+#include "anonymizer.h"
+#include "metrics.h"
+#include "pipeline.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+struct Options {
+    std::size_t rate = 20'000;      // records per second
+    std::size_t seconds = 10;       // load duration
+    std::int32_t partitions = 6;
+    int brokers = 3;
+    std::size_t lanes = 1;          // fake proxies, one insert lane each
+    std::size_t window = 1;         // seconds between accepted requests per proxy (nginx: 60)
+    std::size_t drain = 0;          // wait for the last rows; default 10 windows + 10 s
+    double minRate = 0;
+    std::uint32_t seed = 42;
+    std::size_t killEvery = 0;      // seconds between consumer SIGKILLs; 0: consumer in-process
+    std::size_t joinAt = 0;         // second consumer joins the group then; 0: never
+    std::string out;
+    bool verbose = false;
+};
+
+std::int64_t wallMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// ---------------------------------------------------------------------------
+// Rows the fake ClickHouse accepted, by Kafka partition and offset (shared by all lanes,
+// as the table is)
+
+class Ledger {
+public:
+    struct Seen {
+        std::uint32_t count = 0;
+        std::int64_t firstMillis = 0; // insert accepted
+    };
+
+    /// Records the rows of an accepted JSONEachRow insert; false if `token` was seen before
+    /// (ClickHouse drops such a block).
+    bool insert(std::string_view token, std::string_view body, std::int64_t now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!token.empty() && !tokens_.emplace(token).second) {
+            ++deduplicated_;
+            return false;
+        }
+        while (!body.empty()) {
+            const std::size_t eol = std::min(body.find('\n'), body.size());
+            const std::string_view line = body.substr(0, eol);
+            body.remove_prefix(std::min(eol + 1, body.size()));
+            if (line.empty()) continue;
+
+            const auto partition = field(line, "\"kafka_partition\":");
+            const auto offset = field(line, "\"kafka_offset\":");
+            if (partition < 0 || offset < 0) {
+                ++malformed_;
+                continue;
+            }
+            auto& seen = partitions_[static_cast<std::int32_t>(partition)];
+            if (seen.size() <= static_cast<std::size_t>(offset)) seen.resize(static_cast<std::size_t>(offset) + 1);
+            Seen& s = seen[static_cast<std::size_t>(offset)];
+            if (s.count++ == 0) {
+                s.firstMillis = now;
+                ++unique_;
+            }
+            ++rows_;
+        }
+        return true;
+    }
+
+    std::size_t unique() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return unique_;
+    }
+
+    Seen seen(std::int32_t partition, std::int64_t offset) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = partitions_.find(partition);
+        if (it == partitions_.end() || static_cast<std::size_t>(offset) >= it->second.size()) return {};
+        return it->second[static_cast<std::size_t>(offset)];
+    }
+
+    std::size_t rows() const { std::lock_guard<std::mutex> lock(mutex_); return rows_; }
+    std::size_t malformed() const { std::lock_guard<std::mutex> lock(mutex_); return malformed_; }
+    std::size_t deduplicated() const { std::lock_guard<std::mutex> lock(mutex_); return deduplicated_; }
+
+private:
+    static std::int64_t field(std::string_view line, std::string_view name) {
+        const auto at = line.find(name);
+        if (at == std::string_view::npos) return -1;
+        std::int64_t v = 0;
+        bool digits = false;
+        for (std::size_t i = at + name.size(); i < line.size() && line[i] >= '0' && line[i] <= '9'; ++i) {
+            v = v * 10 + (line[i] - '0');
+            digits = true;
+        }
+        return digits ? v : -1;
+    }
+
+    mutable std::mutex mutex_;
+    std::set<std::string, std::less<>> tokens_;
+    std::map<std::int32_t, std::vector<Seen>> partitions_;
+    std::size_t unique_ = 0, rows_ = 0, malformed_ = 0, deduplicated_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+// One rate-limited proxy in front of the ledger: plain HTTP/1.1 with keep-alive and
+// Content-Length bodies (the sink sends uncompressed inserts here)
+
+class FakeClickHouse {
+public:
+    FakeClickHouse(Ledger& ledger, std::chrono::milliseconds window) : ledger_(ledger), window_(window) {
+        listen_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_ < 0) throw std::runtime_error("socket failed");
+        const int one = 1;
+        ::setsockopt(listen_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listen_, 16) != 0 ||
+            ::getsockname(listen_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            ::close(listen_);
+            throw std::runtime_error("fake ClickHouse: cannot listen on 127.0.0.1");
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] { serve(); });
+    }
+
+    ~FakeClickHouse() {
+        stop_.store(true);
+        thread_.join();
+        for (auto const& [fd, buffer] : conns_) ::close(fd);
+        ::close(listen_);
+    }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/"; }
+    std::size_t accepted() const { return accepted_.load(); }
+    std::size_t rejected() const { return rejected_.load(); }
+
+private:
+    void serve() {
+        std::vector<pollfd> fds;
+        std::vector<char> chunk(1 << 16);
+        while (!stop_.load()) {
+            fds.clear();
+            fds.push_back({listen_, POLLIN, 0});
+            for (auto const& [fd, buffer] : conns_) fds.push_back({fd, POLLIN, 0});
+            if (::poll(fds.data(), fds.size(), 100) <= 0) continue;
+
+            if (fds[0].revents & POLLIN) {
+                const int fd = ::accept(listen_, nullptr, nullptr);
+                if (fd >= 0) conns_[fd];
+            }
+            for (std::size_t i = 1; i < fds.size(); ++i) {
+                if (!fds[i].revents) continue;
+                const int fd = fds[i].fd;
+                const ssize_t n = ::recv(fd, chunk.data(), chunk.size(), 0);
+                if (n <= 0 || !handle(fd, conns_[fd].append(chunk.data(), static_cast<std::size_t>(n)))) {
+                    ::close(fd);
+                    conns_.erase(fd);
+                }
+            }
+        }
+    }
+
+    // answers every complete request in `buffer`; false closes the connection
+    bool handle(int fd, std::string& buffer) {
+        for (;;) {
+            const auto headerEnd = buffer.find("\r\n\r\n");
+            if (headerEnd == std::string::npos) return true;
+            const std::string_view head(buffer.data(), headerEnd);
+
+            std::size_t length = 0;
+            for (std::size_t at = head.find("\r\n"); at != std::string_view::npos; at = head.find("\r\n", at + 2)) {
+                const auto line = head.substr(at + 2, head.find("\r\n", at + 2) - at - 2);
+                if (line.size() > 15 && strncasecmp(line.data(), "Content-Length:", 15) == 0)
+                    length = std::strtoull(std::string(line.substr(15)).c_str(), nullptr, 10);
+                else if (line.size() > 18 && strncasecmp(line.data(), "Transfer-Encoding:", 18) == 0) {
+                    reply(fd, "411 Length Required");
+                    return false;
+                }
+            }
+            if (buffer.size() < headerEnd + 4 + length) return true;
+
+            const std::string_view target = head.substr(0, head.find("\r\n"));
+            const std::string_view body(buffer.data() + headerEnd + 4, length);
+            const auto now = std::chrono::steady_clock::now();
+            bool ok = true;
+            if (accepted_.load() > 0 && now - lastAccepted_ < window_) {
+                ++rejected_;
+                ok = reply(fd, "503 Service Temporarily Unavailable");
+            } else {
+                lastAccepted_ = now;
+                ++accepted_;
+                ledger_.insert(token(target), body, wallMillis());
+                ok = reply(fd, "200 OK");
+            }
+            buffer.erase(0, headerEnd + 4 + length);
+            if (!ok) return false;
+        }
+    }
+
+    static std::string_view token(std::string_view target) {
+        constexpr std::string_view key = "insert_deduplication_token=";
+        const auto at = target.find(key);
+        if (at == std::string_view::npos) return {};
+        const auto value = target.substr(at + key.size());
+        return value.substr(0, std::min(value.find('&'), value.find(' ')));
+    }
+
+    static bool reply(int fd, const std::string& status) {
+        const std::string response = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+        for (std::size_t sent = 0; sent < response.size();) {
+            const ssize_t n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    Ledger& ledger_;
+    const std::chrono::steady_clock::duration window_;
+    int listen_ = -1;
+    std::uint16_t port_ = 0;
+    std::map<int, std::string> conns_; // serve() thread only
+    std::chrono::steady_clock::time_point lastAccepted_;
+    std::atomic<std::size_t> accepted_{0}, rejected_{0};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+// ---------------------------------------------------------------------------
+// Producer on a librdkafka mock cluster it owns
+
+class MockKafka {
+public:
+    struct Produced {
+        std::int32_t partition;
+        std::int64_t offset;
+        std::int64_t createMillis;
+    };
+
+    MockKafka(int brokers, const std::string& topic, std::int32_t partitions) : topic_(topic) {
+        char err[512];
+        rd_kafka_conf_t* conf = rd_kafka_conf_new();
+        auto set = [&](const char* name, const std::string& value) {
+            if (rd_kafka_conf_set(conf, name, value.c_str(), err, sizeof(err)) != RD_KAFKA_CONF_OK)
+                throw std::runtime_error(std::string("producer ") + name + ": " + err);
+        };
+        set("test.mock.num.brokers", std::to_string(brokers));
+        set("linger.ms", "5");
+        rd_kafka_conf_set_opaque(conf, this);
+        rd_kafka_conf_set_dr_msg_cb(conf, [](rd_kafka_t*, const rd_kafka_message_t* m, void* opaque) {
+            auto* self = static_cast<MockKafka*>(opaque);
+            if (m->err) {
+                ++self->failed_;
+                return;
+            }
+            self->produced_.push_back({m->partition, m->offset, rd_kafka_message_timestamp(m, nullptr)});
+        });
+        rk_ = rd_kafka_new(RD_KAFKA_PRODUCER, conf, err, sizeof(err));
+        if (!rk_) {
+            rd_kafka_conf_destroy(conf);
+            throw std::runtime_error(std::string("mock producer: ") + err);
+        }
+        rd_kafka_mock_cluster_t* cluster = rd_kafka_handle_mock_cluster(rk_);
+        if (!cluster) throw std::runtime_error("librdkafka built without the mock cluster");
+        if (auto rc = rd_kafka_mock_topic_create(cluster, topic.c_str(), partitions, 1); rc != RD_KAFKA_RESP_ERR_NO_ERROR)
+            throw std::runtime_error(std::string("mock topic: ") + rd_kafka_err2str(rc));
+        bootstraps_ = rd_kafka_mock_cluster_bootstraps(cluster);
+    }
+
+    ~MockKafka() {
+        rd_kafka_flush(rk_, 10'000);
+        rd_kafka_destroy(rk_);
+    }
+
+    const std::string& bootstraps() const { return bootstraps_; }
+
+    void produce(const void* payload, std::size_t len, std::int32_t partition = RD_KAFKA_PARTITION_UA) {
+        for (;;) {
+            const auto rc = rd_kafka_producev(rk_, RD_KAFKA_V_TOPIC(topic_.c_str()), RD_KAFKA_V_PARTITION(partition),
+                                              RD_KAFKA_V_VALUE(const_cast<void*>(payload), len),
+                                              RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY), RD_KAFKA_V_END);
+            if (rc == RD_KAFKA_RESP_ERR_NO_ERROR) return;
+            if (rc != RD_KAFKA_RESP_ERR__QUEUE_FULL)
+                throw std::runtime_error(std::string("produce: ") + rd_kafka_err2str(rc));
+            rd_kafka_poll(rk_, 10);
+        }
+    }
+
+    /// Serves delivery reports (this thread only).
+    void poll(int timeoutMs) { rd_kafka_poll(rk_, timeoutMs); }
+    void flush() { rd_kafka_flush(rk_, 30'000); }
+
+    const std::vector<Produced>& produced() const { return produced_; }
+    std::size_t failed() const { return failed_; }
+
+private:
+    std::string topic_;
+    rd_kafka_t* rk_ = nullptr;
+    std::string bootstraps_;
+    std::vector<Produced> produced_; // delivery reports, in poll() order
+    std::size_t failed_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+// The consumer as a child process (this binary with --consumer), for --kill-every: it can
+// die the hard way and come back from the committed offsets, like a restarted container
+
+class ConsumerProcess {
+public:
+    explicit ConsumerProcess(bool verbose) : verbose_(verbose) { spawn(); }
+    ~ConsumerProcess() { stop(SIGKILL); }
+
+    ConsumerProcess(const ConsumerProcess&) = delete;
+    ConsumerProcess& operator=(const ConsumerProcess&) = delete;
+
+    /// SIGKILL, then a fresh consumer in the same group; false if it had already exited
+    bool restart() {
+        const bool ok = stop(SIGKILL);
+        spawn();
+        ++restarts_;
+        return ok;
+    }
+
+    /// SIGTERM: in-flight batches are inserted and committed; false if it did not exit cleanly
+    bool finish() { return stop(SIGTERM); }
+
+    std::size_t restarts() const { return restarts_; }
+
+private:
+    void spawn() {
+        pid_ = ::fork();
+        if (pid_ < 0) throw std::runtime_error("fork failed");
+        if (pid_ == 0) {
+            ::prctl(PR_SET_PDEATHSIG, SIGKILL);
+            ::execl("/proc/self/exe", "load_anonymizer", "--consumer", verbose_ ? "--verbose" : nullptr,
+                    static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+    }
+
+    bool stop(int sig) {
+        if (pid_ <= 0) return true;
+        ::kill(pid_, sig);
+        int status = 0;
+        ::waitpid(pid_, &status, 0);
+        pid_ = -1;
+        if (sig == SIGKILL) return WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    bool verbose_;
+    pid_t pid_ = -1;
+    std::size_t restarts_ = 0;
+};
+
+// Synthetic records, cycled by the producer
+std::vector<kj::Array<capnp::word>> makeRecords(std::size_t n, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    const std::uint16_t statuses[] = {200, 200, 200, 206, 301, 304, 404, 500, 503};
+    const char* caches[] = {"HIT", "HIT", "MISS", "EXPIRED", "BYPASS"};
+    const char* methods[] = {"GET", "GET", "HEAD", "POST"};
+
+    std::vector<kj::Array<capnp::word>> records;
+    records.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        std::string addr;
+        if (rng() % 10 == 0) {
+            char buf[64];
+            std::snprintf(buf, sizeof(buf), "2001:db8:%x:%x::%x", unsigned(rng() & 0xffff), unsigned(rng() & 0xffff),
+                          unsigned(rng() & 0xffff));
+            addr = buf;
+        } else {
+            addr = std::to_string(1 + rng() % 223) + "." + std::to_string(rng() % 256) + "." +
+                   std::to_string(rng() % 256) + "." + std::to_string(rng() % 256);
+        }
+        std::string url = "/media/" + std::to_string(rng() % 100000) + "/segment_" + std::to_string(rng() % 100000) +
+                          "/chunk-" + std::to_string(rng() % 10000) + ".ts?token=";
+        for (std::size_t t = 32 + rng() % 256; t > 0; --t) url += "abcdefghijklmnopqrstuvwxyz0123456789"[rng() % 36];
+
+        capnp::MallocMessageBuilder message;
+        auto root = message.initRoot<HttpLogRecord>();
+        root.setTimestampEpochMilli(static_cast<std::uint64_t>(wallMillis()));
+        root.setResourceId(1 + rng() % 5000);
+        root.setBytesSent(200 + rng() % 8'000'000);
+        root.setRequestTimeMilli(1 + rng() % 30'000);
+        root.setResponseStatus(statuses[rng() % std::size(statuses)]);
+        root.setCacheStatus(caches[rng() % std::size(caches)]);
+        root.setMethod(methods[rng() % std::size(methods)]);
+        root.setRemoteAddr(addr.c_str());
+        root.setUrl(url.c_str());
+        records.push_back(capnp::messageToFlatArray(message));
+    }
+    return records;
+}
+
+double quantile(const std::vector<std::int64_t>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    return static_cast<double>(sorted[static_cast<std::size_t>(q * static_cast<double>(sorted.size() - 1))]);
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--rate") opt.rate = std::stoul(value());
+        else if (arg == "--seconds") opt.seconds = std::stoul(value());
+        else if (arg == "--partitions") opt.partitions = std::stoi(value());
+        else if (arg == "--brokers") opt.brokers = std::stoi(value());
+        else if (arg == "--lanes") opt.lanes = std::stoul(value());
+        else if (arg == "--window") opt.window = std::stoul(value());
+        else if (arg == "--drain") opt.drain = std::stoul(value());
+        else if (arg == "--min-rate") opt.minRate = std::stod(value());
+        else if (arg == "--seed") opt.seed = static_cast<std::uint32_t>(std::stoul(value()));
+        else if (arg == "--kill-every") opt.killEvery = std::stoul(value());
+        else if (arg == "--join-at") opt.joinAt = std::stoul(value());
+        else if (arg == "--out") opt.out = value();
+        else if (arg == "--verbose") opt.verbose = true;
+        else {
+            std::cerr << "usage: load_anonymizer [--rate n] [--seconds n] [--partitions n] [--brokers n] "
+                         "[--lanes n] [--window s] [--drain s] [--min-rate n] [--seed n] [--kill-every s] "
+                         "[--join-at s] [--out file] [--verbose]\n";
+            return false;
+        }
+    }
+    if (opt.drain == 0) opt.drain = 10 * opt.window + 10;
+    if (opt.killEvery && opt.joinAt)
+        throw std::runtime_error("--join-at needs the consumer in-process (no --kill-every)");
+    return opt.rate > 0 && opt.partitions > 0 && opt.brokers > 0 && opt.lanes > 0 && opt.window > 0;
+}
+
+// waits until the ledger holds `want` distinct records; false on timeout
+bool waitDelivered(MockKafka& kafka, const Ledger& ledger, std::chrono::seconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    kafka.flush();
+    while (ledger.unique() < kafka.produced().size()) {
+        if (std::chrono::steady_clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(20ms);
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // --kill-every child: the anonymizer itself, configured by the environment set below
+    if (argc > 1 && std::string_view(argv[1]) == "--consumer") {
+        spdlog::set_level(argc > 2 ? spdlog::level::info : spdlog::level::warn);
+        ::setenv("METRICS_PORT", "0", 1);
+        return run_anonymizer(argc, argv);
+    }
+
+    Options opt;
+    try {
+        if (!parseArgs(argc, argv, opt)) return 2;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    spdlog::set_level(opt.verbose ? spdlog::level::info : spdlog::level::warn);
+
+    try {
+        const std::string topic = "http_log";
+        MockKafka kafka(opt.brokers, topic, opt.partitions);
+        Ledger ledger;
+        std::vector<std::unique_ptr<FakeClickHouse>> proxies;
+        std::string urls;
+        for (std::size_t i = 0; i < opt.lanes; ++i) {
+            proxies.push_back(std::make_unique<FakeClickHouse>(ledger, std::chrono::seconds(opt.window)));
+            urls += (i ? " " : "") + proxies.back()->url();
+        }
+
+        ::setenv("KAFKA_BROKERS", kafka.bootstraps().c_str(), 1);
+        ::setenv("KAFKA_TOPIC", topic.c_str(), 1);
+        ::setenv("KAFKA_GROUP_ID", "load_anonymizer", 1);
+        ::setenv("KAFKA_AUTO_OFFSET_RESET", "earliest", 1);
+        ::setenv("CLICKHOUSE_URLS", urls.c_str(), 1);
+        ::setenv("INSERT_FORMAT", "JSONEachRow", 1);
+        ::setenv("INSERT_KAFKA_COLUMNS", "1", 1);
+        ::setenv("INSERT_AGGREGATE", "0", 1);
+        ::setenv("INSERT_COMPRESSION", "none", 1);
+        ::setenv("FLUSH_SECONDS", std::to_string(opt.window).c_str(), 1);
+        // a killed consumer holds its partitions until its session times out (librdkafka: 45 s)
+        if (opt.killEvery) ::setenv("KAFKA_SESSION_TIMEOUT_MS", "6000", 0);
+        if (opt.joinAt) ::setenv("REBALANCE_TIMEOUT_SECONDS", "3", 0);
+        const auto handoffTimeout = PipelineConfig::fromEnv().handoffTimeout;
+
+        const auto records = makeRecords(4096, opt.seed);
+        auto produce = [&](std::size_t i, std::int32_t partition = RD_KAFKA_PARTITION_UA) {
+            auto const& r = records[i % records.size()];
+            kafka.produce(r.begin(), r.size() * sizeof(capnp::word), partition);
+        };
+
+        // the consumer: a pipeline thread here, or a child process --kill-every restarts
+        std::unique_ptr<KafkaConsumer> consumer;
+        std::unique_ptr<ClickHouseSink> sink;
+        std::unique_ptr<Pipeline> pipeline;
+        std::unique_ptr<ConsumerProcess> child;
+        std::unique_ptr<ConsumerProcess> joined; // --join-at
+        std::atomic<bool> running{true};
+        std::exception_ptr failure;
+        std::thread pipelineThread;
+        if (opt.killEvery) {
+            child = std::make_unique<ConsumerProcess>(opt.verbose);
+        } else {
+            consumer = std::make_unique<KafkaConsumer>();
+            sink = std::make_unique<ClickHouseSink>();
+            pipeline = std::make_unique<Pipeline>(*consumer, *sink, PipelineConfig::fromEnv());
+            pipelineThread = std::thread([&] {
+                try {
+                    pipeline->run(running);
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+            });
+        }
+        std::size_t restarts = 0;
+        auto stop = [&] {
+            if (joined && !joined->finish() && !failure)
+                failure = std::make_exception_ptr(std::runtime_error("second consumer did not exit cleanly"));
+            joined.reset();
+            if (child) {
+                restarts = child->restarts();
+                const bool clean = child->finish();
+                child.reset();
+                if (!clean && !failure)
+                    failure = std::make_exception_ptr(std::runtime_error("consumer process did not exit cleanly"));
+                return;
+            }
+            if (!pipelineThread.joinable()) return;
+            running.store(false);
+            pipelineThread.join();
+        };
+        struct StopOnExit {
+            std::function<void()> fn;
+            ~StopOnExit() { fn(); }
+        } stopOnExit{stop};
+
+        // warm-up: one record per partition through the whole path (group join, first window)
+        for (std::int32_t p = 0; p < opt.partitions; ++p) produce(static_cast<std::size_t>(p), p);
+        if (!waitDelivered(kafka, ledger, std::chrono::seconds(opt.drain + 30))) {
+            stop();
+            if (failure) std::rethrow_exception(failure);
+            std::cerr << "warm-up records never reached the fake ClickHouse\n";
+            return 1;
+        }
+        const std::size_t warmup = kafka.produced().size();
+
+        // load at the target rate
+        const auto start = std::chrono::steady_clock::now();
+        const std::int64_t startMillis = wallMillis();
+        const auto duration = std::chrono::seconds(opt.seconds);
+        std::size_t sent = 0;
+        auto lastKill = start;
+        for (auto now = start; now - start < duration; now = std::chrono::steady_clock::now()) {
+            const auto due = static_cast<std::size_t>(
+                std::chrono::duration<double>(now - start).count() * static_cast<double>(opt.rate));
+            while (sent < due) produce(sent++);
+            kafka.poll(1);
+            if (child && now - lastKill >= std::chrono::seconds(opt.killEvery)) {
+                if (!child->restart()) throw std::runtime_error("consumer process exited on its own");
+                lastKill = now;
+            }
+            if (opt.joinAt && !joined && now - start >= std::chrono::seconds(opt.joinAt))
+                joined = std::make_unique<ConsumerProcess>(opt.verbose);
+        }
+        const bool drained = waitDelivered(kafka, ledger, std::chrono::seconds(opt.drain));
+        stop();
+        if (failure) std::rethrow_exception(failure);
+
+        // every record Kafka acknowledged, matched against the ledger
+        std::size_t lost = 0, duplicated = 0;
+        std::int64_t lastAccepted = startMillis;
+        std::vector<std::int64_t> latencies;
+        latencies.reserve(kafka.produced().size());
+        for (std::size_t i = 0; i < kafka.produced().size(); ++i) {
+            auto const& p = kafka.produced()[i];
+            const auto seen = ledger.seen(p.partition, p.offset);
+            if (seen.count == 0) {
+                ++lost;
+                continue;
+            }
+            duplicated += seen.count - 1;
+            if (i < warmup) continue;
+            latencies.push_back(seen.firstMillis - p.createMillis);
+            lastAccepted = std::max(lastAccepted, seen.firstMillis);
+        }
+        std::sort(latencies.begin(), latencies.end());
+        const double elapsed = std::max(1e-3, static_cast<double>(lastAccepted - startMillis) / 1000.0);
+        const double rowsPerSecond = static_cast<double>(latencies.size()) / elapsed;
+
+        std::size_t accepted = 0, rejected = 0;
+        for (auto const& p : proxies) {
+            accepted += p->accepted();
+            rejected += p->rejected();
+        }
+        rusage usage{}, children{};
+        ::getrusage(RUSAGE_SELF, &usage);
+        ::getrusage(RUSAGE_CHILDREN, &children); // largest consumer process, with --kill-every
+        usage.ru_maxrss = std::max(usage.ru_maxrss, children.ru_maxrss);
+
+        // in-process hand-offs that ran past their deadline by more than a second
+        auto const& handoffs = metrics().handoffSeconds;
+        const double slowAfter = std::chrono::duration<double>(handoffTimeout).count() + 1;
+        std::uint64_t slowHandoffs = 0;
+        for (std::size_t i = 1; i <= handoffs.bounds().size(); ++i)
+            if (handoffs.bounds()[i - 1] >= slowAfter) slowHandoffs += handoffs.bucket(i);
+
+        std::ofstream file;
+        if (!opt.out.empty()) file.open(opt.out);
+        std::ostream& os = opt.out.empty() ? std::cout : file;
+        os << "{\n  \"rate\": " << opt.rate << ", \"seconds\": " << opt.seconds << ", \"partitions\": "
+           << opt.partitions << ", \"lanes\": " << opt.lanes << ", \"window_s\": " << opt.window
+           << ",\n  \"produced\": " << kafka.produced().size() << ", \"produce_failed\": " << kafka.failed()
+           << ", \"rows_per_s\": " << rowsPerSecond
+           << ",\n  \"latency_ms\": {\"p50\": " << quantile(latencies, 0.5) << ", \"p99\": "
+           << quantile(latencies, 0.99) << ", \"max\": " << quantile(latencies, 1.0) << "}"
+           << ",\n  \"peak_rss_kb\": " << usage.ru_maxrss << ", \"inserts\": " << accepted
+           << ", \"rows_inserted\": " << ledger.rows() << ", \"rejected_503\": " << rejected
+           << ", \"deduplicated_inserts\": " << ledger.deduplicated()
+           << ",\n  \"restarts\": " << restarts << ", \"handoffs\": " << handoffs.count()
+           << ", \"slow_handoffs\": " << slowHandoffs << ", \"lost\": " << lost << ", \"duplicated\": " << duplicated
+           << ", \"malformed_rows\": "
+           << ledger.malformed() << ", \"drained\": " << (drained ? "true" : "false") << "\n}\n";
+        if (!opt.out.empty() && !file) {
+            std::cerr << "failed to write " << opt.out << "\n";
+            return 1;
+        }
+        std::cerr << rowsPerSecond << " rows/s, p50 " << quantile(latencies, 0.5) << " ms, p99 "
+                  << quantile(latencies, 0.99) << " ms, peak RSS " << usage.ru_maxrss / 1024 << " MB, " << lost
+                  << " lost, " << duplicated << " duplicated\n";
+
+        if (lost || (duplicated && !opt.killEvery && !opt.joinAt) || ledger.malformed() || kafka.failed()) return 1;
+        if (slowHandoffs) {
+            std::cerr << slowHandoffs << " rebalance hand-off(s) took longer than " << slowAfter << " s\n";
+            return 1;
+        }
+        if (rowsPerSecond < opt.minRate) {
+            std::cerr << "below --min-rate " << opt.minRate << "\n";
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "fatal: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
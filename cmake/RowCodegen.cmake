@@ -0,0 +1,502 @@
+# Generates the row struct and the ClickHouse insert encoders from a Cap'n Proto struct.
+#
+#   include(cmake/RowCodegen.cmake)
+#   row_codegen(SCHEMA http_log.capnp STRUCT HttpLogRecord SQL etc/clickhouse/01_schema.sql
+#               TABLE logs.http_log OUTPUT_DIR ${CMAKE_CURRENT_BINARY_DIR}/generated)
+#
+# or standalone: cmake -DSCHEMA=... -DSTRUCT=... -DSQL=... -DTABLE=... -DOUTPUT_DIR=... -P RowCodegen.cmake
+#
+# Writes <OUTPUT_DIR>/http_log_row.h (LogRow, column lists, readRow, anonymizeRow) and
+# <OUTPUT_DIR>/http_log_encode.h (straight-line JSONEachRow / RowBinary / Native writers).
+# Field order, column names and types come from the schema and its $column, $columnType
+# and $anonymize annotations; the build fails if TABLE in SQL does not declare a column
+# with the same type. Only integer and Text fields are supported. kafka_partition and
+# kafka_offset (source message identity, optional per encoder) are appended to every row.
+
+function(_row_codegen_literal out text)
+  string(REPLACE "\\" "\\\\" text "${text}")
+  string(REPLACE "\"" "\\\"" text "${text}")
+  string(REPLACE "\n" "\\n" text "${text}")
+  set(${out} "\"${text}\"" PARENT_SCOPE)
+endfunction()
+
+function(row_codegen)
+  cmake_parse_arguments(RG "" "SCHEMA;STRUCT;SQL;TABLE;OUTPUT_DIR" "" ${ARGN})
+
+  file(READ "${RG_SCHEMA}" schema)
+  string(REGEX REPLACE "#[^\n]*" "" schema "${schema}")
+  string(REGEX MATCH "struct[ \t\r\n]+${RG_STRUCT}[ \t\r\n]*{([^}]*)}" body "${schema}")
+  if (NOT body)
+    message(FATAL_ERROR "row_codegen: struct ${RG_STRUCT} not found in ${RG_SCHEMA}")
+  endif()
+  set(body "${CMAKE_MATCH_1}")
+  string(REGEX REPLACE "[\r\n]+" " " body "${body}")
+  # one list entry per field declaration
+  string(REPLACE ";" "\n" body "${body}")
+  string(REGEX MATCHALL "[^\n]+" decls "${body}")
+
+  # field model: parallel lists
+  set(names)        # capnp name, also the LogRow member
+  set(ctypes)       # C++ type of the LogRow member
+  set(columns)      # ClickHouse column
+  set(chtypes)      # ClickHouse type
+  set(kinds)        # int | datetime | text | lowcard
+  set(anonymized)
+  foreach (decl IN LISTS decls)
+    string(STRIP "${decl}" decl)
+    if (decl STREQUAL "")
+      continue()
+    endif()
+    if (NOT decl MATCHES "^([A-Za-z][A-Za-z0-9]*)[ \t]*@[0-9]+[ \t]*:[ \t]*([A-Za-z0-9]+)(.*)$")
+      message(FATAL_ERROR "row_codegen: cannot parse field `${decl}` of ${RG_STRUCT}")
+    endif()
+    set(name "${CMAKE_MATCH_1}")
+    set(type "${CMAKE_MATCH_2}")
+    set(annotations "${CMAKE_MATCH_3}")
+
+    string(REGEX REPLACE "([A-Z])" "_\\1" column "${name}")
+    string(TOLOWER "${column}" column)
+    if (annotations MATCHES "\\$column\\(\"([^\"]*)\"\\)")
+      set(column "${CMAKE_MATCH_1}")
+    endif()
+
+    if (type MATCHES "^(U?)Int(8|16|32|64)$")
+      if (CMAKE_MATCH_1)
+        set(ctype "std::uint${CMAKE_MATCH_2}_t")
+      else()
+        set(ctype "std::int${CMAKE_MATCH_2}_t")
+      endif()
+      set(chtype "${type}")
+      set(kind int)
+    elseif (type STREQUAL "Text")
+      set(ctype "std::string_view")
+      set(chtype "String")
+      set(kind text)
+    else()
+      message(FATAL_ERROR "row_codegen: ${RG_STRUCT}.${name}: unsupported type ${type}")
+    endif()
+
+    if (annotations MATCHES "\\$columnType\\(\"([^\"]*)\"\\)")
+      set(chtype "${CMAKE_MATCH_1}")
+      if (kind STREQUAL "int" AND chtype STREQUAL "DateTime")
+        set(kind datetime)
+      elseif (kind STREQUAL "text" AND chtype STREQUAL "LowCardinality(String)")
+        set(kind lowcard)
+      else()
+        message(FATAL_ERROR "row_codegen: ${RG_STRUCT}.${name}: cannot write ${type} as ${chtype}")
+      endif()
+    endif()
+
+    if (annotations MATCHES "\\$anonymize")
+      if (kind STREQUAL "int" OR kind STREQUAL "datetime")
+        message(FATAL_ERROR "row_codegen: ${RG_STRUCT}.${name}: only Text fields can be anonymized")
+      endif()
+      list(APPEND anonymized "${name}")
+    endif()
+
+    list(APPEND names "${name}")
+    list(APPEND ctypes "${ctype}")
+    list(APPEND columns "${column}")
+    list(APPEND chtypes "${chtype}")
+    list(APPEND kinds "${kind}")
+  endforeach()
+  list(LENGTH names fieldCount)
+  if (fieldCount EQUAL 0)
+    message(FATAL_ERROR "row_codegen: ${RG_STRUCT} has no fields")
+  endif()
+
+  # source message identity, written only by encoders created with Kafka columns
+  set(allNames ${names} kafkaPartition kafkaOffset)
+  set(allCtypes ${ctypes} "std::int32_t" "std::int64_t")
+  set(allColumns ${columns} kafka_partition kafka_offset)
+  set(allChtypes ${chtypes} Int32 Int64)
+  set(allKinds ${kinds} int int)
+  list(LENGTH allNames allCount)
+  math(EXPR last "${allCount} - 1")
+
+  # the ClickHouse table has to agree with the schema
+  file(READ "${RG_SQL}" sql)
+  string(FIND "${sql}" "CREATE TABLE IF NOT EXISTS ${RG_TABLE}\n" at)
+  if (at EQUAL -1)
+    string(FIND "${sql}" "CREATE TABLE IF NOT EXISTS ${RG_TABLE}\r\n" at)
+  endif()
+  if (at EQUAL -1)
+    message(FATAL_ERROR "row_codegen: table ${RG_TABLE} not found in ${RG_SQL}")
+  endif()
+  string(SUBSTRING "${sql}" ${at} -1 table)
+  string(FIND "${table}" "ENGINE" end)
+  string(SUBSTRING "${table}" 0 ${end} table)
+  foreach (i RANGE ${last})
+    list(GET allColumns ${i} column)
+    list(GET allChtypes ${i} chtype)
+    string(FIND "${table}" "`${column}` ${chtype}" found)
+    if (found EQUAL -1)
+      string(REGEX MATCH "`${column}`[^\r\n,]*" actual "${table}")
+      if (NOT actual)
+        set(actual "missing")
+      endif()
+      message(FATAL_ERROR "row_codegen: ${RG_TABLE} in ${RG_SQL} does not match ${RG_STRUCT}: "
+                          "expected `${column}` ${chtype}, found ${actual}")
+    endif()
+  endforeach()
+
+  get_filename_component(schemaName "${RG_SCHEMA}" NAME)
+  set(header "// Generated from ${RG_STRUCT} in ${schemaName} by cmake/RowCodegen.cmake. Do not edit.\n")
+
+  # -------------------------------------------------------------------------
+  # http_log_row.h
+
+  set(members "")
+  set(reads "")
+  set(anonymizes "")
+  set(columnList "")
+  foreach (i RANGE ${last})
+    list(GET allNames ${i} name)
+    list(GET allCtypes ${i} ctype)
+    list(GET allColumns ${i} column)
+    list(GET allKinds ${i} kind)
+    if (kind STREQUAL "text" OR kind STREQUAL "lowcard")
+      string(APPEND members "    ${ctype} ${name};\n")
+    elseif (i LESS fieldCount)
+      string(APPEND members "    ${ctype} ${name} = 0;\n")
+    endif()
+    if (i LESS fieldCount)
+      string(SUBSTRING "${name}" 0 1 first)
+      string(TOUPPER "${first}" first)
+      string(SUBSTRING "${name}" 1 -1 rest)
+      if (kind STREQUAL "text" OR kind STREQUAL "lowcard")
+        string(APPEND reads "    row.${name} = text(r.get${first}${rest}());\n")
+      else()
+        string(APPEND reads "    row.${name} = r.get${first}${rest}();\n")
+      endif()
+      list(FIND anonymized "${name}" anon)
+      if (NOT anon EQUAL -1)
+        string(APPEND anonymizes "    row.${name} = fn(row.${name});\n")
+      endif()
+      if (columnList STREQUAL "")
+        set(columnList "${column}")
+      else()
+        string(APPEND columnList ", ${column}")
+      endif()
+    endif()
+  endforeach()
+  list(LENGTH anonymized anonymizedCount)
+
+  set(row "${header}")
+  string(APPEND row [=[
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Decoded record with string fields borrowed from the source message. Anonymized fields
+// hold the anonymized value once anonymizeRow() ran.
+struct LogRow {
+]=])
+  string(APPEND row "${members}")
+  string(APPEND row [=[
+    std::int32_t kafkaPartition = 0; // source message identity, written only when the
+    std::int64_t kafkaOffset = 0;    // encoder has Kafka columns enabled
+};
+
+namespace rowgen {
+
+// Column list every encoder writes, in order
+]=])
+  string(APPEND row "inline constexpr const char* kColumns = \"${columnList}\";\n")
+  string(APPEND row "inline constexpr const char* kKafkaColumns = \"kafka_partition, kafka_offset\";\n")
+  string(APPEND row "\n// Fields anonymizeRow() passes through its callback\n")
+  string(APPEND row "inline constexpr std::size_t kAnonymizedFields = ${anonymizedCount};\n")
+  string(APPEND row [=[
+
+/// Copies the fields of `r` (a ]=] "${RG_STRUCT}" [=[::Reader); `text` turns a Text::Reader into a
+/// std::string_view. Anonymized fields are copied raw.
+template <typename Reader, typename TextFn>
+inline void readRow(const Reader& r, LogRow& row, TextFn&& text) {
+]=])
+  string(APPEND row "${reads}")
+  string(APPEND row [=[
+}
+
+/// Replaces every anonymized field by `fn(value)`, in schema order; `fn` keeps each result
+/// alive until the row is encoded.
+template <typename Fn>
+inline void anonymizeRow(]=])
+  if (anonymizedCount EQUAL 0)
+    string(APPEND row "LogRow&, Fn&&) {}\n")
+  else()
+    string(APPEND row "LogRow& row, Fn&& fn) {\n${anonymizes}}\n")
+  endif()
+  string(APPEND row "\n} // namespace rowgen\n")
+
+  # -------------------------------------------------------------------------
+  # http_log_encode.h
+
+  # JSONEachRow as a token stream: L literal, N number, S string, IF/END the Kafka columns
+  set(tokKinds)
+  set(tokValues)
+  macro(_row_codegen_token kind value)
+    list(LENGTH tokKinds _n)
+    set(_merged FALSE)
+    if ("${kind}" STREQUAL "L" AND _n GREATER 0)
+      math(EXPR _lastTok "${_n} - 1")
+      list(GET tokKinds ${_lastTok} _lastKind)
+      if (_lastKind STREQUAL "L")
+        list(GET tokValues ${_lastTok} _lastValue)
+        list(REMOVE_AT tokValues ${_lastTok})
+        list(APPEND tokValues "${_lastValue}${value}")
+        set(_merged TRUE)
+      endif()
+    endif()
+    if (NOT _merged)
+      list(APPEND tokKinds "${kind}")
+      list(APPEND tokValues "${value}")
+    endif()
+  endmacro()
+
+  set(prefix "{")
+  foreach (i RANGE ${last})
+    list(GET allNames ${i} name)
+    list(GET allColumns ${i} column)
+    list(GET allKinds ${i} kind)
+    if (i EQUAL fieldCount)
+      _row_codegen_token(IF "-")
+    endif()
+    if (kind STREQUAL "text" OR kind STREQUAL "lowcard")
+      _row_codegen_token(L "${prefix}\"${column}\":\"")
+      _row_codegen_token(S "r.${name}")
+      _row_codegen_token(L "\"")
+    else()
+      _row_codegen_token(L "${prefix}\"${column}\":")
+      if (kind STREQUAL "datetime")
+        _row_codegen_token(N "r.${name} / 1000")
+      else()
+        _row_codegen_token(N "r.${name}")
+      endif()
+    endif()
+    set(prefix ",")
+  endforeach()
+  _row_codegen_token(END "-")
+  _row_codegen_token(L "}\n")
+
+  list(LENGTH tokKinds tokCount)
+  math(EXPR tokLast "${tokCount} - 1")
+  set(json "")
+  set(open FALSE)
+  set(spans 0)
+  set(indent "    ")
+  foreach (t RANGE ${tokLast})
+    list(GET tokKinds ${t} kind)
+    list(GET tokValues ${t} value)
+    if (kind STREQUAL "S")
+      if (open)
+        string(APPEND json "${indent}out.commit(static_cast<std::size_t>(p - span));\n")
+        set(open FALSE)
+      endif()
+      string(APPEND json "${indent}putJsonString(out, ${value});\n")
+      continue()
+    endif()
+    if (kind STREQUAL "END")
+      set(indent "    ")
+      string(APPEND json "${indent}}\n")
+      continue()
+    endif()
+    if (NOT open)
+      # a number follows before the next string: open a prepare() span sized for the run
+      set(size 0)
+      set(numbers FALSE)
+      foreach (u RANGE ${t} ${tokLast})
+        list(GET tokKinds ${u} k)
+        if (k STREQUAL "S")
+          break()
+        elseif (k STREQUAL "N")
+          math(EXPR size "${size} + 20")
+          set(numbers TRUE)
+        elseif (k STREQUAL "L")
+          list(GET tokValues ${u} v)
+          string(LENGTH "${v}" len)
+          math(EXPR size "${size} + ${len}")
+        endif()
+      endforeach()
+      if (numbers)
+        if (spans EQUAL 0)
+          string(APPEND json "${indent}char* span = out.prepare(${size});\n${indent}char* p = span;\n")
+        else()
+          string(APPEND json "${indent}span = out.prepare(${size});\n${indent}p = span;\n")
+        endif()
+        math(EXPR spans "${spans} + 1")
+        set(open TRUE)
+      endif()
+    endif()
+    if (kind STREQUAL "IF")
+      string(APPEND json "${indent}if (kafkaColumns) {\n")
+      set(indent "        ")
+    elseif (kind STREQUAL "N")
+      string(APPEND json "${indent}p = putDecimal(p, ${value});\n")
+    else()
+      _row_codegen_literal(lit "${value}")
+      if (open)
+        string(APPEND json "${indent}p = putLiteral(p, ${lit});\n")
+      else()
+        string(APPEND json "${indent}out.append(${lit});\n")
+      endif()
+    endif()
+  endforeach()
+  if (open)
+    string(APPEND json "${indent}out.commit(static_cast<std::size_t>(p - span));\n")
+  endif()
+
+  set(rowBinary "")
+  set(nativeAppend "")
+  set(nativeBytes "")
+  set(nativeFinish "")
+  set(nativeClear "")
+  set(nativeMembers "")
+  foreach (i RANGE ${last})
+    list(GET allNames ${i} name)
+    list(GET allCtypes ${i} ctype)
+    list(GET allColumns ${i} column)
+    list(GET allChtypes ${i} chtype)
+    list(GET allKinds ${i} kind)
+    set(indent "    ")
+    set(nativeIndent "        ")
+    if (i EQUAL fieldCount)
+      string(APPEND rowBinary "    if (kafkaColumns) {\n")
+      string(APPEND nativeAppend "        if (kafkaColumns) {\n")
+      string(APPEND nativeFinish "        if (kafkaColumns) {\n")
+    endif()
+    if (NOT i LESS fieldCount)
+      set(indent "        ")
+      set(nativeIndent "            ")
+    endif()
+    if (kind STREQUAL "datetime")
+      set(put "putFixed<std::uint32_t>(%, static_cast<std::uint32_t>(r.${name} / 1000))")
+    elseif (kind STREQUAL "int")
+      set(put "putFixed<${ctype}>(%, r.${name})")
+    else()
+      set(put "putString(%, r.${name})")
+    endif()
+    string(REPLACE "%" "out" line "${put}")
+    string(APPEND rowBinary "${indent}${line};\n")
+    if (kind STREQUAL "lowcard")
+      string(APPEND nativeAppend "${nativeIndent}${name}_.append(r.${name});\n")
+      string(APPEND nativeBytes " +\n               ${name}_.bytes()")
+      string(APPEND nativeFinish "${nativeIndent}lowCardinality(body, \"${column}\", ${name}_);\n")
+      string(APPEND nativeMembers "    LowCardinalityColumn ${name}_;\n")
+    else()
+      string(REPLACE "%" "${name}_" line "${put}")
+      string(APPEND nativeAppend "${nativeIndent}${line};\n")
+      string(APPEND nativeBytes " +\n               ${name}_.size()")
+      string(APPEND nativeFinish "${nativeIndent}column(body, \"${column}\", \"${chtype}\", ${name}_);\n")
+      if (kind STREQUAL "text")
+        string(APPEND nativeMembers "    ChunkedBuffer ${name}_;\n")
+      else()
+        # fixed-width columns grow slowly; smaller chunks keep short batches cheap
+        string(APPEND nativeMembers "    ChunkedBuffer ${name}_{64 * 1024};\n")
+      endif()
+    endif()
+    string(APPEND nativeClear "        ${name}_.clear();\n")
+  endforeach()
+  string(APPEND rowBinary "    }\n")
+  string(APPEND nativeAppend "        }\n")
+  string(APPEND nativeFinish "        }\n")
+  string(REGEX REPLACE "^ \\+\n *" "" nativeBytes "${nativeBytes}")
+  math(EXPR kafkaCount "${fieldCount} + 2")
+
+  set(encode "${header}")
+  string(APPEND encode [=[
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+#include "buffer.h"
+#include "http_log_row.h"
+#include "wire.h"
+
+namespace rowgen {
+
+/// One JSONEachRow line: numbers via to_chars straight into the buffer, strings escaped
+/// in place.
+inline void appendJsonEachRow(ChunkedBuffer& out, const LogRow& r, bool kafkaColumns) {
+]=])
+  string(APPEND encode "${json}")
+  string(APPEND encode [=[
+}
+
+/// One RowBinary row: fixed-width little-endian integers, varint-prefixed strings.
+inline void appendRowBinary(ChunkedBuffer& out, const LogRow& r, bool kafkaColumns) {
+]=])
+  string(APPEND encode "${rowBinary}")
+  string(APPEND encode [=[
+}
+
+/// Column buffers of one Native block.
+class NativeColumns {
+public:
+    void append(const LogRow& r, bool kafkaColumns) {
+]=])
+  string(APPEND encode "${nativeAppend}")
+  string(APPEND encode [=[
+    }
+
+    std::size_t bytes() const {
+        return ]=] "${nativeBytes}" [=[;
+    }
+
+    /// Writes the block (header, then each column spliced in without a copy) and clears.
+    /// HTTP clients speak protocol revision 0: no BlockInfo.
+    void finish(ChunkedBuffer& body, std::size_t rows, bool kafkaColumns) {
+]=])
+  string(APPEND encode "        putVarUInt(body, kafkaColumns ? ${kafkaCount} : ${fieldCount});\n")
+  string(APPEND encode "        putVarUInt(body, rows);\n")
+  string(APPEND encode "${nativeFinish}")
+  string(APPEND encode [=[
+        clear();
+    }
+
+    void clear() {
+]=])
+  string(APPEND encode "${nativeClear}")
+  string(APPEND encode [=[
+    }
+
+private:
+    static void column(ChunkedBuffer& body, const char* name, const char* type, ChunkedBuffer& data) {
+        putString(body, name);
+        putString(body, type);
+        body.splice(std::move(data));
+    }
+
+    static void lowCardinality(ChunkedBuffer& body, const char* name, const LowCardinalityColumn& data) {
+        putString(body, name);
+        putString(body, "LowCardinality(String)");
+        data.serialize(body);
+    }
+
+]=])
+  string(APPEND encode "${nativeMembers}")
+  string(APPEND encode "};\n\n} // namespace rowgen\n")
+
+  # rewrite only on change, so a reconfigure does not rebuild everything
+  file(MAKE_DIRECTORY "${RG_OUTPUT_DIR}")
+  foreach (pair "http_log_row.h;row" "http_log_encode.h;encode")
+    list(GET pair 0 file)
+    list(GET pair 1 var)
+    set(path "${RG_OUTPUT_DIR}/${file}")
+    set(old "")
+    if (EXISTS "${path}")
+      file(READ "${path}" old)
+    endif()
+    if (NOT old STREQUAL "${${var}}")
+      file(WRITE "${path}" "${${var}}")
+    endif()
+  endforeach()
+endfunction()
+
+if (CMAKE_SCRIPT_MODE_FILE AND SCHEMA)
+  row_codegen(SCHEMA "${SCHEMA}" STRUCT "${STRUCT}" SQL "${SQL}" TABLE "${TABLE}" OUTPUT_DIR "${OUTPUT_DIR}")
+endif()
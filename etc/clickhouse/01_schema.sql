@@ -11,7 +11,9 @@ CREATE TABLE IF NOT EXISTS logs.http_log
   `cache_status` LowCardinality(String),
   `method` LowCardinality(String),
   `remote_addr` String,
-  `url` String
+  `url` String,
+  `kafka_partition` Int32 DEFAULT 0,
+  `kafka_offset` Int64 DEFAULT 0
 )
 ENGINE = MergeTree
 PARTITION BY toYYYYMMDD(timestamp)
@@ -19,7 +21,12 @@ ORDER BY (timestamp, resource_id, response_status, cache_status, remote_addr);
 
 -- Ensure column exists even if table pre-existed
 ALTER TABLE logs.http_log ADD COLUMN IF NOT EXISTS `ingested_at` DateTime DEFAULT now();
+-- Source message identity (filled when the anonymizer runs with INSERT_KAFKA_COLUMNS=1)
+ALTER TABLE logs.http_log ADD COLUMN IF NOT EXISTS `kafka_partition` Int32 DEFAULT 0;
+ALTER TABLE logs.http_log ADD COLUMN IF NOT EXISTS `kafka_offset` Int64 DEFAULT 0;
 
+-- Fed by http_log_mv from raw inserts, or directly with pre-summed rows when the
+-- anonymizer runs with INSERT_AGGREGATE=1 (then http_log stays empty and the MV idle).
 CREATE TABLE IF NOT EXISTS logs.http_log_agg
 (
   `resource_id` UInt64,
@@ -89,3 +96,13 @@ FROM logs.http_log
 WHERE (ingested_at - timestamp) BETWEEN 0 AND 7200
 GROUP BY bucket, resource_id, response_status;
 
+-- ---------------------------------------------------------------------------
+-- Insert deduplication: the anonymizer tags each batch with insert_deduplication_token
+-- (a hash of its Kafka offset ranges), so a retried batch or a spill replay is dropped by
+-- the server instead of duplicating rows here and in the aggregates fed by the materialized
+-- views. Rows re-consumed after a crash between insert and commit are batched differently
+-- and still duplicate (at-least-once); kafka_partition/kafka_offset identify them.
+ALTER TABLE logs.http_log MODIFY SETTING non_replicated_deduplication_window = 1000;
+ALTER TABLE logs.http_log_agg MODIFY SETTING non_replicated_deduplication_window = 1000;
+ALTER TABLE logs.http_log_latency_agg MODIFY SETTING non_replicated_deduplication_window = 1000;
+ALTER TABLE logs.http_log_latency_agg_dim MODIFY SETTING non_replicated_deduplication_window = 1000;
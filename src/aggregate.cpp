@@ -0,0 +1,195 @@
+#include "aggregate.h"
+#include "util.h"
+#include "wire.h"
+
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+const char* const kAggregateColumns =
+    "resource_id, response_status, cache_status, remote_addr, bytes_sent_sum, requests_count";
+
+namespace {
+
+// splitmix64 finalizer
+std::uint64_t mix(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+std::uint32_t keyHash(std::uint64_t resourceId, std::uint16_t status, std::string_view cache,
+                      std::string_view addr) {
+    const std::hash<std::string_view> h;
+    const std::uint64_t x = mix(resourceId ^ (std::uint64_t{status} << 48)) ^ h(addr) ^ (h(cache) * 31);
+    return static_cast<std::uint32_t>(mix(x));
+}
+
+std::uint16_t keyLength(std::string_view s) {
+    if (s.size() > std::numeric_limits<std::uint16_t>::max())
+        throw std::runtime_error("aggregation key field too long");
+    return static_cast<std::uint16_t>(s.size());
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------
+// AggregateMap
+
+AggregateMap::AggregateMap(std::size_t expectedKeys) {
+    std::size_t capacity = 16;
+    while (capacity < expectedKeys * 2) capacity *= 2;
+    slots_.assign(capacity, Slot{});
+}
+
+void AggregateMap::add(const LogRow& row) {
+    insert(keyHash(row.resourceId, row.responseStatus, row.cacheStatus, row.remoteAddr), row.resourceId,
+           row.responseStatus, row.cacheStatus, row.remoteAddr, row.bytesSent, 1);
+}
+
+void AggregateMap::merge(const AggregateMap& other) {
+    for (auto const& s : other.slots_) {
+        if (!s.count) continue;
+        const std::string_view cache(other.keys_.data() + s.keyOffset, s.cacheLen);
+        const std::string_view addr(other.keys_.data() + s.keyOffset + s.cacheLen, s.addrLen);
+        insert(s.hash, s.resourceId, s.status, cache, addr, s.bytesSum, s.count);
+    }
+}
+
+void AggregateMap::insert(std::uint32_t hash, std::uint64_t resourceId, std::uint16_t status,
+                          std::string_view cache, std::string_view addr, std::uint64_t bytes,
+                          std::uint64_t count) {
+    const std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+        Slot& s = slots_[i];
+        if (!s.count) {
+            const std::uint16_t cacheLen = keyLength(cache), addrLen = keyLength(addr);
+            if (keys_.size() + cacheLen + addrLen > std::numeric_limits<std::uint32_t>::max())
+                throw std::runtime_error("aggregation key arena full");
+            s.resourceId = resourceId;
+            s.bytesSum = bytes;
+            s.count = count;
+            s.hash = hash;
+            s.keyOffset = static_cast<std::uint32_t>(keys_.size());
+            s.status = status;
+            s.cacheLen = cacheLen;
+            s.addrLen = addrLen;
+            keys_.append(cache);
+            keys_.append(addr);
+            if (++size_ * 2 > slots_.size()) grow();
+            return;
+        }
+        if (s.hash == hash && s.resourceId == resourceId && s.status == status && s.cacheLen == cache.size() &&
+            s.addrLen == addr.size() && keys_.compare(s.keyOffset, s.cacheLen, cache) == 0 &&
+            keys_.compare(s.keyOffset + s.cacheLen, s.addrLen, addr) == 0) {
+            s.bytesSum += bytes;
+            s.count += count;
+            return;
+        }
+    }
+}
+
+void AggregateMap::grow() {
+    std::vector<Slot> old(slots_.size() * 2, Slot{});
+    old.swap(slots_);
+    const std::size_t mask = slots_.size() - 1;
+    for (auto const& s : old) {
+        if (!s.count) continue;
+        std::size_t i = s.hash & mask;
+        while (slots_[i].count) i = (i + 1) & mask;
+        slots_[i] = s;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// AggregatingEncoder
+
+void AggregatingEncoder::append(const LogRow& row) {
+    map_->add(row);
+    ++rows_;
+}
+
+ChunkedBuffer AggregatingEncoder::finish() {
+    return encodeAggregates(*takeMap(), format_);
+}
+
+std::unique_ptr<AggregateMap> AggregatingEncoder::takeMap() {
+    rows_ = 0;
+    return std::exchange(map_, std::make_unique<AggregateMap>());
+}
+
+// ---------------------------------------------------------------------------
+// Encoding
+
+ChunkedBuffer encodeAggregates(const AggregateMap& rows, InsertFormat format) {
+    ChunkedBuffer out(64 * 1024);
+    switch (format) {
+        case InsertFormat::JSONEachRow: {
+            rows.forEach([&](const AggregateRow& r) {
+                char* const head = out.prepare(100);
+                char* p = head;
+                p = putLiteral(p, R"({"resource_id":)");
+                p = putDecimal(p, r.resourceId);
+                p = putLiteral(p, R"(,"response_status":)");
+                p = putDecimal(p, r.responseStatus);
+                p = putLiteral(p, R"(,"cache_status":")");
+                out.commit(static_cast<std::size_t>(p - head));
+                putJsonString(out, r.cacheStatus);
+                out.append(R"(","remote_addr":")");
+                putJsonString(out, r.remoteAddr);
+
+                char* const tail = out.prepare(100);
+                p = tail;
+                p = putLiteral(p, R"(","bytes_sent_sum":)");
+                p = putDecimal(p, r.bytesSentSum);
+                p = putLiteral(p, R"(,"requests_count":)");
+                p = putDecimal(p, r.requestsCount);
+                p = putLiteral(p, "}\n");
+                out.commit(static_cast<std::size_t>(p - tail));
+            });
+            break;
+        }
+        case InsertFormat::RowBinary:
+            rows.forEach([&](const AggregateRow& r) {
+                putFixed<std::uint64_t>(out, r.resourceId);
+                putFixed<std::uint16_t>(out, r.responseStatus);
+                putString(out, r.cacheStatus);
+                putString(out, r.remoteAddr);
+                putFixed<std::uint64_t>(out, r.bytesSentSum);
+                putFixed<std::uint64_t>(out, r.requestsCount);
+            });
+            break;
+        case InsertFormat::Native: {
+            ChunkedBuffer resourceId(64 * 1024), status(64 * 1024), addr, bytesSum(64 * 1024), count(64 * 1024);
+            LowCardinalityColumn cache;
+            rows.forEach([&](const AggregateRow& r) {
+                putFixed<std::uint64_t>(resourceId, r.resourceId);
+                putFixed<std::uint16_t>(status, r.responseStatus);
+                cache.append(r.cacheStatus);
+                putString(addr, r.remoteAddr);
+                putFixed<std::uint64_t>(bytesSum, r.bytesSentSum);
+                putFixed<std::uint64_t>(count, r.requestsCount);
+            });
+            putVarUInt(out, 6);
+            putVarUInt(out, rows.size());
+            auto column = [&](const char* name, const char* type, ChunkedBuffer& data) {
+                putString(out, name);
+                putString(out, type);
+                out.splice(std::move(data));
+            };
+            column("resource_id", "UInt64", resourceId);
+            column("response_status", "UInt16", status);
+            putString(out, "cache_status");
+            putString(out, "LowCardinality(String)");
+            cache.serialize(out);
+            column("remote_addr", "String", addr);
+            column("bytes_sent_sum", "UInt64", bytesSum);
+            column("requests_count", "UInt64", count);
+            break;
+        }
+    }
+    return out;
+}
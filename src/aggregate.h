@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "encoder.h"
+
+// In-process pre-aggregation for logs.http_log_agg (INSERT_AGGREGATE=1): rows are summed
+// per (resource_id, response_status, cache_status, remote_addr) over the flush window,
+// so one insert carries a row per key instead of a row per request.
+
+// Column list of the pre-aggregated rows, in order
+extern const char* const kAggregateColumns;
+
+struct AggregateRow {
+    std::uint64_t resourceId = 0;
+    std::uint16_t responseStatus = 0;
+    std::string_view cacheStatus;
+    std::string_view remoteAddr;
+    std::uint64_t bytesSentSum = 0;
+    std::uint64_t requestsCount = 0;
+};
+
+// Open-addressing (linear probing) hash map over the aggregation key. Slots are small
+// fixed-size structs in one array; key strings live in a single arena, so a lookup
+// touches one or two cache lines and growing never rehashes a string.
+class AggregateMap {
+public:
+    explicit AggregateMap(std::size_t expectedKeys = 256);
+
+    void add(const LogRow& row);
+
+    /// Adds every key of `other` (its stored hashes are reused).
+    void merge(const AggregateMap& other);
+
+    /// Distinct keys.
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// Heap bytes held (slots + key arena).
+    std::size_t bytes() const { return slots_.size() * sizeof(Slot) + keys_.capacity(); }
+
+    /// Calls `fn(const AggregateRow&)` for every key, in slot order.
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (auto const& s : slots_) {
+            if (!s.count) continue;
+            AggregateRow r;
+            r.resourceId = s.resourceId;
+            r.responseStatus = s.status;
+            r.cacheStatus = std::string_view(keys_.data() + s.keyOffset, s.cacheLen);
+            r.remoteAddr = std::string_view(keys_.data() + s.keyOffset + s.cacheLen, s.addrLen);
+            r.bytesSentSum = s.bytesSum;
+            r.requestsCount = s.count;
+            fn(r);
+        }
+    }
+
+private:
+    struct Slot {
+        std::uint64_t resourceId;
+        std::uint64_t bytesSum;
+        std::uint64_t count;      // 0: empty slot
+        std::uint32_t hash;
+        std::uint32_t keyOffset;  // cache_status then remote_addr in keys_
+        std::uint16_t status;
+        std::uint16_t cacheLen;
+        std::uint16_t addrLen;
+    };
+
+    void insert(std::uint32_t hash, std::uint64_t resourceId, std::uint16_t status, std::string_view cache,
+                std::string_view addr, std::uint64_t bytes, std::uint64_t count);
+    void grow();
+
+    std::vector<Slot> slots_; // power-of-two size, at most half full
+    std::string keys_;
+    std::size_t size_ = 0;
+};
+
+// ---------------------------------------------------------------------------
+// BatchEncoder that sums rows instead of encoding them. finish() encodes the aggregate;
+// the pipeline takes the map instead (takeMap) and merges it across the flush window.
+class AggregatingEncoder final : public BatchEncoder {
+public:
+    explicit AggregatingEncoder(InsertFormat format) : format_(format) {}
+
+    InsertFormat format() const override { return format_; }
+    void append(const LogRow& row) override;
+    std::size_t bytes() const override { return map_->bytes(); }
+    ChunkedBuffer finish() override;
+
+    /// Hands over the rows summed since the last call and resets the encoder.
+    std::unique_ptr<AggregateMap> takeMap();
+
+private:
+    InsertFormat format_;
+    std::unique_ptr<AggregateMap> map_ = std::make_unique<AggregateMap>();
+};
+
+// Encodes pre-aggregated rows (kAggregateColumns) in `format`
+ChunkedBuffer encodeAggregates(const AggregateMap& rows, InsertFormat format);
@@ -1,15 +1,18 @@
 #include "anonymizer.h"
-#include <capnp/serialize-packed.h>
-#include "http_log.capnp.h"
+#include "aggregate.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "replay.h"
 #include <curl/curl.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
-#include <cstring>
-#include <kj/array.h>
 #include <thread>
+#include <algorithm>
 #include <atomic>
+#include <cctype>
 #include <csignal>
 #include <cstdlib>
 #include <cstdio>
+#include <ctime>
 #include <sstream>
 
 static std::atomic<bool> g_running{true};
@@ -23,7 +26,20 @@ static void handle_signal(int) {
 // ---------------------------------------------------------------------------
 // KafkaConsumer
 
-KafkaConsumer::KafkaConsumer() {
+class KafkaConsumer::Rebalancer : public RdKafka::RebalanceCb {
+public:
+    explicit Rebalancer(KafkaConsumer& owner) : owner_(owner) {}
+
+    void rebalance_cb(RdKafka::KafkaConsumer* consumer, RdKafka::ErrorCode err,
+                      std::vector<RdKafka::TopicPartition*>& partitions) override {
+        owner_.rebalance(consumer, err, partitions);
+    }
+
+private:
+    KafkaConsumer& owner_;
+};
+
+KafkaConsumer::KafkaConsumer() : rebalancer_(std::make_unique<Rebalancer>(*this)) {
     std::string err;
 
     std::unique_ptr<RdKafka::Conf> conf(RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL));
@@ -36,6 +52,34 @@ KafkaConsumer::KafkaConsumer() {
         conf->set("group.id", groupId, err);
     }
     conf->set("enable.auto.commit", "false", err);
+    // cooperative-sticky only moves the partitions that change owner; the others keep flowing
+    {
+        std::string strategy = getEnvOrDefault("KAFKA_ASSIGNMENT_STRATEGY", "cooperative-sticky");
+        if (conf->set("partition.assignment.strategy", strategy, err) != RdKafka::Conf::CONF_OK)
+            throw std::runtime_error("Kafka partition.assignment.strategy: " + err);
+    }
+    if (conf->set("rebalance_cb", rebalancer_.get(), err) != RdKafka::Conf::CONF_OK)
+        throw std::runtime_error("Kafka rebalance_cb: " + err);
+    // fetch tunables, librdkafka defaults unless set: larger fetches mean fewer broker
+    // round trips and fuller batches per consume() call; auto.offset.reset is where a group
+    // without committed offsets starts
+    static const std::pair<const char*, const char*> kFetchSettings[] = {
+        {"KAFKA_AUTO_OFFSET_RESET", "auto.offset.reset"},
+        {"KAFKA_FETCH_MIN_BYTES", "fetch.min.bytes"},
+        {"KAFKA_FETCH_WAIT_MAX_MS", "fetch.wait.max.ms"},
+        {"KAFKA_FETCH_MAX_BYTES", "fetch.max.bytes"},
+        {"KAFKA_MAX_PARTITION_FETCH_BYTES", "max.partition.fetch.bytes"},
+        {"KAFKA_QUEUED_MIN_MESSAGES", "queued.min.messages"},
+        {"KAFKA_QUEUED_MAX_KBYTES", "queued.max.messages.kbytes"},
+        // how long a consumer that died without leaving keeps its partitions
+        {"KAFKA_SESSION_TIMEOUT_MS", "session.timeout.ms"},
+    };
+    for (auto const& [env, property] : kFetchSettings) {
+        const std::string value = getEnvOrDefault(env, "");
+        if (value.empty()) continue;
+        if (conf->set(property, value, err) != RdKafka::Conf::CONF_OK)
+            throw std::runtime_error(std::string("Kafka ") + property + ": " + err);
+    }
 
     consumer_.reset(RdKafka::KafkaConsumer::create(conf.get(), err));
     if (!consumer_) {
@@ -50,16 +94,181 @@ KafkaConsumer::KafkaConsumer() {
         throw std::runtime_error(what);
     }
 
+    queue_ = rd_kafka_queue_get_consumer(consumer_->c_ptr());
     spdlog::info("Kafka consumer subscribed to topic {}", topic);
 }
 
 KafkaConsumer::~KafkaConsumer() {
     if (consumer_)
         consumer_->close();
+    for (auto& s : shards_)
+        rd_kafka_queue_destroy(s.queue);
+    if (queue_)
+        rd_kafka_queue_destroy(queue_);
+}
+
+void KafkaConsumer::shard(std::size_t n) {
+    if (!shards_.empty()) throw std::logic_error("KafkaConsumer::shard called twice");
+    shards_.resize(n);
+    for (auto& s : shards_) s.queue = rd_kafka_queue_new(consumer_->c_ptr());
+    spdlog::info("Kafka partitions routed to {} shard queue(s)", n);
+}
+
+std::size_t KafkaConsumer::shardOf(const std::string& topic, std::int32_t partition) const {
+    return (std::hash<std::string>{}(topic) + static_cast<std::size_t>(partition)) % shards_.size();
+}
+
+void KafkaConsumer::rebalance(RdKafka::KafkaConsumer* consumer, RdKafka::ErrorCode err,
+                              std::vector<RdKafka::TopicPartition*>& partitions) {
+    const bool cooperative = consumer->rebalance_protocol() == "COOPERATIVE";
+    std::vector<OffsetTracker::Key> keys;
+    for (auto* tp : partitions)
+        keys.emplace_back(tp->topic(), tp->partition());
+
+    auto check = [](RdKafka::Error* error, const char* what) {
+        if (!error) return;
+        spdlog::error("Kafka {} failed: {}", what, error->str());
+        delete error;
+    };
+
+    if (err == RdKafka::ERR__ASSIGN_PARTITIONS) {
+        {
+            std::lock_guard<std::mutex> lock(assignedMutex_);
+            if (!cooperative) assigned_.clear();
+            assigned_.insert(keys.begin(), keys.end());
+        }
+        // forwarded before fetching starts; librdkafka keeps an application forward
+        for (auto const& [topic, partition] : keys) {
+            if (shards_.empty()) break;
+            rd_kafka_queue_t* pq = rd_kafka_queue_get_partition(consumer->c_ptr(), topic.c_str(), partition);
+            if (!pq) {
+                spdlog::error("Kafka partition queue {}[{}] unavailable, left on the consumer queue",
+                              topic, partition);
+                continue;
+            }
+            rd_kafka_queue_forward(pq, shards_[shardOf(topic, partition)].queue);
+            rd_kafka_queue_destroy(pq);
+        }
+        if (cooperative) check(consumer->incremental_assign(partitions), "incremental assign");
+        else consumer->assign(partitions);
+        if (paused_ && consumer->pause(partitions) != RdKafka::ERR_NO_ERROR)
+            spdlog::error("Kafka pause of newly assigned partitions failed");
+        spdlog::info("Kafka assigned {} partition(s){}", keys.size(), paused_ ? " (paused)" : "");
+        return;
+    }
+
+    if (err == RdKafka::ERR__REVOKE_PARTITIONS) {
+        // Hand the revoked partitions' data off while we still own them, so the next owner
+        // resumes right after what we inserted. Lost partitions can no longer be committed.
+        if (onRevoke_ && !consumer->assignment_lost()) {
+            try {
+                onRevoke_(keys);
+            } catch (const std::exception& e) {
+                spdlog::error("Kafka revoke hand-off failed: {}", e.what());
+            }
+        }
+    } else {
+        spdlog::error("Kafka rebalance error: {}", RdKafka::err2str(err));
+    }
+    {
+        std::lock_guard<std::mutex> lock(assignedMutex_);
+        if (cooperative && err == RdKafka::ERR__REVOKE_PARTITIONS) {
+            for (auto const& k : keys) assigned_.erase(k);
+        } else {
+            assigned_.clear();
+        }
+    }
+    if (cooperative) check(consumer->incremental_unassign(partitions), "incremental unassign");
+    else consumer->unassign();
+    spdlog::info("Kafka revoked {} partition(s)", keys.size());
 }
 
-std::unique_ptr<RdKafka::Message> KafkaConsumer::poll(std::chrono::milliseconds timeout) {
-    return std::unique_ptr<RdKafka::Message>(consumer_->consume(static_cast<int>(timeout.count())));
+namespace {
+
+std::size_t consumeQueue(rd_kafka_queue_t* queue, std::vector<rd_kafka_message_t*>& scratch,
+                         std::vector<rd_kafka_message_t*>& out, std::size_t& bytes, std::size_t max,
+                         std::chrono::milliseconds budget) {
+    if (max == 0) return 0;
+    scratch.resize(max);
+    const auto n = rd_kafka_consume_batch_queue(queue, static_cast<int>(budget.count()), scratch.data(), max);
+    if (n < 0) {
+        spdlog::warn("Kafka batch consume failed");
+        return 0;
+    }
+    const std::size_t before = out.size();
+    out.reserve(before + static_cast<std::size_t>(n));
+    for (std::size_t i = 0; i < static_cast<std::size_t>(n); ++i) {
+        rd_kafka_message_t* m = scratch[i];
+        if (m->err) {
+            if (m->err != RD_KAFKA_RESP_ERR__PARTITION_EOF)
+                spdlog::warn("Kafka error: {}", rd_kafka_message_errstr(m));
+            rd_kafka_message_destroy(m);
+            continue;
+        }
+        out.push_back(m);
+        bytes += m->len;
+    }
+    return out.size() - before;
+}
+
+} // namespace
+
+std::size_t KafkaConsumer::consume(MessageBatch& out, std::size_t max, std::chrono::milliseconds budget) {
+    return consumeQueue(queue_, scratch_, out.messages_, out.bytes_, max, budget);
+}
+
+std::size_t KafkaConsumer::consumeShard(std::size_t shard, MessageBatch& out, std::size_t max,
+                                        std::chrono::milliseconds budget) {
+    auto& s = shards_[shard];
+    return consumeQueue(s.queue, s.scratch, out.messages_, out.bytes_, max, budget);
+}
+
+void KafkaConsumer::route(MessageBatch& in, std::vector<MessageBatch>& parts) const {
+    for (rd_kafka_message_t* m : in.messages_) {
+        auto& part = parts[shardOf(rd_kafka_topic_name(m->rkt), m->partition)];
+        part.messages_.push_back(m);
+        part.bytes_ += m->len;
+    }
+    in.messages_.clear();
+    in.bytes_ = 0;
+}
+
+void KafkaConsumer::pause() {
+    if (paused_) return;
+    paused_ = true;
+    std::vector<RdKafka::TopicPartition*> partitions;
+    if (consumer_->assignment(partitions) == RdKafka::ERR_NO_ERROR && !partitions.empty()) {
+        if (auto err = consumer_->pause(partitions); err != RdKafka::ERR_NO_ERROR)
+            spdlog::error("Kafka pause failed: {}", RdKafka::err2str(err));
+    }
+    RdKafka::TopicPartition::destroy(partitions);
+}
+
+void KafkaConsumer::resume() {
+    if (!paused_) return;
+    paused_ = false;
+    std::vector<RdKafka::TopicPartition*> partitions;
+    if (consumer_->assignment(partitions) == RdKafka::ERR_NO_ERROR && !partitions.empty()) {
+        if (auto err = consumer_->resume(partitions); err != RdKafka::ERR_NO_ERROR)
+            spdlog::error("Kafka resume failed: {}", RdKafka::err2str(err));
+    }
+    RdKafka::TopicPartition::destroy(partitions);
+}
+
+// ---------------------------------------------------------------------------
+// MessageBatch
+
+void MessageBatch::splice(MessageBatch& other) {
+    messages_.insert(messages_.end(), other.messages_.begin(), other.messages_.end());
+    bytes_ += other.bytes_;
+    other.messages_.clear();
+    other.bytes_ = 0;
+}
+
+void MessageBatch::clear() {
+    for (auto* m : messages_) rd_kafka_message_destroy(m);
+    messages_.clear();
+    bytes_ = 0;
 }
 
 void KafkaConsumer::commit(std::vector<RdKafka::TopicPartition*>& partitions) {
@@ -71,6 +280,48 @@ void KafkaConsumer::commit(std::vector<RdKafka::TopicPartition*>& partitions) {
     }
 }
 
+void KafkaConsumer::commit(const OffsetTracker& offsets) {
+    if (!consumer_ || offsets.empty()) return;
+    std::vector<RdKafka::TopicPartition*> partitions;
+    {
+        std::lock_guard<std::mutex> lock(assignedMutex_);
+        for (auto const& [key, range] : offsets.ranges()) {
+            if (!assigned_.count(key)) {
+                spdlog::warn("Skipping commit of {}[{}]@{}: partition no longer assigned",
+                             key.first, key.second, range.last + 1);
+                continue;
+            }
+            partitions.push_back(RdKafka::TopicPartition::create(key.first, key.second, range.last + 1));
+        }
+    }
+    if (partitions.empty()) return;
+    try {
+        commit(partitions);
+    } catch (...) {
+        RdKafka::TopicPartition::destroy(partitions);
+        throw;
+    }
+    RdKafka::TopicPartition::destroy(partitions);
+}
+
+std::map<OffsetTracker::Key, std::int64_t> KafkaConsumer::lag() {
+    std::map<OffsetTracker::Key, std::int64_t> out;
+    std::vector<RdKafka::TopicPartition*> partitions;
+    if (!consumer_ || consumer_->assignment(partitions) != RdKafka::ERR_NO_ERROR) return out;
+    if (consumer_->position(partitions) == RdKafka::ERR_NO_ERROR) {
+        for (auto* tp : partitions) {
+            std::int64_t low = 0, high = 0;
+            if (tp->offset() < 0 ||
+                consumer_->get_watermark_offsets(tp->topic(), tp->partition(), &low, &high) != RdKafka::ERR_NO_ERROR ||
+                high < 0)
+                continue; // nothing consumed or fetched yet
+            out[{tp->topic(), tp->partition()}] = std::max<std::int64_t>(0, high - tp->offset());
+        }
+    }
+    RdKafka::TopicPartition::destroy(partitions);
+    return out;
+}
+
 void KafkaConsumer::commitCurrent() {
     if (!consumer_) return;
     auto err = consumer_->commitSync();
@@ -83,57 +334,276 @@ void KafkaConsumer::commitCurrent() {
 // ---------------------------------------------------------------------------
 // ClickHouseSink
 
+namespace {
+
+// Request body as curl pulls it: raw chunks, or compressed on the fly
+class BodySource {
+public:
+    BodySource(const ChunkedBuffer& body, Codec codec, int level) : plain_(body) {
+        if (codec != Codec::None)
+            compressed_ = std::make_unique<CompressingReader>(body, codec, level);
+    }
+
+    std::size_t read(char* dst, std::size_t n) {
+        return compressed_ ? compressed_->read(dst, n) : plain_.read(dst, n);
+    }
+
+    bool seek(std::size_t offset) {
+        if (!compressed_) return plain_.seek(offset);
+        if (offset != 0) return false;
+        compressed_->rewind();
+        return true;
+    }
+
+    std::size_t produced() const { return compressed_ ? compressed_->produced() : plain_.position(); }
+
+private:
+    ChunkedBufferReader plain_;
+    std::unique_ptr<CompressingReader> compressed_;
+};
+
+// CLICKHOUSE_URLS entries (escaped URLs never contain whitespace)
+std::vector<std::string> splitUrls(const std::string& list) {
+    std::vector<std::string> out;
+    std::istringstream in(list);
+    for (std::string url; in >> url;) out.push_back(url);
+    return out;
+}
+
+} // namespace
+
+// One insert in flight on the sink's multi handle
+struct ClickHouseSink::Transfer {
+    Transfer(const ChunkedBuffer& body, Codec codec, int level) : source(body, codec, level) {}
+    ~Transfer() {
+        if (easy) curl_easy_cleanup(easy);
+        curl_slist_free_all(headers);
+    }
+
+    CURL* easy = nullptr;
+    curl_slist* headers = nullptr;
+    BodySource source;
+    std::string response; // captured for diagnostics
+    std::string retryAfter; // Retry-After or RateLimit-Reset header of the last response
+    std::size_t rows = 0;
+    std::size_t bytes = 0;
+    bool done = false;    // completion read off the multi handle, possibly by another lane
+    CURLcode result = CURLE_OK;
+};
+
 ClickHouseSink::ClickHouseSink() {
     curl_global_init(CURL_GLOBAL_ALL);
-    url_ = getRequiredEnv("CLICKHOUSE_URL");
+    multi_ = curl_multi_init();
+    if (!multi_)
+        throw std::runtime_error("curl_multi_init failed");
+    urls_ = splitUrls(getEnvOrDefault("CLICKHOUSE_URLS", ""));
+    if (urls_.empty()) urls_.push_back(getRequiredEnv("CLICKHOUSE_URL"));
+    active_.resize(urls_.size());
+    format_ = parseInsertFormat(getEnvOrDefault("INSERT_FORMAT", "JSONEachRow"));
+    kafkaColumns_ = getEnvOrDefault("INSERT_KAFKA_COLUMNS", "0") == "1";
+    aggregate_ = getEnvOrDefault("INSERT_AGGREGATE", "0") == "1";
+    dedup_ = getEnvOrDefault("INSERT_DEDUP", "1") == "1";
+    if (aggregate_ && kafkaColumns_) {
+        spdlog::warn("INSERT_KAFKA_COLUMNS is ignored with INSERT_AGGREGATE=1");
+        kafkaColumns_ = false;
+    }
+
+    const std::string table =
+        getEnvOrDefault("CLICKHOUSE_TABLE", aggregate_ ? "logs.http_log_agg" : "logs.http_log");
+    std::string columns = aggregate_ ? kAggregateColumns : kInsertColumns;
+    if (kafkaColumns_) columns = columns + ", " + kKafkaColumns;
+    const std::string query = "INSERT INTO " + table + " (" + columns + ") FORMAT " +
+                              insertFormatName(format_);
+    char* escapedQuery = curl_easy_escape(nullptr, query.c_str(), static_cast<int>(query.size()));
+    if (!escapedQuery)
+        throw std::runtime_error("curl_easy_escape failed");
+    const std::string queryParam = std::string("query=") + escapedQuery;
+    curl_free(escapedQuery);
+
+    for (auto& url : urls_) {
+        // A URL that already carries `query=` is used verbatim; otherwise build the INSERT
+        // for the configured table and format.
+        if (url.find("query=") == std::string::npos) {
+            url += (url.find('?') == std::string::npos) ? "?" : "&";
+            url += queryParam;
+        } else if (format_ != InsertFormat::JSONEachRow) {
+            spdlog::warn("ClickHouse URL has an explicit query; make sure it uses FORMAT {}",
+                         insertFormatName(format_));
+        }
+
+        // materialized views (http_log_agg, latency) skip a deduplicated block too
+        if (dedup_) {
+            url += (url.find('?') == std::string::npos) ? "?" : "&";
+            url += "deduplicate_blocks_in_dependent_materialized_views=1";
+        }
+    }
+
+    codec_ = parseCodec(getEnvOrDefault("INSERT_COMPRESSION", "none"));
+    level_ = std::stoi(getEnvOrDefault("INSERT_COMPRESSION_LEVEL", "-1"));
+    spdlog::info("ClickHouse sink using FORMAT {}, compression {}{}, {} lane(s)", insertFormatName(format_),
+                 codec_ == Codec::None ? "none" : contentEncoding(codec_),
+                 aggregate_ ? ", pre-aggregated rows" : "", urls_.size());
 }
 
 ClickHouseSink::~ClickHouseSink() {
+    for (auto& t : active_)
+        if (t) curl_multi_remove_handle(multi_, t->easy);
+    active_.clear();
+    curl_multi_cleanup(multi_);
     curl_global_cleanup();
 }
 
-void ClickHouseSink::send(const std::vector<std::string> &rows) {
-    CURL *curl = curl_easy_init();
-    if (!curl)
+void ClickHouseSink::startSend(std::size_t lane, const ChunkedBuffer &body, std::size_t rows,
+                               const std::string& dedupToken) {
+    if (active_.at(lane))
+        throw std::logic_error("ClickHouse insert already in flight on lane " + std::to_string(lane));
+
+    // stream the chunks straight from the batch buffer (compressing on the fly if
+    // configured); no contiguous copy of the body
+    auto t = std::make_unique<Transfer>(body, codec_, level_);
+    t->rows = rows;
+    t->bytes = body.size();
+    t->easy = curl_easy_init();
+    if (!t->easy)
         throw std::runtime_error("curl init failed");
 
-    std::string body = join_rows(rows);
-    spdlog::debug("Sending batch of {} rows to ClickHouse", rows.size());
+    spdlog::debug("Sending batch of {} rows ({} bytes) to ClickHouse", rows, body.size());
 
-    // capture response body for diagnostics
-    std::string responseBody;
     auto writeFn = +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> size_t {
         auto* out = static_cast<std::string*>(userdata);
         out->append(ptr, size * nmemb);
         return size * nmemb;
     };
-
-    curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, body.size());
+    // rate-limit hints; a later response (after 100 Continue, a redirect) starts over
+    auto headerFn = +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> size_t {
+        auto* out = static_cast<std::string*>(userdata);
+        const std::string_view line(ptr, size * nmemb);
+        auto header = [&](std::string_view name) {
+            return line.size() > name.size() && line[name.size()] == ':' &&
+                   std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) {
+                       return std::tolower(static_cast<unsigned char>(a)) ==
+                              std::tolower(static_cast<unsigned char>(b));
+                   });
+        };
+        if (line.rfind("HTTP/", 0) == 0) out->clear();
+        for (std::string_view name : {"Retry-After", "RateLimit-Reset", "X-RateLimit-Reset"}) {
+            if (header(name) && (out->empty() || name == "Retry-After")) {
+                out->assign(line.substr(name.size() + 1));
+                break;
+            }
+        }
+        return size * nmemb;
+    };
+    auto readFn = +[](char* dst, size_t size, size_t nmemb, void* userdata) -> size_t {
+        return static_cast<BodySource*>(userdata)->read(dst, size * nmemb);
+    };
+    // curl rewinds the body when it has to resend it (e.g. on a reused, dead connection)
+    auto seekFn = +[](void* userdata, curl_off_t offset, int origin) -> int {
+        if (origin != SEEK_SET || offset < 0) return CURL_SEEKFUNC_CANTSEEK;
+        return static_cast<BodySource*>(userdata)->seek(static_cast<std::size_t>(offset))
+                   ? CURL_SEEKFUNC_OK
+                   : CURL_SEEKFUNC_CANTSEEK;
+    };
+    // large bodies would otherwise wait for "100 Continue" before streaming
+    t->headers = curl_slist_append(nullptr, "Expect:");
+    if (const char* encoding = contentEncoding(codec_))
+        t->headers = curl_slist_append(t->headers, (std::string("Content-Encoding: ") + encoding).c_str());
+
+    CURL* curl = t->easy;
+    // the batch identity (its Kafka offset ranges) makes retries of this batch idempotent;
+    // hashed, since the ranges grow with the partition count and would hit URL limits
+    std::string url = urls_[lane];
+    if (dedup_ && !dedupToken.empty()) {
+        const std::string token = sha256_hex(dedupToken);
+        spdlog::debug("Insert token {} for {}", token, dedupToken);
+        url += "&insert_deduplication_token=";
+        url += token;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, readFn);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &t->source);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seekFn);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, &t->source);
+    // compressed size is unknown up front: -1 makes curl use chunked transfer encoding
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                     codec_ == Codec::None ? static_cast<curl_off_t>(body.size()) : curl_off_t{-1});
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t->headers);
     curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 5000L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 30000L);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFn);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseBody);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t->response);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerFn);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &t->retryAfter);
+
+    if (auto rc = curl_multi_add_handle(multi_, curl); rc != CURLM_OK)
+        throw std::runtime_error(std::string("curl_multi_add_handle: ") + curl_multi_strerror(rc));
+    active_[lane] = std::move(t);
+}
+
+std::optional<InsertResult> ClickHouseSink::pollSend(std::size_t lane, std::chrono::milliseconds timeout) {
+    if (!active_.at(lane)) return InsertResult{};
+
+    if (!active_[lane]->done) {
+        int running = 0;
+        curl_multi_perform(multi_, &running);
+        if (running) {
+            curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+            curl_multi_perform(multi_, &running);
+        }
+
+        // completions of other lanes are kept for their own pollSend()
+        int queued = 0;
+        while (CURLMsg* m = curl_multi_info_read(multi_, &queued)) {
+            if (m->msg != CURLMSG_DONE) continue;
+            for (auto& t : active_) {
+                if (t && t->easy == m->easy_handle) {
+                    t->done = true;
+                    t->result = m->data.result;
+                }
+            }
+        }
+    }
+    if (!active_[lane]->done) return std::nullopt;
 
-    if (auto rc = curl_easy_perform(curl); rc != CURLE_OK) {
-        std::string msg = curl_easy_strerror(rc);
-        curl_easy_cleanup(curl);
-        spdlog::error("ClickHouse insert failed: {}", msg);
-        throw std::runtime_error("ClickHouse insert failed: " + msg);
+    std::unique_ptr<Transfer> t = std::move(active_[lane]);
+    curl_multi_remove_handle(multi_, t->easy);
+
+    InsertResult result;
+    if (t->result != CURLE_OK) {
+        result.status = InsertStatus::NetworkError;
+        result.timedOut = t->result == CURLE_OPERATION_TIMEDOUT;
+        result.message = curl_easy_strerror(t->result);
+        return result;
     }
 
-    long httpCode = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
-    if (httpCode < 200 || httpCode >= 300) {
-        std::string msg = "HTTP " + std::to_string(httpCode) + ": " + responseBody;
-        curl_easy_cleanup(curl);
-        spdlog::error("ClickHouse insert failed (status): {}", msg);
-        throw std::runtime_error("ClickHouse insert failed: " + msg);
+    curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &result.httpCode);
+    const long code = result.httpCode;
+    if (code >= 200 && code < 300) {
+        if (codec_ != Codec::None)
+            spdlog::debug("Compressed {} -> {} bytes ({})", t->bytes, t->source.produced(),
+                          contentEncoding(codec_));
+        return result;
+    }
+    if (code == 503 || code == 429) result.status = InsertStatus::RateLimited;
+    else if (code >= 400 && code < 500) result.status = InsertStatus::ClientError;
+    else result.status = InsertStatus::ServerError;
+    if (!t->retryAfter.empty()) result.retryAfter = parseRetryAfter(t->retryAfter, std::time(nullptr));
+    result.message = "HTTP " + std::to_string(code) + ": " + t->response;
+    return result;
+}
+
+void ClickHouseSink::send(const ChunkedBuffer &body, std::size_t rows, const std::string& dedupToken) {
+    startSend(0, body, rows, dedupToken);
+    std::optional<InsertResult> result;
+    while (!(result = pollSend(0, std::chrono::milliseconds(1000)))) {
+    }
+    if (!result->ok()) {
+        spdlog::error("ClickHouse insert failed ({}): {}", insertStatusName(result->status), result->message);
+        throw std::runtime_error("ClickHouse insert failed: " + result->message);
     }
-    curl_easy_cleanup(curl);
 }
 
 // ---------------------------------------------------------------------------
@@ -144,105 +614,17 @@ int run_anonymizer(int /*argc*/, char* /*argv*/[]) {
         KafkaConsumer consumer;
         ClickHouseSink sink;
 
-        std::vector<std::string> batch;
-        batch.reserve(50'000);
-
-        const std::size_t BATCH_MAX = []{
-            std::string v = getEnvOrDefault("BATCH_MAX", "50000");
-            return static_cast<std::size_t>(std::stoull(v));
-        }();
-        const auto FLUSH_EVERY = std::chrono::seconds([]{
-            std::string v = getEnvOrDefault("FLUSH_SECONDS", "60");
-            return static_cast<unsigned long long>(std::stoull(v));
-        }());
-        auto last_flush = std::chrono::steady_clock::now();
-        // Avoid hammering proxy after 503. When rate-limited, we wait until next_allowed_send.
-        auto next_allowed_send = std::chrono::steady_clock::time_point::min();
+        // Prometheus endpoint (METRICS_PORT=0 disables it)
+        std::unique_ptr<MetricsServer> metricsServer;
+        if (auto port = std::stoi(getEnvOrDefault("METRICS_PORT", "9464")); port > 0)
+            metricsServer = std::make_unique<MetricsServer>(static_cast<std::uint16_t>(port));
 
         // Graceful shutdown na SIGINT/SIGTERM
         std::signal(SIGINT, handle_signal);
         std::signal(SIGTERM, handle_signal);
 
-        // helper to perform time-based flush even when idle
-        auto try_flush = [&](std::chrono::steady_clock::time_point now) {
-            if (batch.empty()) return;
-            if (now < next_allowed_send) return; // still cooling down after 503
-            if (now - last_flush < FLUSH_EVERY) return;
-            try {
-                sink.send(batch);
-                spdlog::info("Flushed {} rows to ClickHouse", batch.size());
-                batch.clear();
-                last_flush = now;
-                try { consumer.commitCurrent(); }
-                catch (const std::exception &e) { spdlog::error("commit failed: {}", e.what()); }
-            } catch (const std::exception &e) {
-                spdlog::error("{}", e.what());
-                const std::string msg = e.what();
-                const auto now_err = std::chrono::steady_clock::now();
-                if (msg.find("HTTP 503") != std::string::npos) {
-                    // Respect 1 req/min: schedule next attempt at the next window edge
-                    auto next_slot = last_flush + FLUSH_EVERY;
-                    if (next_slot <= now_err) next_slot = now_err + FLUSH_EVERY;
-                    next_allowed_send = next_slot;
-                    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_slot - now_err);
-                    spdlog::info("proxy 503 → backing off for {} ms until next slot", wait.count());
-                    if (wait > std::chrono::milliseconds(0)) std::this_thread::sleep_for(wait);
-                } else {
-                    std::this_thread::sleep_for(std::chrono::seconds(5));
-                }
-            }
-        };
-
-        while (g_running.load()) {
-            // time-based flush even if no messages arrive
-            try_flush(std::chrono::steady_clock::now());
-
-            auto msg = consumer.poll(std::chrono::milliseconds(100));
-            if (!msg)
-                continue; // timeout already handled by try_flush
-
-            if (msg->err()) {
-                if (msg->err() != RdKafka::ERR__TIMED_OUT)
-                    spdlog::warn("Kafka error: {}", msg->errstr());
-                continue;
-            }
-
-            // Cap'n Proto decode (aligned copy)
-            std::size_t words = (msg->len() + sizeof(capnp::word) - 1) / sizeof(capnp::word);
-            kj::Array<capnp::word> aligned = kj::heapArray<capnp::word>(words);
-            std::memcpy(aligned.begin(), msg->payload(), msg->len());
-
-            capnp::FlatArrayMessageReader reader(aligned);
-            HttpLogRecord::Reader r = reader.getRoot<HttpLogRecord>();
-
-            // anonymization + JSON build (optionally add identity for future deduplication)
-            std::ostringstream oss;
-            oss << R"({"timestamp":)" << (r.getTimestampEpochMilli() / 1000)
-                << R"(,"resource_id":)" << r.getResourceId()
-                << R"(,"bytes_sent":)" << r.getBytesSent()
-                << R"(,"request_time_milli":)" << r.getRequestTimeMilli()
-                << R"(,"response_status":)" << r.getResponseStatus()
-                << R"(,"cache_status":")" << escape_json(r.getCacheStatus().cStr())
-                << R"(","method":")" << escape_json(r.getMethod().cStr())
-                << R"(","remote_addr":")" << escape_json(anonymize_ip(r.getRemoteAddr().cStr()))
-                << R"(","url":")" << escape_json(r.getUrl().cStr())
-                << R"("})";
-
-            batch.emplace_back(std::move(oss).str());
-
-            // If batch grew and we can't flush yet (1 req/min), wait for next flush window
-            if (batch.size() >= BATCH_MAX) {
-                auto now2 = std::chrono::steady_clock::now();
-                if (now2 - last_flush < FLUSH_EVERY) {
-                    auto wait = FLUSH_EVERY - (now2 - last_flush);
-                    spdlog::info("Batch reached limit ({}). Waiting {} ms for next flush window...",
-                                 batch.size(), std::chrono::duration_cast<std::chrono::milliseconds>(wait).count());
-                    std::this_thread::sleep_for(wait);
-                }
-            }
-
-            // main flush is handled by try_flush(now) at the start of the loop
-        }
+        Pipeline pipeline(consumer, sink, PipelineConfig::fromEnv());
+        pipeline.run(g_running);
 
     } catch (const std::exception &e) {
         spdlog::critical("fatal: {}", e.what());
@@ -252,14 +634,19 @@ int run_anonymizer(int /*argc*/, char* /*argv*/[]) {
 }
 
 // ---------------------------------------------------------------------------
-// entry‑point
+// entry‑point (left out of the load harness, which runs the pipeline in-process)
 
+#ifndef ANONYMIZER_NO_MAIN
 int main(int argc, char *argv[]) {
-    auto console = spdlog::stdout_color_mt("console");
+    // `anonymizer replay ...` may write rows to stdout, so it logs to stderr
+    const bool replay = argc > 1 && std::string_view(argv[1]) == "replay";
+    auto console = replay ? spdlog::stderr_color_mt("console") : spdlog::stdout_color_mt("console");
     spdlog::set_default_logger(console);
     spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%^%l%$] %v");
     spdlog::set_level(spdlog::level::info);
 
+    if (replay) return run_replay(argc - 1, argv + 1);
     spdlog::info("Starting anonymizer application");
     return run_anonymizer(argc, argv);
 }
+#endif
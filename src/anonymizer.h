@@ -1,46 +1,191 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
 #include <string_view>
 #include <vector>
+#include <curl/curl.h>
+#include <librdkafka/rdkafka.h>
 #include <librdkafka/rdkafkacpp.h>
 #include <spdlog/spdlog.h>
+#include "compress.h"
+#include "encoder.h"
+#include "lanes.h"
+#include "offsets.h"
 #include "util.h"
 
 // Helpers are declared in `util.h`
 
+// ---------------------------------------------------------------------------
+// Messages drained by KafkaConsumer::consume(). Holds librdkafka's C handles (no
+// per-message C++ wrapper) and gives them back when cleared or destroyed.
+class MessageBatch {
+public:
+    MessageBatch() = default;
+    MessageBatch(const MessageBatch&) = delete;
+    MessageBatch& operator=(const MessageBatch&) = delete;
+    ~MessageBatch() { clear(); }
+
+    std::size_t size() const { return messages_.size(); }
+    bool empty() const { return messages_.empty(); }
+    void reserve(std::size_t n) { messages_.reserve(n); }
+
+    /// Payload bytes held.
+    std::size_t bytes() const { return bytes_; }
+
+    const rd_kafka_message_t* const* begin() const { return messages_.data(); }
+    const rd_kafka_message_t* const* end() const { return messages_.data() + messages_.size(); }
+
+    /// Moves every message of `other` to the end of this batch.
+    void splice(MessageBatch& other);
+
+    /// Destroys the messages, handing their fetch buffers back to librdkafka.
+    void clear();
+
+private:
+    friend class KafkaConsumer;
+    std::vector<rd_kafka_message_t*> messages_;
+    std::size_t bytes_ = 0;
+};
+
 // ---------------------------------------------------------------------------
 // Kafka consumer (RAII wrapper)
 class KafkaConsumer {
 public:
+    /// Called on the polling thread before partitions are taken away, while their
+    /// offsets can still be committed.
+    using RevokeFn = std::function<void(const std::vector<OffsetTracker::Key>&)>;
+
     KafkaConsumer();
     ~KafkaConsumer();
 
-    /// Blocks for at most `timeout` and returns a message (nullptr on timeout).
-    std::unique_ptr<RdKafka::Message> poll(std::chrono::milliseconds timeout);
+    /// Appends up to `max` messages to `out` in one call, waiting at most `budget` to
+    /// fill them; returns how many were added. Errors and partition EOFs are logged and
+    /// dropped. Serves callbacks (rebalance) like poll().
+    std::size_t consume(MessageBatch& out, std::size_t max, std::chrono::milliseconds budget);
 
     /// Synchronous commit for given offsets (typically after flush).
     void commit(std::vector<RdKafka::TopicPartition*>& partitions);
 
+    /// Synchronous commit of the next offset after each tracked partition's last one.
+    /// Partitions no longer assigned to this consumer are skipped.
+    void commit(const OffsetTracker& offsets);
+
+    /// Messages between the position and the (cached) high watermark per assigned partition.
+    /// Call from the polling thread.
+    std::map<OffsetTracker::Key, std::int64_t> lag();
+
+    /// Installs the hand-off hook run before a rebalance revokes partitions (empty to remove).
+    void onRevoke(RevokeFn fn) { onRevoke_ = std::move(fn); }
+
+    /// Stops fetching from the assigned partitions, and from partitions assigned later,
+    /// until resume(). consume() keeps serving the group meanwhile. Messages librdkafka
+    /// had prefetched are dropped and fetched again after resume(), from the position of
+    /// the last message consume() returned. Call from the polling thread.
+    void pause();
+    void resume();
+    bool paused() const { return paused_; }
+
     /// Synchronous commit current offsets for assigned partitions.
     void commitCurrent();
 
+    /// Routes every partition assigned from now on to one of `n` shard queues (by topic
+    /// and partition, so a partition always lands on the same shard): its messages are
+    /// read with consumeShard(), and consume() only serves callbacks. Call before the
+    /// first consume().
+    void shard(std::size_t n);
+    std::size_t shards() const { return shards_.size(); }
+
+    /// consume() for the partitions of `shard`; one thread per shard may call it
+    /// concurrently with consume(). Serves no callbacks.
+    std::size_t consumeShard(std::size_t shard, MessageBatch& out, std::size_t max,
+                             std::chrono::milliseconds budget);
+
+    /// Splits messages consume() returned while sharded (a partition whose queue could
+    /// not be forwarded) into `parts`, one per shard; `in` is left empty.
+    void route(MessageBatch& in, std::vector<MessageBatch>& parts) const;
+
 private:
+    class Rebalancer;
+    void rebalance(RdKafka::KafkaConsumer* consumer, RdKafka::ErrorCode err,
+                   std::vector<RdKafka::TopicPartition*>& partitions);
+    std::size_t shardOf(const std::string& topic, std::int32_t partition) const; // once sharded
+
+    std::unique_ptr<Rebalancer> rebalancer_; // outlives consumer_
+    RevokeFn onRevoke_;
+    std::mutex assignedMutex_;
+    std::set<OffsetTracker::Key> assigned_;  // written on the polling thread, read by committers
     std::unique_ptr<RdKafka::KafkaConsumer> consumer_;
+    rd_kafka_queue_t* queue_{nullptr};       // consumer queue for batch consumption
+    std::vector<rd_kafka_message_t*> scratch_;
+    bool paused_{false};
+
+    struct Shard {
+        rd_kafka_queue_t* queue{nullptr};     // partition queues forwarded here
+        std::vector<rd_kafka_message_t*> scratch;
+    };
+    std::vector<Shard> shards_;
 };
 
 // ---------------------------------------------------------------------------
-// ClickHouse HTTP sink
+// ClickHouse HTTP sink. Each endpoint of CLICKHOUSE_URLS (whitespace-separated; default
+// the single CLICKHOUSE_URL) is a lane with its own proxy rate limit and at most one
+// insert in flight; the Flusher schedules batches across them.
 class ClickHouseSink {
 public:
     ClickHouseSink();
     ~ClickHouseSink();
 
-    void send(const std::vector<std::string>& rows);
+    /// Insert format selected by INSERT_FORMAT (default JSONEachRow).
+    InsertFormat format() const { return format_; }
+
+    /// INSERT_KAFKA_COLUMNS=1: rows also carry kafka_partition and kafka_offset.
+    bool kafkaColumns() const { return kafkaColumns_; }
+
+    /// INSERT_AGGREGATE=1: inserts pre-summed rows (kAggregateColumns) into the aggregate table.
+    bool aggregate() const { return aggregate_; }
+
+    /// Number of insert endpoints (at least one).
+    std::size_t lanes() const { return urls_.size(); }
+
+    /// POSTs one encoded batch body to lane 0, streamed chunk by chunk (`rows` is for
+    /// logging only). A non-empty `dedupToken` (the batch's offset ranges) is sent hashed
+    /// as insert_deduplication_token (unless INSERT_DEDUP=0), so re-sending the same batch
+    /// is a no-op on the server. Rows re-batched differently after a restart are not.
+    /// Blocks until done; throws on transport errors and non-2xx responses.
+    void send(const ChunkedBuffer& body, std::size_t rows, const std::string& dedupToken = {});
+
+    /// Non-blocking variant of send() on `lane`: starts the insert; `body` must outlive it.
+    /// Only one insert per lane can be in flight.
+    void startSend(std::size_t lane, const ChunkedBuffer& body, std::size_t rows,
+                   const std::string& dedupToken = {});
+
+    /// Drives the lane's in-flight insert, waiting up to `timeout` for socket activity on
+    /// any lane. Returns the classified outcome once it completed (Ok if nothing is in
+    /// flight), nullopt while it is still running. Only setup failures throw.
+    std::optional<InsertResult> pollSend(std::size_t lane, std::chrono::milliseconds timeout);
+
+    bool sending(std::size_t lane) const { return active_.at(lane) != nullptr; }
 private:
-    std::string url_{};
+    struct Transfer;
+
+    std::vector<std::string> urls_;             // one per lane, INSERT query included
+    InsertFormat format_{InsertFormat::JSONEachRow};
+    bool kafkaColumns_{false};
+    bool aggregate_{false};
+    bool dedup_{true};
+    Codec codec_{Codec::None};
+    int level_{-1}; // codec default
+    CURLM* multi_{nullptr};                     // shared by all lanes
+    std::vector<std::unique_ptr<Transfer>> active_; // per lane
+
 };
 
 // ---------------------------------------------------------------------------
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "aggregate.h"
+#include "buffer.h"
+#include "offsets.h"
+
+// Encoded rows plus the Kafka offsets they cover
+struct Batch {
+    ChunkedBuffer body;
+    std::size_t rows = 0;
+    OffsetTracker offsets;
+    std::size_t spilled = 0; // spill-log records replayed by this batch (released once inserted)
+    std::unique_ptr<AggregateMap> aggregate; // INSERT_AGGREGATE: summed rows, encoded by seal()
+
+    // Where an appended part starts in `body`; each part is a valid insert on its own
+    // (whole JSON lines, RowBinary rows or Native blocks), so split() may cut there.
+    struct Cut {
+        std::size_t bytes;
+        std::size_t rows;
+    };
+    std::vector<Cut> cuts;
+
+    /// Moves `other` to the end of this batch (no copy of the encoded bytes).
+    void append(Batch&& other) {
+        if (!body.empty() && !other.body.empty()) cuts.push_back(Cut{body.size(), rows});
+        for (auto const& c : other.cuts) cuts.push_back(Cut{body.size() + c.bytes, rows + c.rows});
+        body.splice(std::move(other.body));
+        rows += other.rows;
+        offsets.merge(other.offsets);
+        spilled += other.spilled;
+        if (other.aggregate) {
+            if (aggregate) aggregate->merge(*other.aggregate);
+            else aggregate = std::move(other.aggregate);
+            other.aggregate.reset();
+        }
+        other.rows = 0;
+        other.offsets.clear();
+        other.spilled = 0;
+        other.cuts.clear();
+    }
+
+    /// Moves the parts from the cut nearest the middle onwards into the returned batch,
+    /// which also takes the offsets and spill records: they are done only once that last
+    /// part is in. Copies the bytes (rare path: a request the server found too large).
+    /// Returns a batch with an empty body if this one is a single part. Call after seal().
+    Batch split() {
+        Batch tail;
+        if (cuts.empty()) return tail;
+        const std::size_t half = body.size() / 2;
+        const auto distance = [half](const Cut& c) { return c.bytes > half ? c.bytes - half : half - c.bytes; };
+        const auto at = std::min_element(cuts.begin(), cuts.end(),
+                                         [&](const Cut& a, const Cut& b) { return distance(a) < distance(b); });
+        const Cut cut = *at;
+
+        ChunkedBuffer head;
+        ChunkedBufferReader reader(body);
+        while (reader.position() < cut.bytes) head.append(reader.next(cut.bytes - reader.position()));
+        for (auto part = reader.next(std::numeric_limits<std::size_t>::max()); !part.empty();
+             part = reader.next(std::numeric_limits<std::size_t>::max()))
+            tail.body.append(part);
+        for (auto it = at + 1; it != cuts.end(); ++it)
+            tail.cuts.push_back(Cut{it->bytes - cut.bytes, it->rows - cut.rows});
+        cuts.erase(at, cuts.end());
+        body = std::move(head);
+
+        tail.rows = rows - cut.rows;
+        rows = cut.rows;
+        tail.offsets.merge(offsets);
+        offsets.clear();
+        tail.spilled = std::exchange(spilled, 0);
+        return tail;
+    }
+
+    bool empty() const { return rows == 0; }
+
+    /// Memory held by the batch, aggregate included.
+    std::size_t bytes() const { return body.size() + (aggregate ? aggregate->bytes() : 0); }
+
+    /// Encodes the aggregate (if any) into `body`; call before sending or spilling.
+    void seal(InsertFormat format) {
+        if (!aggregate) return;
+        body.splice(encodeAggregates(*aggregate, format));
+        aggregate.reset();
+    }
+};
@@ -0,0 +1,79 @@
+#include "buffer.h"
+
+#include <algorithm>
+
+void ChunkedBuffer::addChunk(std::size_t hint) {
+    Chunk c;
+    c.capacity = std::max(chunkSize_, hint);
+    c.data.reset(new char[c.capacity]);
+    chunks_.push_back(std::move(c));
+}
+
+void ChunkedBuffer::splice(ChunkedBuffer&& other) {
+    if (&other == this) return;
+    chunks_.reserve(chunks_.size() + other.chunks_.size());
+    for (auto& c : other.chunks_)
+        chunks_.push_back(std::move(c));
+    size_ += other.size_;
+    other.chunks_.clear();
+    other.size_ = 0;
+}
+
+void ChunkedBuffer::clear() {
+    chunks_.clear();
+    size_ = 0;
+}
+
+std::string ChunkedBuffer::toString() const {
+    std::string out;
+    out.reserve(size_);
+    forEachChunk([&](const char* p, std::size_t n) { out.append(p, n); });
+    return out;
+}
+
+std::size_t ChunkedBufferReader::read(char* dst, std::size_t n) {
+    std::size_t copied = 0;
+    auto const& chunks = buf_->chunks_;
+    while (copied < n && chunk_ < chunks.size()) {
+        auto const& c = chunks[chunk_];
+        std::size_t take = std::min(n - copied, c.size - offset_);
+        std::memcpy(dst + copied, c.data.get() + offset_, take);
+        copied += take;
+        offset_ += take;
+        if (offset_ == c.size) {
+            ++chunk_;
+            offset_ = 0;
+        }
+    }
+    position_ += copied;
+    return copied;
+}
+
+std::string_view ChunkedBufferReader::next(std::size_t max) {
+    auto const& chunks = buf_->chunks_;
+    while (chunk_ < chunks.size() && offset_ == chunks[chunk_].size) {
+        ++chunk_;
+        offset_ = 0;
+    }
+    if (chunk_ == chunks.size()) return {};
+    auto const& c = chunks[chunk_];
+    std::size_t take = std::min(max, c.size - offset_);
+    std::string_view view(c.data.get() + offset_, take);
+    offset_ += take;
+    position_ += take;
+    return view;
+}
+
+bool ChunkedBufferReader::seek(std::size_t offset) {
+    if (offset > buf_->size()) return false;
+    chunk_ = 0;
+    offset_ = 0;
+    position_ = offset;
+    auto const& chunks = buf_->chunks_;
+    while (chunk_ < chunks.size() && offset >= chunks[chunk_].size) {
+        offset -= chunks[chunk_].size;
+        ++chunk_;
+    }
+    offset_ = offset;
+    return true;
+}
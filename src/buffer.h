@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Append-only byte buffer made of fixed-size chunks. Growing never moves bytes already
+// written (unlike std::string), and whole buffers can be spliced without copying, so a
+// batch costs roughly its encoded size in memory.
+class ChunkedBuffer {
+public:
+    static constexpr std::size_t kDefaultChunkSize = 256 * 1024;
+
+    explicit ChunkedBuffer(std::size_t chunkSize = kDefaultChunkSize) : chunkSize_(chunkSize) {}
+
+    ChunkedBuffer(ChunkedBuffer&&) noexcept = default;
+    ChunkedBuffer& operator=(ChunkedBuffer&&) noexcept = default;
+    ChunkedBuffer(const ChunkedBuffer&) = delete;
+    ChunkedBuffer& operator=(const ChunkedBuffer&) = delete;
+
+    void append(const char* data, std::size_t n) {
+        while (n > 0) {
+            if (chunks_.empty() || chunks_.back().size == chunks_.back().capacity)
+                addChunk(n);
+            Chunk& c = chunks_.back();
+            std::size_t take = std::min(n, c.capacity - c.size);
+            std::memcpy(c.data.get() + c.size, data, take);
+            c.size += take;
+            size_ += take;
+            data += take;
+            n -= take;
+        }
+    }
+
+    void append(std::string_view s) { append(s.data(), s.size()); }
+
+    void push_back(char c) { append(&c, 1); }
+
+    /// Returns `n` contiguous writable bytes at the end (starting a new chunk if the current
+    /// one is too short); commit() then makes the first bytes written part of the buffer.
+    char* prepare(std::size_t n) {
+        if (chunks_.empty() || chunks_.back().capacity - chunks_.back().size < n)
+            addChunk(n);
+        Chunk& c = chunks_.back();
+        return c.data.get() + c.size;
+    }
+
+    /// Accepts `n` bytes written at the pointer returned by the last prepare().
+    void commit(std::size_t n) {
+        chunks_.back().size += n;
+        size_ += n;
+    }
+
+    /// Moves all chunks of `other` to the end of this buffer without copying; `other` ends up empty.
+    void splice(ChunkedBuffer&& other);
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// Releases all chunks.
+    void clear();
+
+    /// Calls `fn(const char* data, std::size_t len)` for each non-empty chunk in order.
+    template <typename Fn>
+    void forEachChunk(Fn&& fn) const {
+        for (auto const& c : chunks_)
+            if (c.size) fn(static_cast<const char*>(c.data.get()), c.size);
+    }
+
+    /// Copies the whole content into one string (tests and diagnostics only).
+    std::string toString() const;
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        std::size_t size = 0;
+        std::size_t capacity = 0;
+    };
+
+    void addChunk(std::size_t hint);
+
+    std::vector<Chunk> chunks_;
+    std::size_t chunkSize_;
+    std::size_t size_ = 0;
+
+    friend class ChunkedBufferReader;
+};
+
+// Sequential cursor over a ChunkedBuffer, e.g. to feed a curl read callback.
+class ChunkedBufferReader {
+public:
+    explicit ChunkedBufferReader(const ChunkedBuffer& buf) : buf_(&buf) {}
+
+    /// Copies up to `n` bytes into `dst`; returns 0 at the end.
+    std::size_t read(char* dst, std::size_t n);
+
+    /// Returns up to `max` bytes at the cursor without copying (never crosses a chunk
+    /// boundary) and advances past them; empty at the end.
+    std::string_view next(std::size_t max);
+
+    /// Repositions the cursor at absolute `offset`; returns false if out of range.
+    bool seek(std::size_t offset);
+
+    std::size_t position() const { return position_; }
+
+private:
+    const ChunkedBuffer* buf_;
+    std::size_t chunk_ = 0;
+    std::size_t offset_ = 0;   // within chunk_
+    std::size_t position_ = 0; // absolute
+};
@@ -0,0 +1,191 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <zlib.h>
+#ifdef ANONYMIZER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ANONYMIZER_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+Codec parseCodec(std::string_view name) {
+    if (name.empty() || name == "none") return Codec::None;
+    if (name == "gzip") return Codec::Gzip;
+    if (name == "zstd") {
+#ifdef ANONYMIZER_WITH_ZSTD
+        return Codec::Zstd;
+#else
+        throw std::runtime_error("INSERT_COMPRESSION=zstd: built without libzstd");
+#endif
+    }
+    if (name == "lz4") {
+#ifdef ANONYMIZER_WITH_LZ4
+        return Codec::Lz4;
+#else
+        throw std::runtime_error("INSERT_COMPRESSION=lz4: built without liblz4");
+#endif
+    }
+    throw std::runtime_error("Unknown INSERT_COMPRESSION: " + std::string(name));
+}
+
+const char* contentEncoding(Codec codec) {
+    switch (codec) {
+        case Codec::None: return nullptr;
+        case Codec::Gzip: return "gzip";
+        case Codec::Zstd: return "zstd";
+        case Codec::Lz4: return "lz4";
+    }
+    return nullptr;
+}
+
+namespace {
+
+class GzipCompressor final : public Compressor {
+public:
+    explicit GzipCompressor(int level) {
+        // 15 window bits + 16 selects the gzip wrapper
+        if (deflateInit2(&zs_, level < 0 ? 3 : level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+    }
+    ~GzipCompressor() override { deflateEnd(&zs_); }
+
+    void update(const char* data, std::size_t n, bool last, std::string& out) override {
+        zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs_.avail_in = static_cast<uInt>(n);
+        const int flush = last ? Z_FINISH : Z_NO_FLUSH;
+        int rc;
+        do {
+            char buf[64 * 1024];
+            zs_.next_out = reinterpret_cast<Bytef*>(buf);
+            zs_.avail_out = sizeof(buf);
+            rc = deflate(&zs_, flush);
+            if (rc == Z_STREAM_ERROR) throw std::runtime_error("deflate failed");
+            out.append(buf, sizeof(buf) - zs_.avail_out);
+        } while (zs_.avail_out == 0 || (last && rc != Z_STREAM_END));
+    }
+
+private:
+    z_stream zs_{};
+};
+
+#ifdef ANONYMIZER_WITH_ZSTD
+class ZstdCompressor final : public Compressor {
+public:
+    explicit ZstdCompressor(int level) : cctx_(ZSTD_createCCtx()) {
+        if (!cctx_) throw std::runtime_error("ZSTD_createCCtx failed");
+        ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level < 0 ? 3 : level);
+    }
+    ~ZstdCompressor() override { ZSTD_freeCCtx(cctx_); }
+
+    void update(const char* data, std::size_t n, bool last, std::string& out) override {
+        ZSTD_inBuffer in{data, n, 0};
+        const ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+        std::size_t remaining;
+        do {
+            char buf[64 * 1024];
+            ZSTD_outBuffer ob{buf, sizeof(buf), 0};
+            remaining = ZSTD_compressStream2(cctx_, &ob, &in, mode);
+            if (ZSTD_isError(remaining))
+                throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(remaining));
+            out.append(buf, ob.pos);
+        } while (last ? remaining != 0 : in.pos < in.size);
+    }
+
+private:
+    ZSTD_CCtx* cctx_;
+};
+#endif
+
+#ifdef ANONYMIZER_WITH_LZ4
+class Lz4Compressor final : public Compressor {
+public:
+    explicit Lz4Compressor(int level) {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&ctx_, LZ4F_VERSION)))
+            throw std::runtime_error("LZ4F_createCompressionContext failed");
+        prefs_.compressionLevel = level < 0 ? 0 : level;
+    }
+    ~Lz4Compressor() override { LZ4F_freeCompressionContext(ctx_); }
+
+    void update(const char* data, std::size_t n, bool last, std::string& out) override {
+        if (!started_) {
+            char header[LZ4F_HEADER_SIZE_MAX];
+            check(LZ4F_compressBegin(ctx_, header, sizeof(header), &prefs_), out, header);
+            started_ = true;
+        }
+        if (n) {
+            scratch_.resize(LZ4F_compressBound(n, &prefs_));
+            check(LZ4F_compressUpdate(ctx_, scratch_.data(), scratch_.size(), data, n, nullptr), out,
+                  scratch_.data());
+        }
+        if (last) {
+            scratch_.resize(LZ4F_compressBound(0, &prefs_));
+            check(LZ4F_compressEnd(ctx_, scratch_.data(), scratch_.size(), nullptr), out, scratch_.data());
+        }
+    }
+
+private:
+    static void check(std::size_t rc, std::string& out, const char* buf) {
+        if (LZ4F_isError(rc))
+            throw std::runtime_error(std::string("lz4: ") + LZ4F_getErrorName(rc));
+        out.append(buf, rc);
+    }
+
+    LZ4F_cctx* ctx_ = nullptr;
+    LZ4F_preferences_t prefs_{};
+    std::string scratch_;
+    bool started_ = false;
+};
+#endif
+
+} // namespace
+
+std::unique_ptr<Compressor> makeCompressor(Codec codec, int level) {
+    switch (codec) {
+        case Codec::None: return nullptr;
+        case Codec::Gzip: return std::make_unique<GzipCompressor>(level);
+#ifdef ANONYMIZER_WITH_ZSTD
+        case Codec::Zstd: return std::make_unique<ZstdCompressor>(level);
+#endif
+#ifdef ANONYMIZER_WITH_LZ4
+        case Codec::Lz4: return std::make_unique<Lz4Compressor>(level);
+#endif
+        default: break;
+    }
+    throw std::runtime_error("Unsupported compression codec");
+}
+
+// ---------------------------------------------------------------------------
+// CompressingReader
+
+CompressingReader::CompressingReader(const ChunkedBuffer& body, Codec codec, int level)
+    : body_(&body), codec_(codec), level_(level), input_(body),
+      compressor_(makeCompressor(codec, level)) {
+    if (!compressor_) throw std::runtime_error("CompressingReader needs a codec");
+}
+
+std::size_t CompressingReader::read(char* dst, std::size_t n) {
+    while (outPos_ == out_.size() && !finished_) {
+        out_.clear();
+        outPos_ = 0;
+        std::string_view in = input_.next(kInputSlice);
+        finished_ = input_.position() == body_->size();
+        compressor_->update(in.data(), in.size(), finished_, out_);
+    }
+    std::size_t take = std::min(n, out_.size() - outPos_);
+    std::copy_n(out_.data() + outPos_, take, dst);
+    outPos_ += take;
+    produced_ += take;
+    return take;
+}
+
+void CompressingReader::rewind() {
+    input_.seek(0);
+    compressor_ = makeCompressor(codec_, level_);
+    out_.clear();
+    outPos_ = 0;
+    produced_ = 0;
+    finished_ = false;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "buffer.h"
+
+// Streaming compression of insert bodies (HTTP Content-Encoding understood by ClickHouse)
+
+enum class Codec { None, Gzip, Zstd, Lz4 };
+
+// Parses INSERT_COMPRESSION values: none, gzip, zstd, lz4. Throws on unknown codecs and
+// on codecs this binary was built without.
+Codec parseCodec(std::string_view name);
+
+// Value for the Content-Encoding header; nullptr for Codec::None
+const char* contentEncoding(Codec codec);
+
+class Compressor {
+public:
+    virtual ~Compressor() = default;
+
+    /// Compresses `n` bytes and appends whatever output is ready to `out`.
+    /// The call with `last == true` flushes and closes the frame.
+    virtual void update(const char* data, std::size_t n, bool last, std::string& out) = 0;
+};
+
+// `level < 0` selects the codec's default. Returns nullptr for Codec::None.
+std::unique_ptr<Compressor> makeCompressor(Codec codec, int level = -1);
+
+// Pull-style reader producing the compressed form of a ChunkedBuffer piece by piece,
+// so the compressed body never exists in full. Only rewinding to the start is supported.
+class CompressingReader {
+public:
+    CompressingReader(const ChunkedBuffer& body, Codec codec, int level);
+
+    /// Copies up to `n` compressed bytes into `dst`; returns 0 at the end.
+    std::size_t read(char* dst, std::size_t n);
+
+    /// Restarts compression from the beginning of the body.
+    void rewind();
+
+    /// Uncompressed bytes consumed / compressed bytes produced so far.
+    std::size_t consumed() const { return input_.position(); }
+    std::size_t produced() const { return produced_; }
+
+private:
+    static constexpr std::size_t kInputSlice = 64 * 1024;
+
+    const ChunkedBuffer* body_;
+    Codec codec_;
+    int level_;
+    ChunkedBufferReader input_;
+    std::unique_ptr<Compressor> compressor_;
+    std::string out_;
+    std::size_t outPos_ = 0;
+    std::size_t produced_ = 0;
+    bool finished_ = false;
+};
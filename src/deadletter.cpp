@@ -0,0 +1,165 @@
+#include "deadletter.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <librdkafka/rdkafkacpp.h>
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace {
+
+void base64Append(std::string& out, std::string_view in) {
+    static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::size_t i = 0;
+    for (; i + 2 < in.size(); i += 3) {
+        const std::uint32_t v = (static_cast<unsigned char>(in[i]) << 16) |
+                                (static_cast<unsigned char>(in[i + 1]) << 8) | static_cast<unsigned char>(in[i + 2]);
+        out += kAlphabet[v >> 18];
+        out += kAlphabet[(v >> 12) & 63];
+        out += kAlphabet[(v >> 6) & 63];
+        out += kAlphabet[v & 63];
+    }
+    if (i < in.size()) {
+        std::uint32_t v = static_cast<unsigned char>(in[i]) << 16;
+        if (i + 1 < in.size()) v |= static_cast<unsigned char>(in[i + 1]) << 8;
+        out += kAlphabet[v >> 18];
+        out += kAlphabet[(v >> 12) & 63];
+        out += i + 1 < in.size() ? kAlphabet[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+}
+
+} // namespace
+
+DeadLetterConfig DeadLetterConfig::fromEnv() {
+    DeadLetterConfig c;
+    c.topic = getEnvOrDefault("DEAD_LETTER_TOPIC", "");
+    c.path = getEnvOrDefault("DEAD_LETTER_FILE", "");
+    if (!c.topic.empty()) c.brokers = getRequiredEnv("KAFKA_BROKERS");
+    return c;
+}
+
+std::string deadLetterJson(const DeadLetter& letter) {
+    std::string out = "{\"topic\":\"";
+    escape_json_append(out, letter.topic);
+    out += "\",\"partition\":" + std::to_string(letter.partition) + ",\"offset\":" + std::to_string(letter.offset);
+    out += ",\"error\":\"";
+    escape_json_append(out, letter.error);
+    out += "\",\"key_base64\":\"";
+    base64Append(out, letter.key);
+    out += "\",\"payload_base64\":\"";
+    base64Append(out, letter.payload);
+    out += "\"}";
+    return out;
+}
+
+class DeadLetters::DeliveryReport : public RdKafka::DeliveryReportCb {
+public:
+    void dr_cb(RdKafka::Message& message) override {
+        if (message.err() == RdKafka::ERR_NO_ERROR) return;
+        spdlog::error("Dead letter not delivered: {}", message.errstr());
+        ++failed;
+    }
+
+    std::atomic<std::size_t> failed{0}; // since start
+};
+
+DeadLetters::DeadLetters(DeadLetterConfig config) : config_(std::move(config)) {
+    if (!config_.topic.empty()) {
+        std::string err;
+        std::unique_ptr<RdKafka::Conf> conf(RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL));
+        report_ = std::make_unique<DeliveryReport>();
+        if (conf->set("bootstrap.servers", config_.brokers, err) != RdKafka::Conf::CONF_OK ||
+            conf->set("dr_cb", report_.get(), err) != RdKafka::Conf::CONF_OK)
+            throw std::runtime_error("Dead-letter producer: " + err);
+        // rare and small: no reason to hold them back
+        conf->set("linger.ms", "10", err);
+        // give up on a letter (delivery report) before flush() gives up waiting
+        conf->set("message.timeout.ms", std::to_string(config_.deliveryTimeout.count()), err);
+        producer_.reset(RdKafka::Producer::create(conf.get(), err));
+        if (!producer_) throw std::runtime_error("Dead-letter producer create failed: " + err);
+    }
+    if (!config_.path.empty()) {
+        file_ = std::fopen(config_.path.c_str(), "a");
+        if (!file_)
+            throw std::runtime_error("Dead-letter file " + config_.path + ": " + std::strerror(errno));
+    }
+    if (producer_ || file_)
+        spdlog::info("Dead letters go to{}{}{}{}", producer_ ? " topic " : "", config_.topic,
+                     file_ ? " file " : "", config_.path);
+}
+
+DeadLetters::~DeadLetters() {
+    if (producer_) producer_->flush(10'000);
+    if (file_) std::fclose(file_);
+}
+
+void DeadLetters::write(const DeadLetter& letter) {
+    metrics().deadLetters.inc();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++written_;
+
+    // one bad producer can send many: a line per second, with how many were not logged
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastLog_ >= std::chrono::seconds(1)) {
+        spdlog::warn("Dead letter {}:{}:{}: {}{}", letter.topic, letter.partition, letter.offset, letter.error,
+                     suppressed_ ? " (" + std::to_string(suppressed_) + " more since the last one)" : "");
+        lastLog_ = now;
+        suppressed_ = 0;
+    } else {
+        ++suppressed_;
+    }
+
+    if (producer_) {
+        std::unique_ptr<RdKafka::Headers> headers(RdKafka::Headers::create());
+        headers->add("source_topic", std::string(letter.topic));
+        headers->add("source_partition", std::to_string(letter.partition));
+        headers->add("source_offset", std::to_string(letter.offset));
+        headers->add("error", std::string(letter.error));
+        for (;;) {
+            const auto rc = producer_->produce(
+                config_.topic, RdKafka::Producer::PARTITION_UA, RdKafka::Producer::RK_MSG_COPY,
+                const_cast<char*>(letter.payload.data()), letter.payload.size(),
+                letter.key.empty() ? nullptr : letter.key.data(), letter.key.size(), 0, headers.get(), nullptr);
+            if (rc == RdKafka::ERR_NO_ERROR) {
+                headers.release(); // owned by librdkafka now
+                break;
+            }
+            if (rc != RdKafka::ERR__QUEUE_FULL)
+                throw std::runtime_error("Dead-letter produce: " + RdKafka::err2str(rc));
+            producer_->poll(100);
+        }
+        producer_->poll(0);
+    }
+    if (file_) {
+        const std::string line = deadLetterJson(letter) + '\n';
+        if (std::fwrite(line.data(), 1, line.size(), file_) != line.size())
+            throw std::runtime_error("Dead-letter file " + config_.path + ": " + std::strerror(errno));
+    }
+}
+
+void DeadLetters::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (lost_.empty() && producer_) {
+        const auto wait = config_.deliveryTimeout + std::chrono::seconds(5);
+        if (producer_->flush(static_cast<int>(wait.count())) != RdKafka::ERR_NO_ERROR)
+            throw std::runtime_error("Dead letters not delivered to " + config_.topic + " within " +
+                                     std::to_string(wait.count()) + " ms");
+        if (const std::size_t failed = report_->failed.load())
+            lost_ = std::to_string(failed) + " dead letter(s) not delivered to " + config_.topic;
+    }
+    if (lost_.empty() && file_ && (std::fflush(file_) != 0 || ::fsync(::fileno(file_)) != 0))
+        lost_ = "Dead-letter file " + config_.path + ": " + std::strerror(errno);
+    if (!lost_.empty()) throw std::runtime_error(lost_);
+}
+
+std::size_t DeadLetters::written() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return written_;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace RdKafka {
+class Producer;
+}
+
+// ---------------------------------------------------------------------------
+// Dead letters: Kafka messages with a record that does not decode or fails validation
+// (transformPayload).
+// Instead of failing the worker (and crash-looping on the same uncommitted message after
+// every restart), the pipeline writes them here and counts their offsets as processed.
+//
+// DEAD_LETTER_TOPIC sends each one to a Kafka topic on KAFKA_BROKERS: original key and
+// payload, source topic/partition/offset and the error in headers. DEAD_LETTER_FILE
+// appends one JSON line each (payload base64). With neither set they are only logged and
+// counted (anonymizer_dead_letters_total).
+
+struct DeadLetterConfig {
+    std::string topic;    // Kafka topic; empty: not sent
+    std::string brokers;  // for `topic`
+    std::string path;     // file appended to; empty: not written
+    std::chrono::milliseconds deliveryTimeout{30'000}; // per letter to `topic` (message.timeout.ms)
+
+    /// DEAD_LETTER_TOPIC (with KAFKA_BROKERS), DEAD_LETTER_FILE
+    static DeadLetterConfig fromEnv();
+};
+
+struct DeadLetter {
+    std::string_view topic;
+    std::int32_t partition = 0;
+    std::int64_t offset = 0;
+    std::string_view key;
+    std::string_view payload;
+    std::string_view error;
+};
+
+class DeadLetters {
+public:
+    explicit DeadLetters(DeadLetterConfig config);
+    ~DeadLetters();
+
+    DeadLetters(const DeadLetters&) = delete;
+    DeadLetters& operator=(const DeadLetters&) = delete;
+
+    /// Records one rejected message. Thread-safe; logs at most one line per second.
+    void write(const DeadLetter& letter);
+
+    /// Waits until every letter written so far is delivered to the topic and on disk in
+    /// the file. Call before committing the offsets they came from; throws if one could
+    /// not be delivered, so those offsets are not committed. A lost letter cannot be sent
+    /// again (its payload is gone), so from then on every flush() throws: only a restart,
+    /// re-consuming from the last commit, writes it again.
+    void flush();
+
+    /// Letters written since start.
+    std::size_t written() const;
+
+private:
+    class DeliveryReport;
+
+    DeadLetterConfig config_;
+    mutable std::mutex mutex_;
+    std::unique_ptr<DeliveryReport> report_; // outlives producer_
+    std::unique_ptr<RdKafka::Producer> producer_;
+    std::FILE* file_ = nullptr;
+    std::size_t written_ = 0;
+    std::string lost_;                       // why a letter was lost; flush() keeps throwing it
+    std::size_t suppressed_ = 0;             // not logged since lastLog_
+    std::chrono::steady_clock::time_point lastLog_;
+};
+
+/// JSON line DEAD_LETTER_FILE holds for `letter` (no trailing newline).
+std::string deadLetterJson(const DeadLetter& letter);
@@ -0,0 +1,81 @@
+#include "decoder.h"
+#include "frames.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+capnp::ReaderOptions httpLogReaderOptions() {
+    capnp::ReaderOptions options;
+    // 1 MiB per message: far above any real record (URLs are at most a few KB),
+    // far below the 64 MiB library default.
+    options.traversalLimitInWords = (1u << 20) / sizeof(capnp::word);
+    // root struct -> Text is depth 2; leave headroom for schema growth
+    options.nestingLimit = 8;
+    return options;
+}
+
+RecordDecoder::RecordDecoder(capnp::ReaderOptions options) : options_(options) {}
+
+kj::ArrayPtr<const capnp::word> RecordDecoder::words(const void* payload, std::size_t len) {
+    const auto addr = reinterpret_cast<std::uintptr_t>(payload);
+    if (addr % alignof(capnp::word) == 0 && len % sizeof(capnp::word) == 0) {
+        return kj::arrayPtr(static_cast<const capnp::word*>(payload), len / sizeof(capnp::word));
+    }
+
+    const std::size_t words = (len + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+    if (words == 0) return nullptr;
+    if (arena_.size() < words) {
+        std::size_t grow = arena_.size() ? arena_.size() : 64;
+        while (grow < words) grow *= 2;
+        arena_ = kj::heapArray<capnp::word>(grow);
+    }
+    // zero the padding of the last word so a short payload reads like before
+    std::memset(static_cast<void*>(arena_.begin() + words - 1), 0, sizeof(capnp::word));
+    std::memcpy(static_cast<void*>(arena_.begin()), payload, len);
+    ++copies_;
+    return kj::arrayPtr(static_cast<const capnp::word*>(arena_.begin()), words);
+}
+
+const std::vector<kj::ArrayPtr<const capnp::word>>& RecordDecoder::messages(const void* payload, std::size_t len) {
+    // framed messages are whole words and their segment tables add up to the payload; a
+    // packed payload starts with a tag byte, which reads as an absurd segment count
+    if (len % sizeof(capnp::word) == 0 && split(words(payload, len))) return messages_;
+    // garbage full of zero runs must not expand to a gigabyte: a few times the payload at
+    // most, and the buffer is dropped once refused so it does not stay at the limit
+    const std::size_t maxWords =
+        std::max<std::size_t>(options_.traversalLimitInWords, kMaxPackRatio * len / sizeof(capnp::word));
+    if (!unpackCapnp(static_cast<const char*>(payload), len, packed_, maxWords) ||
+        !split(kj::arrayPtr(reinterpret_cast<const capnp::word*>(packed_.data()), packed_.size()))) {
+        std::vector<std::uint64_t>().swap(packed_);
+        throw std::runtime_error("payload is neither framed nor packed capnp messages (at most " +
+                                 std::to_string(maxWords * sizeof(capnp::word)) + " bytes unpacked)");
+    }
+    ++packedPayloads_;
+    return messages_;
+}
+
+bool RecordDecoder::split(kj::ArrayPtr<const capnp::word> words) {
+    messages_.clear();
+    const char* data = reinterpret_cast<const char*>(words.begin());
+    std::size_t left = words.size() * sizeof(capnp::word);
+    while (left > 0) {
+        const std::size_t size = capnpMessageSize(data, left);
+        if (size == 0) {
+            messages_.clear();
+            return false;
+        }
+        messages_.push_back(kj::arrayPtr(reinterpret_cast<const capnp::word*>(data), size / sizeof(capnp::word)));
+        data += size;
+        left -= size;
+    }
+    return !messages_.empty();
+}
+
+capnp::ReaderOptions RecordDecoder::options(kj::ArrayPtr<const capnp::word> message) const {
+    capnp::ReaderOptions options = options_;
+    options.traversalLimitInWords = std::max<std::uint64_t>(options.traversalLimitInWords, 2 * message.size());
+    return options;
+}
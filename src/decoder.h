@@ -0,0 +1,54 @@
+#pragma once
+
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/array.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Reader limits sized for HttpLogRecord: one flat struct with four Text fields.
+// Tight limits make a hostile payload fail fast instead of walking megabytes of pointers.
+capnp::ReaderOptions httpLogReaderOptions();
+
+// Turns a Kafka payload into the word array FlatArrayMessageReader wants, without a
+// per-message allocation: word-aligned payloads are read in place, others are copied
+// into an arena that is reused (and only grown) across calls.
+// Not thread-safe: keep one decoder per thread. The returned view is valid until the
+// next call or until the payload is released.
+class RecordDecoder {
+public:
+    explicit RecordDecoder(capnp::ReaderOptions options = httpLogReaderOptions());
+
+    kj::ArrayPtr<const capnp::word> words(const void* payload, std::size_t len);
+
+    /// Splits a Kafka payload into its capnp messages: one or more standard-framed messages
+    /// back to back, as is or capnp-packed (writePackedMessage). Throws if the payload is
+    /// neither. Valid like words(); options(message) gives the reader options for each.
+    const std::vector<kj::ArrayPtr<const capnp::word>>& messages(const void* payload, std::size_t len);
+
+    const capnp::ReaderOptions& options() const { return options_; }
+
+    /// options() with the traversal limit raised to read all of `message` (an envelope of
+    /// many records) but not much more.
+    capnp::ReaderOptions options(kj::ArrayPtr<const capnp::word> message) const;
+
+    /// Number of payloads that needed the arena copy (for diagnostics).
+    std::size_t copies() const { return copies_; }
+
+    /// Number of payloads that were packed and needed unpacking (for diagnostics).
+    std::size_t packedPayloads() const { return packedPayloads_; }
+
+private:
+    static constexpr std::size_t kMaxPackRatio = 4; // unpacked bytes per packed byte, at most
+
+    bool split(kj::ArrayPtr<const capnp::word> words);
+
+    capnp::ReaderOptions options_;
+    kj::Array<capnp::word> arena_;
+    std::vector<std::uint64_t> packed_; // unpacked words of the last packed payload
+    std::vector<kj::ArrayPtr<const capnp::word>> messages_;
+    std::size_t copies_ = 0;
+    std::size_t packedPayloads_ = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "buffer.h"
+#include "http_log_row.h" // LogRow, generated from http_log.capnp (cmake/RowCodegen.cmake)
+
+// Batch encoders for ClickHouse inserts (no Kafka/capnp deps, unit-testable)
+
+enum class InsertFormat { JSONEachRow, RowBinary, Native };
+
+// Parses INSERT_FORMAT values (case-insensitive): JSONEachRow|json, RowBinary, Native. Throws on unknown.
+InsertFormat parseInsertFormat(std::string_view name);
+
+// Name used in the `FORMAT` clause of the INSERT query
+const char* insertFormatName(InsertFormat format);
+
+// Column list every encoder writes, in schema order (`ingested_at` is left to its DEFAULT)
+extern const char* const kInsertColumns;
+
+// Appended to kInsertColumns by encoders created with `kafkaColumns`
+extern const char* const kKafkaColumns;
+
+// ---------------------------------------------------------------------------
+// Accumulates rows of one batch and produces the HTTP request body.
+class BatchEncoder {
+public:
+    explicit BatchEncoder(bool kafkaColumns = false) : kafkaColumns_(kafkaColumns) {}
+    virtual ~BatchEncoder() = default;
+
+    virtual InsertFormat format() const = 0;
+
+    virtual void append(const LogRow& row) = 0;
+
+    /// Rows appended since the last finish().
+    std::size_t rows() const { return rows_; }
+
+    /// Encoded bytes held so far (approximate for columnar formats until finish()).
+    virtual std::size_t bytes() const = 0;
+
+    /// Returns the encoded body and resets the encoder for the next batch.
+    virtual ChunkedBuffer finish() = 0;
+
+protected:
+    std::size_t rows_ = 0;
+    bool kafkaColumns_; // also write kafka_partition, kafka_offset
+};
+
+std::unique_ptr<BatchEncoder> makeEncoder(InsertFormat format, bool kafkaColumns = false);
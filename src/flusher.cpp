@@ -0,0 +1,167 @@
+#include "flusher.h"
+#include "metrics.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+void publishLimit(const BatchSizer& sizer) {
+    metrics().batchLimitBytes.set(static_cast<std::int64_t>(std::min<std::size_t>(sizer.limit(), INT64_MAX)));
+}
+
+} // namespace
+
+Flusher::Flusher(ClickHouseSink& sink, std::chrono::seconds flushEvery, InsertedFn inserted, BatchSizer sizer)
+    : sink_(sink), inserted_(std::move(inserted)),
+      schedule_(sink.lanes(), flushEvery, std::chrono::steady_clock::now()), sizer_(sizer),
+      lanes_(sink.lanes()) {
+    publishLimit(sizer_);
+}
+
+void Flusher::submit(Batch batch) {
+    const auto now = std::chrono::steady_clock::now();
+    const auto lane = schedule_.pick(now);
+    if (!lane) throw std::logic_error("no ClickHouse lane ready for a batch");
+    auto& l = lanes_[*lane];
+    l.batch = std::make_unique<Batch>(std::move(batch));
+    // same token on every retry of this batch (and on a spill replay, which keeps its ranges);
+    // rows re-consumed after a crash are batched anew and get another one
+    l.token = l.batch->offsets.identity();
+    l.firstRow = 0;
+    l.split = false;
+    l.seq = submitted_++;
+    schedule_.assign(*lane, now);
+    ++lanesBusy_;
+    step(*lane, 0ms);
+    deliver();
+}
+
+std::size_t Flusher::bytes() const {
+    std::size_t total = 0;
+    for (auto const& l : lanes_) {
+        if (l.batch) total += l.batch->bytes();
+        for (auto const& piece : l.rest) total += piece->bytes();
+    }
+    for (auto const& [seq, batch] : accepted_) total += batch->bytes();
+    return total;
+}
+
+void Flusher::poll(std::chrono::milliseconds timeout) {
+    // the lanes share the sink's multi handle: waiting on one wakes up on any transfer
+    for (std::size_t i = 0; i < lanes_.size(); ++i) {
+        if (!lanes_[i].batch) continue;
+        step(i, lanes_[i].transferring ? std::exchange(timeout, 0ms) : 0ms);
+    }
+    deliver();
+}
+
+void Flusher::step(std::size_t lane, std::chrono::milliseconds timeout) {
+    auto& l = lanes_[lane];
+    std::optional<InsertResult> result;
+    if (!l.transferring) {
+        const auto now = std::chrono::steady_clock::now();
+        if (!schedule_.due(lane, now)) return; // waiting for the lane's retry slot
+        schedule_.attempt(lane, now);
+        try {
+            sink_.startSend(lane, l.batch->body, l.batch->rows, l.sendToken());
+            l.transferring = true;
+            ++transferring_;
+        } catch (const std::exception &e) {
+            result = InsertResult{InsertStatus::NetworkError, 0, false, std::nullopt, e.what()};
+        }
+    }
+    if (!result) {
+        result = sink_.pollSend(lane, timeout);
+        if (!result) return;
+        l.transferring = false;
+        --transferring_;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> took = now - schedule_.attemptStarted(lane);
+    const auto retryAt = schedule_.completed(lane, now, *result);
+    auto& m = metrics();
+
+    if (result->ok()) {
+        if (lanes_.size() > 1)
+            spdlog::info("Flushed {} rows to ClickHouse (lane {})", l.batch->rows, lane);
+        else
+            spdlog::info("Flushed {} rows to ClickHouse", l.batch->rows);
+        m.inserts.inc();
+        m.batchRows.observe(static_cast<double>(l.batch->rows));
+        m.batchBytes.observe(static_cast<double>(l.batch->body.size()));
+        m.flushSeconds.observe(took.count());
+        sizer_.observe(l.batch->body.size(), took);
+        publishLimit(sizer_);
+        if (!l.rest.empty()) {
+            // next piece of a split batch; its offsets and spill records ride on the last one
+            l.firstRow += l.batch->rows;
+            l.batch = std::move(l.rest.back());
+            l.rest.pop_back();
+            schedule_.proceed(lane);
+            return;
+        }
+        accepted_.emplace(l.seq, std::move(l.batch));
+        --lanesBusy_;
+        return;
+    }
+
+    spdlog::error("ClickHouse insert failed ({}): {}", insertStatusName(result->status), result->message);
+    if (result->status == InsertStatus::ClientError) {
+        m.insertErrors.inc();
+        if (result->httpCode != 413)
+            throw std::runtime_error("ClickHouse refused the insert, not retrying it: " + result->message);
+        const std::size_t bytes = l.batch->body.size();
+        sizer_.tooLarge(bytes);
+        publishLimit(sizer_);
+        Batch tail = l.batch->split();
+        if (tail.body.empty())
+            throw std::runtime_error("insert of " + std::to_string(l.batch->rows) + " rows (" + std::to_string(bytes) +
+                                     " bytes) is too large for the server and cannot be split; raise its request "
+                                     "body limit (client_max_body_size on an nginx proxy)");
+        spdlog::warn("insert of {} bytes too large, split into {} + {} rows; resending at next slot", bytes,
+                     l.batch->rows, tail.rows);
+        l.rest.push_back(std::make_unique<Batch>(std::move(tail)));
+        l.split = true;
+        return;
+    }
+    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(retryAt - now);
+    if (result->status == InsertStatus::RateLimited) {
+        // the lane's window is not open yet: retry where it opens, not before
+        spdlog::info("proxy {} → retrying in {} ms at next slot{}", result->httpCode, wait.count(),
+                     result->retryAfter ? " (Retry-After)" : "");
+        m.rateLimited.inc();
+    } else {
+        if (result->timedOut) {
+            sizer_.timedOut(l.batch->body.size());
+            publishLimit(sizer_);
+        }
+        spdlog::info("retrying insert in {} ms", wait.count());
+        m.insertErrors.inc();
+    }
+    m.backoffMicros.inc(static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(retryAt - now).count()));
+}
+
+std::string Flusher::Lane::sendToken() const {
+    if (!split) return token;
+    return token + "/" + std::to_string(firstRow) + "+" + std::to_string(batch->rows);
+}
+
+void Flusher::deliver() {
+    while (!accepted_.empty() && accepted_.begin()->first == delivered_) {
+        auto batch = std::move(accepted_.begin()->second);
+        accepted_.erase(accepted_.begin());
+        ++delivered_;
+        try { inserted_(*batch); }
+        catch (const std::exception &e) { spdlog::error("commit failed: {}", e.what()); }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "anonymizer.h"
+#include "batch.h"
+#include "lanes.h"
+
+// ---------------------------------------------------------------------------
+// Owns the batches in flight to ClickHouse, at most one per sink lane (double
+// buffering: the caller keeps filling the next one meanwhile). Inserts are driven
+// through the sink's curl multi handle from poll(), so the owning thread never blocks
+// on HTTP and never sleeps through a backoff; a batch is retried on its lane until
+// accepted. LaneSchedule staggers the lanes' windows and learns where the proxy opens
+// them from the typed insert results; BatchSizer turns insert latency into the byte
+// size the caller should cap the next batch at.
+//
+// Client errors are not retried as is: a batch refused as too large (413) is split at a
+// part boundary and sent piece by piece on its lane (and BatchSizer caps later batches
+// below it); any other 4xx, or a 413 on a batch that cannot be split, throws from
+// poll()/submit() with the server's answer, failing the pipeline instead of looping.
+//
+// The `inserted` callback (offset commit, spill release) runs from poll() in submission
+// order: a batch accepted on one lane waits for those submitted before it on others, so
+// a commit never covers rows that are not in ClickHouse yet.
+class Flusher {
+public:
+    using InsertedFn = std::function<void(const Batch&)>;
+
+    Flusher(ClickHouseSink& sink, std::chrono::seconds flushEvery, InsertedFn inserted,
+            BatchSizer sizer = {});
+
+    /// No batch owned: everything submitted was inserted.
+    bool idle() const { return lanesBusy_ == 0 && accepted_.empty(); }
+
+    /// A transfer is on the wire (as opposed to waiting for its retry slot).
+    bool transferring() const { return transferring_ > 0; }
+
+    /// A lane is free and its window is open: a batch submitted now is sent right away.
+    bool ready(std::chrono::steady_clock::time_point now) const { return schedule_.pick(now).has_value(); }
+
+    /// Hands `batch` to the lane ready() found; sent right away, retried until accepted.
+    /// Throws std::logic_error if no lane is ready.
+    void submit(Batch batch);
+
+    /// Drives the batches in flight. While a transfer is active this waits up to `timeout`
+    /// for socket activity; otherwise it returns immediately. Throws std::runtime_error if
+    /// ClickHouse refuses a batch for good (see above).
+    void poll(std::chrono::milliseconds timeout);
+
+    /// When the next lane opens (or a busy one may retry).
+    std::chrono::steady_clock::time_point nextSlot() const { return schedule_.nextSlot(); }
+
+    /// Byte size a batch should stop growing at (BatchSizer).
+    std::size_t batchBytes() const { return sizer_.limit(); }
+
+    /// Bytes of the batches owned (in flight or waiting for delivery).
+    std::size_t bytes() const;
+
+private:
+    struct Lane {
+        std::unique_ptr<Batch> batch;
+        std::vector<std::unique_ptr<Batch>> rest; // split off `batch` by a 413, sent after it (back first)
+        std::string token;    // insert deduplication token of the submitted batch
+        std::size_t firstRow = 0; // of `batch` within the submitted one, once split
+        bool split = false;
+        std::uint64_t seq = 0;
+        bool transferring = false;
+
+        // token of `batch` itself: each piece of a split batch is an insert of its own
+        std::string sendToken() const;
+    };
+
+    void step(std::size_t lane, std::chrono::milliseconds timeout);
+    void deliver(); // runs `inserted` for accepted batches whose predecessors are in too
+
+    ClickHouseSink& sink_;
+    InsertedFn inserted_;
+    LaneSchedule schedule_;
+    BatchSizer sizer_;
+    std::vector<Lane> lanes_;
+    std::size_t lanesBusy_ = 0;
+    std::size_t transferring_ = 0;
+
+    std::uint64_t submitted_ = 0;  // sequence of the next submission
+    std::uint64_t delivered_ = 0;  // `inserted` has run for all sequences below
+    std::map<std::uint64_t, std::unique_ptr<Batch>> accepted_; // out of order, waiting
+};
@@ -0,0 +1,148 @@
+#include "frames.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Framing parseFraming(std::string_view name) {
+    std::string lower(name);
+    std::transform(lower.begin(), lower.end(), lower.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    if (lower == "length" || lower == "length-prefixed") return Framing::LengthPrefixed;
+    if (lower == "capnp") return Framing::Capnp;
+    throw std::runtime_error("Unknown framing: " + std::string(name));
+}
+
+// ---------------------------------------------------------------------------
+// MappedFile
+
+MappedFile::MappedFile(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "open " + path);
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        const int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "stat " + path);
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ > 0) {
+        map_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map_ == MAP_FAILED) {
+            const int err = errno;
+            map_ = nullptr;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), "mmap " + path);
+        }
+        ::madvise(map_, size_, MADV_SEQUENTIAL); // read-ahead, drop pages behind us
+    }
+    ::close(fd); // the mapping keeps the file referenced
+}
+
+MappedFile::~MappedFile() {
+    if (map_) ::munmap(map_, size_);
+}
+
+// ---------------------------------------------------------------------------
+// FrameReader
+
+namespace {
+
+std::uint32_t readU32Le(const char* p) {
+    const auto* b = reinterpret_cast<const unsigned char*>(p);
+    return std::uint32_t(b[0]) | std::uint32_t(b[1]) << 8 | std::uint32_t(b[2]) << 16 | std::uint32_t(b[3]) << 24;
+}
+
+std::uint32_t readU32Be(const char* p) {
+    const auto* b = reinterpret_cast<const unsigned char*>(p);
+    return std::uint32_t(b[0]) << 24 | std::uint32_t(b[1]) << 16 | std::uint32_t(b[2]) << 8 | std::uint32_t(b[3]);
+}
+
+// capnp's default ReaderOptions refuse more segments than this anyway
+constexpr std::uint32_t kMaxSegments = 512;
+
+} // namespace
+
+bool FrameReader::next(std::string_view& payload) {
+    if (pos_ == size_) return false;
+    const char* p = data_ + pos_;
+    const std::size_t left = size_ - pos_;
+    auto truncated = [&] {
+        return std::runtime_error("truncated frame at byte " + std::to_string(pos_));
+    };
+
+    std::size_t header = 0, len = 0;
+    if (framing_ == Framing::LengthPrefixed) {
+        if (left < 4) throw truncated();
+        header = 4;
+        len = readU32Be(p);
+    } else {
+        if (left < 8) throw truncated();
+        const std::uint32_t segments = readU32Le(p) + 1;
+        if (segments == 0 || segments > kMaxSegments)
+            throw std::runtime_error("bad capnp segment count at byte " + std::to_string(pos_));
+        len = capnpMessageSize(p, left); // the payload is the whole message, table included
+        if (len == 0) throw truncated();
+    }
+    if (len > left - header) throw truncated();
+    payload = std::string_view(p + header, len);
+    pos_ += header + len;
+    return true;
+}
+
+std::size_t capnpMessageSize(const char* data, std::size_t size) {
+    // segment table: u32 segment count - 1, u32 size in words per segment, padded to a word
+    if (size < 8) return 0;
+    const std::uint32_t segments = readU32Le(data) + 1;
+    if (segments == 0 || segments > kMaxSegments) return 0;
+    const std::size_t header = (segments / 2 + 1) * 8;
+    if (size < header) return 0;
+    std::size_t len = header;
+    for (std::uint32_t s = 0; s < segments; ++s) len += std::size_t{readU32Le(data + 4 + 4 * s)} * 8;
+    return len <= size ? len : 0;
+}
+
+bool unpackCapnp(const char* data, std::size_t size, std::vector<std::uint64_t>& out, std::size_t maxWords) {
+    // each word starts with a tag byte whose bits say which of its 8 bytes follow (the rest
+    // are zero); tag 0x00 is followed by a count of extra zero words, tag 0xff by a count
+    // of words copied verbatim
+    const auto* in = reinterpret_cast<const unsigned char*>(data);
+    const auto* end = in + size;
+    out.clear();
+    while (in < end) {
+        const unsigned tag = *in++;
+        std::uint64_t word = 0;
+        auto* bytes = reinterpret_cast<unsigned char*>(&word);
+        for (int b = 0; b < 8; ++b) {
+            if (!(tag & (1u << b))) continue;
+            if (in == end) return false;
+            bytes[b] = *in++;
+        }
+        if (out.size() == maxWords) return false;
+        out.push_back(word);
+        if (tag == 0x00 || tag == 0xff) {
+            if (in == end) return false;
+            const std::size_t run = *in++;
+            if (run > maxWords - out.size()) return false;
+            if (tag == 0x00) {
+                out.resize(out.size() + run, 0);
+            } else {
+                if (static_cast<std::size_t>(end - in) < run * 8) return false;
+                const std::size_t at = out.size();
+                out.resize(at + run);
+                std::memcpy(out.data() + at, in, run * 8);
+                in += run * 8;
+            }
+        }
+    }
+    return true;
+}
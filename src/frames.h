@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Archived HttpLogRecord dumps for `anonymizer replay`, and the capnp framing helpers the
+// Kafka payload decoder uses (no capnp/Kafka deps, unit-testable)
+
+enum class Framing {
+    LengthPrefixed, // u32 big-endian payload length, then the payload (kcat -f '%R%s')
+    Capnp,          // concatenated standard-framed messages (capnp::writeMessage)
+};
+
+// Parses --framing values: "length" or "capnp". Throws on unknown.
+Framing parseFraming(std::string_view name);
+
+// Read-only mapping of a whole file; empty files map to nothing.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return static_cast<const char*>(map_); }
+    std::size_t size() const { return size_; }
+
+private:
+    void* map_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Splits a dump into message payloads, borrowed from the input (no copies). A mapped
+// capnp-framed file starts page-aligned and every message is a whole number of words,
+// so its payloads decode in place.
+class FrameReader {
+public:
+    FrameReader(const char* data, std::size_t size, Framing framing)
+        : data_(data), size_(size), framing_(framing) {}
+
+    /// Next payload; false at the end of the input. Throws on a truncated or malformed frame.
+    bool next(std::string_view& payload);
+
+    /// Bytes consumed so far.
+    std::size_t position() const { return pos_; }
+
+private:
+    const char* data_;
+    std::size_t size_;
+    Framing framing_;
+    std::size_t pos_ = 0;
+};
+
+// Size of the standard-framed capnp message starting at `data` (segment table included);
+// 0 if the bytes do not start one that fits in `size`.
+std::size_t capnpMessageSize(const char* data, std::size_t size);
+
+// Decodes capnp's packed encoding (capnp::writePackedMessage) into `out`, resized to the
+// unpacked words. False if `data` is not well-formed packed data or would unpack to more
+// than `maxWords` (two bytes of zero run make 2 KiB).
+bool unpackCapnp(const char* data, std::size_t size, std::vector<std::uint64_t>& out, std::size_t maxWords);
@@ -0,0 +1,167 @@
+#include "lanes.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+using namespace std::chrono_literals;
+
+const char* insertStatusName(InsertStatus status) {
+    switch (status) {
+        case InsertStatus::Ok: return "ok";
+        case InsertStatus::RateLimited: return "rate limited";
+        case InsertStatus::ServerError: return "server error";
+        case InsertStatus::ClientError: return "client error";
+        case InsertStatus::NetworkError: return "network error";
+    }
+    return "unknown";
+}
+
+std::optional<std::chrono::seconds> parseRetryAfter(std::string_view value, std::time_t now) {
+    while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front()))) value.remove_prefix(1);
+    while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back()))) value.remove_suffix(1);
+    if (value.empty()) return std::nullopt;
+
+    if (std::all_of(value.begin(), value.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        if (value.size() > 12) return std::nullopt;
+        std::int64_t n = 0;
+        for (char c : value) n = n * 10 + (c - '0');
+        // X-RateLimit-Reset is sometimes an epoch timestamp rather than a delay
+        if (n > 1'000'000'000) n = std::max<std::int64_t>(0, n - static_cast<std::int64_t>(now));
+        return std::chrono::seconds(n);
+    }
+
+    // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+    std::tm tm{};
+    const std::string text(value);
+    const char* end = ::strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') return std::nullopt;
+    const std::time_t at = ::timegm(&tm);
+    return std::chrono::seconds(std::max<std::int64_t>(0, static_cast<std::int64_t>(at - now)));
+}
+
+// ---------------------------------------------------------------------------
+// LaneSchedule
+
+LaneSchedule::LaneSchedule(std::size_t lanes, Clock::duration interval, Clock::time_point now)
+    : interval_(interval) {
+    if (lanes == 0) throw std::invalid_argument("LaneSchedule needs at least one lane");
+    stagger_ = interval_ / static_cast<Clock::rep>(lanes);
+    lastAssign_ = now - stagger_;
+    // lane i first opens at now + (i + 1) * stagger: a single lane keeps the old
+    // "first insert one interval after start"
+    lanes_.resize(lanes);
+    for (std::size_t i = 0; i < lanes; ++i)
+        lanes_[i].windowStart = now - interval_ + stagger_ * static_cast<Clock::rep>(i + 1);
+}
+
+std::optional<std::size_t> LaneSchedule::pick(Clock::time_point now) const {
+    if (now < lastAssign_ + stagger_) return std::nullopt;
+    std::optional<std::size_t> best;
+    for (std::size_t i = 0; i < lanes_.size(); ++i) {
+        auto const& l = lanes_[i];
+        if (l.busy || now < l.retryAt || now < opens(l)) continue;
+        if (!best || opens(l) < opens(lanes_[*best])) best = i;
+    }
+    return best;
+}
+
+LaneSchedule::Clock::time_point LaneSchedule::nextSlot() const {
+    auto next = Clock::time_point::max();
+    for (auto const& l : lanes_)
+        next = std::min(next, std::max(opens(l), l.retryAt));
+    return std::max(next, lastAssign_ + stagger_);
+}
+
+void LaneSchedule::assign(std::size_t lane, Clock::time_point now) {
+    lanes_[lane].busy = true;
+    lanes_[lane].attemptStarted = now;
+    lastAssign_ = now;
+}
+
+LaneSchedule::Clock::time_point LaneSchedule::completed(std::size_t lane, Clock::time_point now,
+                                                        const InsertResult& result) {
+    auto& l = lanes_[lane];
+    switch (result.status) {
+        case InsertStatus::Ok:
+            l.busy = false;
+            l.accepted = true;
+            l.failures = 0;
+            l.windowStart = l.attemptStarted;
+            l.margin -= l.margin / 16;
+            l.retryAt = now;
+            break;
+
+        case InsertStatus::RateLimited: {
+            // only a rejection right at our window edge says something about the proxy's
+            // phase; later ones (lane idle for a while) may be someone else's request
+            const bool atEdge = l.accepted && l.attemptStarted < opens(l) + 1s;
+            if (result.retryAfter) {
+                // the proxy says where its window opens
+                l.retryAt = now + *result.retryAfter;
+                if (atEdge)
+                    l.margin = std::clamp<Clock::duration>(l.retryAt - (l.windowStart + interval_),
+                                                           Clock::duration::zero(), interval_);
+            } else if (atEdge) {
+                // the proxy's window starts later than we think
+                l.margin = std::min<Clock::duration>(interval_, std::max<Clock::duration>(250ms, l.margin * 2));
+                l.retryAt = std::max(now, opens(l));
+            } else {
+                // phase unknown: the proxy's last accepted request is at most an interval ago
+                auto next = l.windowStart + interval_;
+                l.retryAt = next > now ? next : now + interval_;
+            }
+            break;
+        }
+
+        case InsertStatus::ClientError:
+            // the Flusher resends only a smaller request (413); the proxy may have counted
+            // this one, so it goes at the lane's next window
+            l.retryAt = std::max(now, l.attemptStarted + interval_ + l.margin);
+            break;
+
+        default: {
+            const auto backoff = std::min<Clock::duration>(30s, std::chrono::seconds(1u << std::min(l.failures, 5u)));
+            ++l.failures;
+            l.retryAt = now + backoff;
+        }
+    }
+    return l.retryAt;
+}
+
+void LaneSchedule::proceed(std::size_t lane) {
+    auto& l = lanes_[lane];
+    l.busy = true;
+    l.retryAt = opens(l);
+}
+
+// ---------------------------------------------------------------------------
+// BatchSizer
+
+BatchSizer::BatchSizer(std::size_t minBytes, std::size_t maxBytes, std::chrono::duration<double> target)
+    : minBytes_(minBytes), maxBytes_(std::max(minBytes, maxBytes)), target_(target.count()), limit_(maxBytes_) {}
+
+BatchSizer::BatchSizer() : BatchSizer(0, std::numeric_limits<std::size_t>::max(), 0s) {}
+
+void BatchSizer::observe(std::size_t bytes, std::chrono::duration<double> took) {
+    if (target_ <= 0 || bytes == 0) return;
+    const double fits = static_cast<double>(bytes) * target_ / std::max(took.count(), 1e-3);
+    double next = static_cast<double>(limit_);
+    if (took.count() > target_) next = fits;
+    else if (fits > next) next = std::min(fits, next * 2);
+    limit_ = static_cast<std::size_t>(
+        std::clamp(next, static_cast<double>(minBytes_), static_cast<double>(maxBytes_)));
+}
+
+void BatchSizer::timedOut(std::size_t bytes) {
+    if (target_ <= 0) return;
+    limit_ = std::max(minBytes_, std::min(limit_, bytes) / 2);
+}
+
+void BatchSizer::tooLarge(std::size_t bytes) {
+    maxBytes_ = std::max<std::size_t>(1, std::min(maxBytes_, bytes / 2));
+    minBytes_ = std::min(minBytes_, maxBytes_);
+    limit_ = std::min(limit_, maxBytes_);
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// Outcome of one insert attempt, classified by the sink
+enum class InsertStatus {
+    Ok,
+    RateLimited,   // HTTP 503/429 from the proxy
+    ServerError,   // other 5xx (and anything else non-2xx that is not a client error)
+    ClientError,   // other 4xx
+    NetworkError,  // transport failure, no HTTP answer
+};
+
+const char* insertStatusName(InsertStatus status);
+
+struct InsertResult {
+    InsertStatus status = InsertStatus::Ok;
+    long httpCode = 0;
+    bool timedOut = false;                         // NetworkError: the request timed out
+    std::optional<std::chrono::seconds> retryAfter; // Retry-After / RateLimit-Reset, if sent
+    std::string message;                           // for logging
+
+    bool ok() const { return status == InsertStatus::Ok; }
+};
+
+/// Delay announced by a Retry-After (delta-seconds or HTTP-date) or RateLimit-Reset value,
+/// relative to `now`; nullopt if it does not parse. Dates in the past give zero.
+std::optional<std::chrono::seconds> parseRetryAfter(std::string_view value, std::time_t now);
+
+// ---------------------------------------------------------------------------
+// Send windows of N insert lanes, each allowed one request per `interval` (one proxy
+// endpoint per lane). First windows are staggered by interval / N and consecutive
+// batches are kept at least that far apart, so some lane is always about to open and
+// N lanes carry N inserts per interval without any of them hitting its limit.
+//
+// The proxy counts its window from when it accepted a request, which is a little after
+// we sent it, so each lane learns a margin on top of `interval` from 503s at its own
+// window edge: a Retry-After sets it exactly, a bare 503 doubles it, and accepted inserts
+// let it shrink slowly again. Any other 503 without Retry-After (phase unknown, e.g.
+// right after a restart) waits a full interval, as before.
+//
+// Pure bookkeeping (no I/O): the Flusher asks which lane may take the next batch and
+// reports how its attempts went.
+class LaneSchedule {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    LaneSchedule(std::size_t lanes, Clock::duration interval, Clock::time_point now);
+
+    std::size_t lanes() const { return lanes_.size(); }
+
+    /// Idle lane that may take a batch at `now` (window open, stagger kept), the one
+    /// that waited longest first.
+    std::optional<std::size_t> pick(Clock::time_point now) const;
+
+    /// Earliest time a lane's window opens (or a busy lane may retry); for logging.
+    Clock::time_point nextSlot() const;
+
+    /// `lane` took a batch at `now`; it stays busy until an attempt succeeds.
+    void assign(std::size_t lane, Clock::time_point now);
+
+    /// The busy lane may (re)try its batch at `now`.
+    bool due(std::size_t lane, Clock::time_point now) const { return now >= lanes_[lane].retryAt; }
+
+    /// An attempt of the busy lane went on the wire at `now`.
+    void attempt(std::size_t lane, Clock::time_point now) { lanes_[lane].attemptStarted = now; }
+    Clock::time_point attemptStarted(std::size_t lane) const { return lanes_[lane].attemptStarted; }
+
+    /// Books the outcome of the lane's last attempt and returns when it may send next:
+    /// success frees the lane and restarts its window at the attempt; a rate limit retries
+    /// where the proxy's window opens; a client error waits for the next window (the
+    /// request may have used this one); other failures back off exponentially (1s..30s).
+    Clock::time_point completed(std::size_t lane, Clock::time_point now, const InsertResult& result);
+
+    /// `lane`, freed by a success, keeps going with more of the same batch (the rest of a
+    /// split one) at its next window.
+    void proceed(std::size_t lane);
+
+    bool busy(std::size_t lane) const { return lanes_[lane].busy; }
+
+    /// Extra wait learned on top of the interval.
+    Clock::duration margin(std::size_t lane) const { return lanes_[lane].margin; }
+
+private:
+    struct Lane {
+        bool busy = false;
+        bool accepted = false;                           // windowStart is a real insert
+        unsigned failures = 0;                           // consecutive non-rate-limit failures
+        Clock::time_point windowStart;                   // last accepted attempt
+        Clock::time_point attemptStarted;
+        Clock::time_point retryAt = Clock::time_point::min();
+        Clock::duration margin = Clock::duration::zero();
+    };
+
+    Clock::time_point opens(const Lane& l) const { return l.windowStart + interval_ + l.margin; }
+
+    Clock::duration interval_;
+    Clock::duration stagger_;   // interval / lanes
+    Clock::time_point lastAssign_;
+    std::vector<Lane> lanes_;
+};
+
+// ---------------------------------------------------------------------------
+// Byte size of the next batch, steered by insert latency: an insert slower than `target`
+// shrinks the limit to what would have fit, one that fit with room to spare lets it grow
+// (at most 2x per insert, up to `maxBytes`), and a timeout halves it. Keeps inserts
+// clear of the request timeout when ClickHouse slows down. Fast inserts smaller than the
+// limit say little about throughput, so they never shrink it. A request refused as too
+// large (413) halves `maxBytes` itself, below `minBytes` if need be: the server's or
+// proxy's body limit is hard.
+class BatchSizer {
+public:
+    BatchSizer(std::size_t minBytes, std::size_t maxBytes, std::chrono::duration<double> target);
+
+    /// No limit (SIZE_MAX).
+    BatchSizer();
+
+    /// An accepted insert of `bytes` (uncompressed) took `took`.
+    void observe(std::size_t bytes, std::chrono::duration<double> took);
+
+    /// An insert of `bytes` timed out.
+    void timedOut(std::size_t bytes);
+
+    /// An insert of `bytes` was refused as too large (HTTP 413).
+    void tooLarge(std::size_t bytes);
+
+    std::size_t limit() const { return limit_; }
+
+private:
+    std::size_t minBytes_;
+    std::size_t maxBytes_;
+    double target_; // seconds
+    std::size_t limit_;
+};
@@ -0,0 +1,256 @@
+#include "metrics.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)), buckets_(new std::atomic<std::uint64_t>[bounds_.size() + 1]) {
+    for (std::size_t i = 0; i <= bounds_.size(); ++i)
+        buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::observe(double v) {
+    const auto i = static_cast<std::size_t>(
+        std::lower_bound(bounds_.begin(), bounds_.end(), v) - bounds_.begin());
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + v, std::memory_order_relaxed)) {
+    }
+}
+
+namespace {
+
+// per-record stage times: 100 ns .. 1 ms
+std::vector<double> recordBuckets() {
+    return {1e-7, 2.5e-7, 5e-7, 1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 1e-3};
+}
+
+std::string number(double v) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+void header(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void counter(std::string& out, const char* name, const char* help, double value) {
+    header(out, name, "counter", help);
+    out += name;
+    out += ' ';
+    out += number(value);
+    out += '\n';
+}
+
+void gauge(std::string& out, const char* name, const char* help, double value) {
+    header(out, name, "gauge", help);
+    out += name;
+    out += ' ';
+    out += number(value);
+    out += '\n';
+}
+
+void histogram(std::string& out, const char* name, const char* help, const Histogram& h) {
+    header(out, name, "histogram", help);
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i <= h.bounds().size(); ++i) {
+        cumulative += h.bucket(i);
+        out += name;
+        out += "_bucket{le=\"";
+        out += i < h.bounds().size() ? number(h.bounds()[i]) : "+Inf";
+        out += "\"} ";
+        out += std::to_string(cumulative);
+        out += '\n';
+    }
+    out += name;
+    out += "_sum ";
+    out += number(h.sum());
+    out += '\n';
+    out += name;
+    out += "_count ";
+    out += std::to_string(cumulative); // consistent with the buckets read above
+    out += '\n';
+}
+
+std::int64_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::int64_t size = 0, resident = 0;
+    if (!(statm >> size >> resident)) return 0;
+    return resident * static_cast<std::int64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+} // namespace
+
+Metrics::Metrics()
+    : decodeSeconds(recordBuckets()),
+      anonymizeSeconds(recordBuckets()),
+      encodeSeconds(recordBuckets()),
+      batchBytes({64e3, 256e3, 1e6, 4e6, 16e6, 64e6, 256e6, 1e9}),
+      batchRows({100, 1e3, 1e4, 5e4, 1e5, 5e5, 1e6}),
+      flushSeconds({0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30}),
+      handoffSeconds({0.1, 0.5, 1, 5, 10, 30, 60, 120}) {}
+
+void Metrics::setLag(std::map<OffsetTracker::Key, std::int64_t> lag) {
+    std::lock_guard<std::mutex> lock(lagMutex_);
+    lag_ = std::move(lag);
+}
+
+std::string Metrics::render() const {
+    std::string out;
+    out.reserve(8192);
+    counter(out, "anonymizer_records_total", "Kafka records decoded, anonymized and encoded.",
+            static_cast<double>(records.value()));
+    counter(out, "anonymizer_invalid_addresses_total", "remote_addr values that were not an IP address (fully masked).",
+            static_cast<double>(invalidAddresses.value()));
+    counter(out, "anonymizer_dead_letters_total",
+            "Messages with a record that did not decode or failed validation (dead-lettered, offsets committed).",
+            static_cast<double>(deadLetters.value()));
+    histogram(out, "anonymizer_record_decode_seconds", "Cap'n Proto decode time per record (sampled).",
+              decodeSeconds);
+    histogram(out, "anonymizer_record_anonymize_seconds", "IP anonymization time per record (sampled).",
+              anonymizeSeconds);
+    histogram(out, "anonymizer_record_encode_seconds", "Insert-format encoding time per record (sampled).",
+              encodeSeconds);
+    histogram(out, "anonymizer_batch_bytes", "Encoded size of inserted batches.", batchBytes);
+    histogram(out, "anonymizer_batch_rows", "Rows per inserted batch.", batchRows);
+    histogram(out, "anonymizer_flush_duration_seconds", "Duration of successful ClickHouse inserts.",
+              flushSeconds);
+    counter(out, "anonymizer_inserts_total", "Batches accepted by ClickHouse.",
+            static_cast<double>(inserts.value()));
+    counter(out, "anonymizer_insert_rate_limited_total", "Insert attempts rejected by the proxy rate limit (HTTP 503/429).",
+            static_cast<double>(rateLimited.value()));
+    counter(out, "anonymizer_insert_errors_total", "Insert attempts failed for other reasons.",
+            static_cast<double>(insertErrors.value()));
+    counter(out, "anonymizer_backoff_seconds_total", "Time scheduled waiting for an insert retry slot.",
+            static_cast<double>(backoffMicros.value()) / 1e6);
+    histogram(out, "anonymizer_rebalance_handoff_seconds",
+              "Time a rebalance spent handing off revoked partitions (bounded by REBALANCE_TIMEOUT_SECONDS).",
+              handoffSeconds);
+    gauge(out, "anonymizer_spill_bytes", "Disk used by the spill log.",
+          static_cast<double>(spillBytes.value()));
+    gauge(out, "anonymizer_batch_limit_bytes", "Batch size the flush controller currently caps inserts at.",
+          static_cast<double>(batchLimitBytes.value()));
+    gauge(out, "anonymizer_pipeline_bytes", "Payloads, encoded blocks and batches held by the pipeline.",
+          static_cast<double>(pipelineBytes.value()));
+    gauge(out, "anonymizer_consumer_paused", "1 while fetching is paused because the pipeline is full.",
+          static_cast<double>(consumerPaused.value()));
+
+    header(out, "anonymizer_partition_lag", "gauge", "Messages between the consumer position and the high watermark.");
+    {
+        std::lock_guard<std::mutex> lock(lagMutex_);
+        for (auto const& [key, lag] : lag_) {
+            out += "anonymizer_partition_lag{topic=\"" + key.first + "\",partition=\"" +
+                   std::to_string(key.second) + "\"} " + std::to_string(lag) + '\n';
+        }
+    }
+    gauge(out, "process_resident_memory_bytes", "Resident memory size in bytes.",
+          static_cast<double>(residentBytes()));
+    return out;
+}
+
+Metrics& metrics() {
+    static Metrics instance;
+    return instance;
+}
+
+// ---------------------------------------------------------------------------
+// MetricsServer
+
+MetricsServer::MetricsServer(std::uint16_t port, std::function<std::string()> render)
+    : render_(std::move(render)) {
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0)
+        throw std::runtime_error(std::string("metrics socket: ") + std::strerror(errno));
+    int one = 1;
+    ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd_, 16) != 0 ||
+        ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        const std::string what = std::string("metrics bind :") + std::to_string(port) + ": " + std::strerror(errno);
+        ::close(fd_);
+        throw std::runtime_error(what);
+    }
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] { serve(); });
+    spdlog::info("Metrics on http://0.0.0.0:{}/metrics", port_);
+}
+
+MetricsServer::~MetricsServer() {
+    stop_.store(true);
+    if (thread_.joinable()) thread_.join();
+    ::close(fd_);
+}
+
+void MetricsServer::serve() {
+    while (!stop_.load()) {
+        pollfd p{fd_, POLLIN, 0};
+        if (::poll(&p, 1, 200) <= 0) continue; // wake up regularly to notice stop_
+        int client = ::accept(fd_, nullptr, nullptr);
+        if (client < 0) continue;
+        try {
+            handle(client);
+        } catch (const std::exception& e) {
+            spdlog::warn("metrics request failed: {}", e.what());
+        }
+        ::close(client);
+    }
+}
+
+void MetricsServer::handle(int client) {
+    timeval timeout{1, 0}; // a stuck scraper must not hold the endpoint
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = ::recv(client, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        request.append(buf, static_cast<std::size_t>(n));
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0) {
+        body = render_();
+    } else {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+    std::string response = "HTTP/1.1 " + status +
+                           "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    for (std::size_t off = 0; off < response.size();) {
+        ssize_t n = ::send(client, response.data() + off, response.size() - off, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        off += static_cast<std::size_t>(n);
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "offsets.h"
+
+// ---------------------------------------------------------------------------
+// Prometheus metrics. Updates are relaxed atomic adds (no locks on the hot path);
+// render() builds the text exposition format when /metrics is scraped.
+
+class Counter {
+public:
+    void inc(std::uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    std::uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> value_{0};
+};
+
+class Gauge {
+public:
+    void set(std::int64_t v) { value_.store(v, std::memory_order_relaxed); }
+    std::int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::int64_t> value_{0};
+};
+
+// Fixed upper bounds (ascending); values above the last one land in +Inf.
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double v);
+
+    const std::vector<double>& bounds() const { return bounds_; }
+    /// Observations in bucket `i` alone (not cumulative); i == bounds().size() is +Inf.
+    std::uint64_t bucket(std::size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+    std::uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> buckets_;
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<double> sum_{0};
+};
+
+struct Metrics {
+    Metrics();
+
+    Counter records;              // transformed Kafka records
+    Counter invalidAddresses;     // remote_addr values that were not an IP (fully masked)
+    Counter deadLetters;          // messages with a record that did not decode or failed validation
+    Histogram decodeSeconds;      // per record, sampled (see transformRecord)
+    Histogram anonymizeSeconds;
+    Histogram encodeSeconds;
+
+    Histogram batchBytes;         // inserted batches
+    Histogram batchRows;
+    Histogram flushSeconds;       // successful insert round trip
+    Counter inserts;
+    Counter rateLimited;          // HTTP 503/429 from the proxy
+    Counter insertErrors;         // any other failed attempt
+    Counter backoffMicros;        // time scheduled waiting for a retry slot
+    Histogram handoffSeconds;     // rebalance callback handing off revoked partitions
+
+    Gauge spillBytes;
+    Gauge batchLimitBytes;        // BatchSizer's current cap
+    Gauge pipelineBytes;          // held by the pipeline, checked against MEMORY_BUDGET_MB
+    Gauge consumerPaused;         // 1 while the partitions are paused for backpressure
+
+    /// Replaces the per-partition consumer lag (called periodically from the poll stage).
+    void setLag(std::map<OffsetTracker::Key, std::int64_t> lag);
+
+    /// Prometheus text exposition format (version 0.0.4), process RSS included.
+    std::string render() const;
+
+private:
+    mutable std::mutex lagMutex_;
+    std::map<OffsetTracker::Key, std::int64_t> lag_;
+};
+
+/// Process-wide metrics instance.
+Metrics& metrics();
+
+// ---------------------------------------------------------------------------
+// Minimal HTTP endpoint serving GET /metrics from its own thread.
+class MetricsServer {
+public:
+    /// Binds 0.0.0.0:`port` (0 picks a free port); throws if the socket cannot be set up.
+    explicit MetricsServer(std::uint16_t port,
+                           std::function<std::string()> render = [] { return metrics().render(); });
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    std::uint16_t port() const { return port_; }
+
+private:
+    void serve();
+    void handle(int client);
+
+    std::function<std::string()> render_;
+    int fd_ = -1;
+    std::uint16_t port_ = 0;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
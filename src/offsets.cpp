@@ -0,0 +1,76 @@
+#include "offsets.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+void OffsetTracker::add(const std::string& topic, std::int32_t partition, std::int64_t offset) {
+    auto [it, inserted] = ranges_.try_emplace(Key(topic, partition), Range{offset, offset});
+    if (!inserted) {
+        it->second.first = std::min(it->second.first, offset);
+        it->second.last = std::max(it->second.last, offset);
+    }
+}
+
+void OffsetTracker::merge(const OffsetTracker& other) {
+    for (auto const& [key, range] : other.ranges_) {
+        auto [it, inserted] = ranges_.try_emplace(key, range);
+        if (!inserted) {
+            it->second.first = std::min(it->second.first, range.first);
+            it->second.last = std::max(it->second.last, range.last);
+        }
+    }
+}
+
+OffsetTracker OffsetTracker::newerThan(const OffsetTracker& committed) const {
+    OffsetTracker out;
+    for (auto const& [key, range] : ranges_) {
+        auto it = committed.ranges_.find(key);
+        if (it == committed.ranges_.end()) {
+            out.ranges_.emplace(key, range);
+        } else if (it->second.last < range.last) {
+            out.ranges_.emplace(key, Range{std::max(range.first, it->second.last + 1), range.last});
+        }
+    }
+    return out;
+}
+
+std::string OffsetTracker::identity() const {
+    std::string out;
+    for (auto const& [key, range] : ranges_) {
+        if (!out.empty()) out += ',';
+        out += key.first;
+        out += ':';
+        out += std::to_string(key.second);
+        out += ':';
+        out += std::to_string(range.first);
+        out += '-';
+        out += std::to_string(range.last);
+    }
+    return out;
+}
+
+OffsetTracker OffsetTracker::fromIdentity(std::string_view identity) {
+    OffsetTracker out;
+    while (!identity.empty()) {
+        const auto end = std::min(identity.find(','), identity.size());
+        const std::string entry(identity.substr(0, end));
+        identity.remove_prefix(std::min(end + 1, identity.size()));
+
+        // topic names may contain '-' but not ':', so split from the right
+        const auto dash = entry.rfind('-');
+        const auto colon2 = entry.rfind(':', dash);
+        const auto colon1 = colon2 == std::string::npos || colon2 == 0 ? std::string::npos
+                                                                       : entry.rfind(':', colon2 - 1);
+        if (dash == std::string::npos || colon1 == std::string::npos)
+            throw std::runtime_error("Malformed offset identity: " + entry);
+        try {
+            const Key key(entry.substr(0, colon1),
+                          static_cast<std::int32_t>(std::stol(entry.substr(colon1 + 1, colon2 - colon1 - 1))));
+            out.ranges_[key] = Range{std::stoll(entry.substr(colon2 + 1, dash - colon2 - 1)),
+                                     std::stoll(entry.substr(dash + 1))};
+        } catch (const std::logic_error&) {
+            throw std::runtime_error("Malformed offset identity: " + entry);
+        }
+    }
+    return out;
+}
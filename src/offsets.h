@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Exact range of processed Kafka offsets per topic-partition. Commits use last + 1
+// (the next message to read), as Kafka expects.
+class OffsetTracker {
+public:
+    using Key = std::pair<std::string, std::int32_t>;
+
+    struct Range {
+        std::int64_t first; // lowest offset covered
+        std::int64_t last;  // highest offset covered
+    };
+
+    void add(const std::string& topic, std::int32_t partition, std::int64_t offset);
+
+    /// Folds in offsets from a later (or concurrent) batch.
+    void merge(const OffsetTracker& other);
+
+    /// Entries ahead of `committed` (absent there or higher), so commits never move back.
+    OffsetTracker newerThan(const OffsetTracker& committed) const;
+
+    /// Deterministic identity of the covered ranges, "topic:partition:first-last,..." in
+    /// key order; used as the insert deduplication token. Empty when nothing is tracked.
+    std::string identity() const;
+
+    /// Inverse of identity(); throws on malformed input.
+    static OffsetTracker fromIdentity(std::string_view identity);
+
+    /// Forgets one partition (e.g. after it was revoked).
+    void erase(const Key& key) { ranges_.erase(key); }
+
+    bool empty() const { return ranges_.empty(); }
+    void clear() { ranges_.clear(); }
+
+    /// Processed offsets per partition.
+    const std::map<Key, Range>& ranges() const { return ranges_; }
+
+private:
+    std::map<Key, Range> ranges_;
+};
@@ -0,0 +1,589 @@
+#include "pipeline.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+PipelineConfig PipelineConfig::fromEnv() {
+    PipelineConfig c;
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    // poll and sink threads take two cores when available
+    c.workers = static_cast<std::size_t>(std::stoul(
+        getEnvOrDefault("PIPELINE_WORKERS", std::to_string(cores > 2 ? cores - 2 : 1).c_str())));
+    const std::string sharding = getEnvOrDefault("PIPELINE_SHARDING", "roundrobin");
+    if (sharding == "partition") c.partitionShards = true;
+    else if (sharding != "roundrobin") throw std::runtime_error("Unknown PIPELINE_SHARDING: " + sharding);
+    c.blockMessages = static_cast<std::size_t>(std::stoul(getEnvOrDefault("PIPELINE_BLOCK", "1024")));
+    c.blockLinger = std::chrono::milliseconds(std::stoul(getEnvOrDefault("PIPELINE_LINGER_MS", "20")));
+    c.queueDepth = static_cast<std::size_t>(std::stoul(getEnvOrDefault("PIPELINE_QUEUE", "64")));
+    c.batchMax = static_cast<std::size_t>(std::stoull(getEnvOrDefault("BATCH_MAX", "50000")));
+    c.flushEvery = std::chrono::seconds(std::stoull(getEnvOrDefault("FLUSH_SECONDS", "60")));
+    c.batchMaxBytes = static_cast<std::size_t>(std::stoull(getEnvOrDefault("BATCH_MAX_MB", "512"))) << 20;
+    c.batchMinBytes = static_cast<std::size_t>(std::stoull(getEnvOrDefault("BATCH_MIN_MB", "1"))) << 20;
+    c.insertTarget = std::chrono::milliseconds(
+        static_cast<std::int64_t>(std::stod(getEnvOrDefault("INSERT_TARGET_SECONDS", "10")) * 1000));
+    c.memoryBudget = static_cast<std::size_t>(std::stoull(getEnvOrDefault("MEMORY_BUDGET_MB", "1024"))) << 20;
+    c.handoffTimeout = std::chrono::seconds(std::stoull(getEnvOrDefault("REBALANCE_TIMEOUT_SECONDS", "60")));
+    c.workers = std::max<std::size_t>(c.workers, 1);
+    c.blockMessages = std::max<std::size_t>(c.blockMessages, 1);
+    c.spill = SpillConfig::fromEnv();
+    c.deadLetter = DeadLetterConfig::fromEnv();
+    c.ipMask = IpMask::fromEnv();
+    return c;
+}
+
+// ---------------------------------------------------------------------------
+// Pipeline
+
+Pipeline::Pipeline(KafkaConsumer& consumer, ClickHouseSink& sink, PipelineConfig config)
+    : consumer_(consumer), sink_(sink), config_(config), deadLetters_(config_.deadLetter) {
+    for (std::size_t i = 0; i < config_.workers; ++i)
+        workers_.push_back(std::make_unique<Worker>(i, config_.queueDepth));
+    if (config_.partitionShards) consumer_.shard(config_.workers);
+    consumer_.onRevoke([this](const std::vector<OffsetTracker::Key>& revoked) { handOff(revoked); });
+    spdlog::info("Pipeline: {} {}, {} messages per block, {} MB memory budget", config_.workers,
+                 config_.partitionShards ? "partition shards" : "workers", config_.blockMessages,
+                 config_.memoryBudget >> 20);
+}
+
+Pipeline::~Pipeline() {
+    consumer_.onRevoke({});
+    stop_.store(true);
+    for (auto& w : workers_)
+        if (w->thread.joinable()) w->thread.join();
+    if (sinkThread_.joinable()) sinkThread_.join();
+}
+
+void Pipeline::run(const std::atomic<bool>& running) {
+    for (auto& w : workers_)
+        w->thread = std::thread([this, wp = w.get()] { workerStage(*wp); });
+    sinkThread_ = std::thread([this] { sinkStage(); });
+
+    try {
+        pollStage(running);
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    inputClosed_.store(true);
+
+    for (auto& w : workers_)
+        w->thread.join();
+    workersDone_.store(true);
+    sinkThread_.join();
+
+    if (failure_) std::rethrow_exception(failure_);
+}
+
+void Pipeline::fail(std::exception_ptr e) {
+    {
+        std::lock_guard<std::mutex> lock(failureMutex_);
+        if (!failure_) failure_ = e;
+    }
+    stop_.store(true);
+}
+
+template <typename Q, typename T>
+bool Pipeline::pushWait(Q& queue, T& item) {
+    IdleBackoff backoff;
+    while (!queue.try_push(item)) {
+        if (stop_.load()) return false;
+        backoff.idle();
+    }
+    return true;
+}
+
+bool Pipeline::dispatch(std::chrono::steady_clock::time_point deadline) {
+    IdleBackoff backoff;
+    while (!tryDispatch()) {
+        if (stop_.load() || std::chrono::steady_clock::now() >= deadline) return false;
+        backoff.idle();
+    }
+    return true;
+}
+
+bool Pipeline::tryDispatch() {
+    if (pollItem_->messages.empty()) return true;
+    if (!workers_[pollNext_]->in.try_push(pollItem_)) return false;
+    ++workers_[pollNext_]->dispatched;
+    pollNext_ = (pollNext_ + 1) % workers_.size();
+    pollItem_ = std::make_unique<WorkItem>();
+    pollItem_->messages.reserve(config_.blockMessages);
+    return true;
+}
+
+std::size_t Pipeline::memoryUsed() const {
+    const std::int64_t used = payloadBytes_.load(std::memory_order_relaxed) +
+                              blockBytes_.load(std::memory_order_relaxed) +
+                              sinkBytes_.load(std::memory_order_relaxed);
+    return static_cast<std::size_t>(std::max<std::int64_t>(used, 0));
+}
+
+void Pipeline::backpressure(bool blocked) {
+    const std::size_t used = memoryUsed();
+    metrics().pipelineBytes.set(static_cast<std::int64_t>(used));
+    if (!consumer_.paused() && (blocked || used > config_.memoryBudget)) {
+        if (blocked) spdlog::info("Pausing Kafka partitions: workers are behind");
+        else spdlog::info("Pausing Kafka partitions: {} bytes held, budget {}", used, config_.memoryBudget);
+        consumer_.pause();
+        metrics().consumerPaused.set(1);
+    } else if (consumer_.paused() && !blocked && used <= config_.memoryBudget / 4 * 3) {
+        spdlog::info("Resuming Kafka partitions ({} bytes held)", used);
+        consumer_.resume();
+        metrics().consumerPaused.set(0);
+    }
+}
+
+void Pipeline::pollStage(const std::atomic<bool>& running) {
+    pollItem_ = std::make_unique<WorkItem>();
+    if (config_.partitionShards) {
+        pollShards(running);
+        return;
+    }
+    pollItem_->messages.reserve(config_.blockMessages);
+    // consume() appends here, not to pollItem_: a hand-off inside the call dispatches
+    // pollItem_. Messages fetched before such a revocation are still inserted, but their
+    // partitions are no longer assigned, so they are not committed (the new owner replays).
+    MessageBatch polled;
+    auto lagUpdated = std::chrono::steady_clock::now();
+    bool blocked = false; // pollItem_ is due but the next worker's queue is full
+    std::chrono::steady_clock::time_point blockedSince;
+    IdleBackoff backoff;
+
+    while (running.load() && !stop_.load()) {
+        // A short stall waits for the worker; a longer one pauses fetching instead of
+        // blocking, since consume() has to keep serving the group (max.poll.interval.ms)
+        if (blocked) {
+            blocked = !tryDispatch();
+            if (blocked && std::chrono::steady_clock::now() - blockedSince < 1s) {
+                backoff.idle();
+                continue;
+            }
+        }
+        backoff.reset();
+        backpressure(blocked);
+
+        // one call fills the rest of the block or spends the linger budget trying; it may
+        // run the rebalance callback (handOff). A full block waiting for a worker still
+        // polls (paused, nothing arrives but callbacks and the odd in-flight message).
+        const std::size_t size = pollItem_->messages.size();
+        const std::size_t room = size < config_.blockMessages ? config_.blockMessages - size : 1;
+        const std::size_t got = consumer_.consume(polled, room, config_.blockLinger);
+        payloadBytes_.fetch_add(static_cast<std::int64_t>(polled.bytes()), std::memory_order_relaxed);
+        pollItem_->messages.splice(polled);
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lagUpdated >= 5s) { // cached watermarks: no broker round trip
+            metrics().setLag(consumer_.lag());
+            lagUpdated = now;
+        }
+        // hand over full blocks, and partial ones once the budget ran out
+        if (!blocked && (got < room || pollItem_->messages.size() >= config_.blockMessages)) {
+            blocked = !tryDispatch();
+            blockedSince = now;
+        }
+    }
+    dispatch();
+    if (consumer_.paused()) {
+        consumer_.resume();
+        metrics().consumerPaused.set(0);
+    }
+}
+
+void Pipeline::pollShards(const std::atomic<bool>& running) {
+    // the shards read the partitions; this thread keeps the consumer in the group
+    MessageBatch polled;
+    std::vector<MessageBatch> parts(workers_.size());
+    auto lagUpdated = std::chrono::steady_clock::now();
+
+    while (running.load() && !stop_.load()) {
+        backpressure(false);
+        consumer_.consume(polled, config_.blockMessages, config_.blockLinger);
+        if (!polled.empty()) {
+            // only partitions whose queue could not be forwarded end up here
+            consumer_.route(polled, parts);
+            for (std::size_t i = 0; i < parts.size(); ++i) {
+                if (parts[i].empty()) continue;
+                payloadBytes_.fetch_add(static_cast<std::int64_t>(parts[i].bytes()), std::memory_order_relaxed);
+                auto item = std::make_unique<WorkItem>();
+                item->messages.splice(parts[i]);
+                if (!pushWait(workers_[i]->in, item)) return;
+                ++workers_[i]->dispatched;
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lagUpdated >= 5s) {
+            metrics().setLag(consumer_.lag());
+            lagUpdated = now;
+        }
+    }
+    if (consumer_.paused()) {
+        consumer_.resume();
+        metrics().consumerPaused.set(0);
+    }
+}
+
+void Pipeline::handOff(const std::vector<OffsetTracker::Key>& revoked) {
+    if (stop_.load()) return;
+    const auto started = std::chrono::steady_clock::now();
+    const auto deadline = started + config_.handoffTimeout;
+
+    // From here on the sink collects even with a full batch: a worker (or shard) stuck
+    // pushing to it would otherwise hold this callback until the next flush window, or
+    // forever with ClickHouse down, and the consumer would miss max.poll.interval.ms.
+    handoffActive_.store(true);
+    struct Finish {
+        Pipeline& p;
+        std::chrono::steady_clock::time_point started;
+        ~Finish() {
+            p.handoffActive_.store(false);
+            metrics().handoffSeconds.observe(
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        }
+    } finish{*this, started};
+
+    if (!dispatch(deadline)) {
+        if (stop_.load()) return;
+        // still inserted later, but not committed: the partitions are gone by then
+        spdlog::warn("Rebalance hand-off: workers did not take the last polled block in time");
+    }
+
+    std::vector<std::size_t> blocks(workers_.size());
+    if (config_.partitionShards) {
+        // every shard pushes what it has consumed so far and reports how many blocks that is
+        const auto barrier = shardBarrier_.load() + 1;
+        shardBarrier_.store(barrier, std::memory_order_release);
+        IdleBackoff backoff;
+        for (auto& w : workers_) {
+            while (w->barrier.load(std::memory_order_acquire) < barrier) {
+                if (stop_.load()) return;
+                if (std::chrono::steady_clock::now() >= deadline) break; // the sink times out too
+                backoff.idle();
+            }
+            if (w->barrier.load(std::memory_order_acquire) >= barrier) blocks[w->index] = w->pushedAtBarrier;
+        }
+    } else {
+        for (auto& w : workers_) blocks[w->index] = w->dispatched;
+    }
+
+    std::uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(handoffMutex_);
+        handoffRevoked_ = revoked;
+        handoffBlocks_ = std::move(blocks);
+        handoffDeadline_ = deadline;
+        seq = handoffRequested_.load() + 1;
+        handoffRequested_.store(seq);
+    }
+    spdlog::info("Handing off {} revoked partition(s)", revoked.size());
+
+    // the sink stage always answers, at the latest when the deadline passes
+    IdleBackoff backoff;
+    while (handoffDone_.load() < seq) {
+        if (stop_.load()) return;
+        backoff.idle();
+    }
+}
+
+void Pipeline::workerStage(Worker& w) {
+    try {
+        RecordDecoder decoder;
+        std::unique_ptr<BatchEncoder> encoder;
+        AggregatingEncoder* aggregator = nullptr; // INSERT_AGGREGATE: sum rows per block
+        if (sink_.aggregate()) {
+            auto owned = std::make_unique<AggregatingEncoder>(sink_.format());
+            aggregator = owned.get();
+            encoder = std::move(owned);
+        } else {
+            encoder = makeEncoder(sink_.format(), sink_.kafkaColumns());
+        }
+        std::unique_ptr<WorkItem> item;
+        IdleBackoff backoff;
+        std::string error;
+
+        // one block per message batch, pushed to the sink; false if the pipeline is stopping.
+        // A message with a rejected record is dead-lettered whole and none of its records is
+        // inserted (transformPayload); its offset goes with the block all the same.
+        auto encode = [&](MessageBatch& messages) {
+            auto block = std::make_unique<Batch>();
+            std::size_t records = 0;
+            for (const rd_kafka_message_t* msg : messages) {
+                const char* topic = rd_kafka_topic_name(msg->rkt);
+                records += transformPayload(msg->payload, msg->len, decoder, *encoder, config_.ipMask, msg->partition,
+                                            msg->offset, &error);
+                if (!error.empty()) {
+                    DeadLetter letter;
+                    letter.topic = topic;
+                    letter.partition = msg->partition;
+                    letter.offset = msg->offset;
+                    letter.key = std::string_view(static_cast<const char*>(msg->key), msg->key ? msg->key_len : 0);
+                    letter.payload = std::string_view(static_cast<const char*>(msg->payload), msg->len);
+                    letter.error = error;
+                    deadLetters_.write(letter);
+                }
+                block->offsets.add(topic, msg->partition, msg->offset);
+            }
+            metrics().records.inc(records);
+            block->rows = encoder->rows();
+            if (aggregator) block->aggregate = aggregator->takeMap(); // merged by the sink
+            else block->body = encoder->finish();
+            messages.clear(); // hand the payload buffers back to librdkafka
+            blockBytes_.fetch_add(static_cast<std::int64_t>(block->bytes()), std::memory_order_relaxed);
+            if (!pushWait(w.out, block)) return false;
+            ++w.pushed;
+            return true;
+        };
+        auto drainInput = [&] {
+            while (w.in.try_pop(item)) {
+                const auto payload = static_cast<std::int64_t>(item->messages.bytes());
+                const bool ok = encode(item->messages);
+                payloadBytes_.fetch_sub(payload, std::memory_order_relaxed);
+                if (!ok) return false;
+            }
+            return true;
+        };
+
+        if (config_.partitionShards) {
+            MessageBatch own; // this shard's partitions
+            own.reserve(config_.blockMessages);
+            while (!stop_.load()) {
+                if (!drainInput()) return;
+                // revocation barrier: all consumed so far is pushed (the input too, it was
+                // queued before the barrier went up)
+                const auto barrier = shardBarrier_.load(std::memory_order_acquire);
+                if (barrier != w.barrier.load(std::memory_order_relaxed)) {
+                    if (!drainInput()) return;
+                    w.pushedAtBarrier = w.pushed;
+                    w.barrier.store(barrier, std::memory_order_release);
+                }
+                if (inputClosed_.load() && w.in.empty()) break;
+                consumer_.consumeShard(w.index, own, config_.blockMessages, config_.blockLinger);
+                if (!own.empty() && !encode(own)) return;
+            }
+            return;
+        }
+
+        while (!stop_.load()) {
+            if (!w.in.try_pop(item)) {
+                if (inputClosed_.load() && w.in.empty()) break;
+                backoff.idle();
+                continue;
+            }
+            backoff.reset();
+
+            const auto payload = static_cast<std::int64_t>(item->messages.bytes());
+            const bool ok = encode(item->messages);
+            item.reset();
+            payloadBytes_.fetch_sub(payload, std::memory_order_relaxed);
+            if (!ok) break;
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void Pipeline::sinkStage() {
+    try {
+        std::unique_ptr<SpillLog> spill;
+        if (config_.spill.enabled()) spill = std::make_unique<SpillLog>(config_.spill);
+
+        // spilled batches commit ahead of the one in flight; never move a partition back
+        OffsetTracker committed;
+        auto commit = [&](const OffsetTracker& offsets) {
+            OffsetTracker ahead = offsets.newerThan(committed);
+            if (ahead.empty()) return;
+            try {
+                deadLetters_.flush(); // the dead letters among them are delivered first
+            } catch (...) {
+                // the Flusher only logs a failed commit; a lost letter needs a restart
+                fail(std::current_exception());
+                throw;
+            }
+            consumer_.commit(ahead);
+            committed.merge(ahead);
+        };
+
+        std::size_t spillInFlight = 0; // spilled records submitted on some lane, oldest first
+
+        // runs in submission order across lanes, so releases stay oldest-first
+        Flusher flusher(sink_, config_.flushEvery, [&](const Batch& inserted) {
+            if (inserted.spilled) {
+                spill->release(inserted.spilled);
+                spillInFlight -= inserted.spilled;
+                metrics().spillBytes.set(static_cast<std::int64_t>(spill->bytesOnDisk()));
+            }
+            // on_write: spilled offsets were committed when written (possibly by an earlier run)
+            if (!inserted.spilled || !config_.spill.commitOnWrite) commit(inserted.offsets);
+        }, BatchSizer(config_.batchMinBytes, config_.batchMaxBytes, config_.insertTarget));
+        Batch pending; // next batch, filled while the previous one is in flight
+        bool spillFull = false;
+
+        // moves `pending` to disk; false if the spill is disabled or at its cap
+        auto spillPending = [&] {
+            if (!spill || pending.empty()) return false;
+            pending.seal(sink_.format());
+            if (!spill->append(pending)) {
+                if (!spillFull)
+                    spdlog::warn("Spill log full ({} bytes on disk), holding {} rows in memory",
+                                 spill->bytesOnDisk(), pending.rows);
+                spillFull = true;
+                return false;
+            }
+            spillFull = false;
+            metrics().spillBytes.set(static_cast<std::int64_t>(spill->bytesOnDisk()));
+            if (config_.spill.commitOnWrite) commit(pending.offsets);
+            pending = Batch();
+            return true;
+        };
+
+        // spilled rows go first (oldest); records already on another lane are skipped
+        auto submitNext = [&] {
+            if (spill && spill->records() > spillInFlight) {
+                Batch replay = spill->peek(config_.spill.replayBytes, spillInFlight);
+                spillInFlight += replay.spilled;
+                flusher.submit(std::move(replay));
+            } else if (!pending.empty()) {
+                pending.seal(sink_.format());
+                flusher.submit(std::exchange(pending, Batch()));
+            } else if (!pending.offsets.empty() && flusher.idle()) {
+                // dead letters only: no rows to insert, nothing older still in flight
+                commit(pending.offsets);
+                pending = Batch();
+            }
+        };
+
+        std::size_t next = 0;
+        std::vector<std::size_t> collected(workers_.size()); // blocks taken per worker
+        std::unique_ptr<Batch> block;
+        IdleBackoff backoff;
+        bool atLimit = false;
+
+        // Revoked partitions: every row polled before the revocation has been collected.
+        // Spill it (committed on write) or insert it before the deadline; commits of
+        // inserted rows go out from the flusher callback while we still own the partitions.
+        auto handOff = [&](const std::vector<OffsetTracker::Key>& revoked,
+                           std::chrono::steady_clock::time_point deadline) {
+            if (config_.spill.commitOnWrite) spillPending();
+            auto settled = [&] {
+                return pending.empty() && flusher.idle() &&
+                       (!spill || config_.spill.commitOnWrite || spill->empty());
+            };
+            while (!settled() && !stop_.load() && std::chrono::steady_clock::now() < deadline) {
+                if (flusher.ready(std::chrono::steady_clock::now())) submitNext();
+                if (flusher.transferring()) {
+                    flusher.poll(10ms);
+                } else {
+                    flusher.poll(0ms);
+                    std::this_thread::sleep_for(10ms);
+                }
+            }
+            if (!settled())
+                spdlog::warn("Rebalance hand-off timed out; the next owner replays uncommitted rows");
+            else if (!pending.offsets.empty())
+                commit(std::exchange(pending, Batch()).offsets); // dead letters only
+            for (auto const& key : revoked) committed.erase(key);
+        };
+
+        // a pending hand-off request, once everything it covers has been collected
+        auto serveHandOff = [&] {
+            const auto seq = handoffRequested_.load();
+            if (seq == handoffDone_.load()) return;
+            std::vector<OffsetTracker::Key> revoked;
+            std::vector<std::size_t> blocks;
+            std::chrono::steady_clock::time_point deadline;
+            {
+                std::lock_guard<std::mutex> lock(handoffMutex_);
+                revoked = handoffRevoked_;
+                blocks = handoffBlocks_;
+                deadline = handoffDeadline_;
+            }
+            const bool expired = std::chrono::steady_clock::now() >= deadline;
+            bool missing = false;
+            for (std::size_t i = 0; i < blocks.size(); ++i) missing |= collected[i] < blocks[i];
+            if (missing && !expired) return;
+            if (expired) spdlog::warn("Rebalance hand-off timed out before its rows reached the sink");
+            else handOff(revoked, deadline);
+            handoffDone_.store(seq);
+        };
+
+        // waits for socket activity while an insert is on the wire, else backs off
+        auto idle = [&](std::chrono::milliseconds timeout) {
+            if (flusher.transferring()) flusher.poll(timeout);
+            else backoff.idle();
+        };
+
+        while (!stop_.load()) {
+            serveHandOff();
+            sinkBytes_.store(static_cast<std::int64_t>(pending.bytes() + flusher.bytes()),
+                             std::memory_order_relaxed);
+
+            // time-based flush even if no messages arrive
+            if (flusher.ready(std::chrono::steady_clock::now())) submitNext();
+            flusher.poll(0ms);
+
+            // a full batch: BATCH_MAX rows, or the bytes one insert can carry within the latency goal
+            const bool full = pending.rows >= config_.batchMax || pending.bytes() >= flusher.batchBytes();
+
+            // while an insert is owed, large batches go to disk instead of stalling Kafka
+            if (spill && !flusher.ready(std::chrono::steady_clock::now()) &&
+                (pending.bytes() >= config_.spill.memoryBytes || full))
+                spillPending();
+
+            // If batch grew and we can't flush yet (1 req/min), stop collecting until the next
+            // flush window; the bounded queues push back on the workers, and the memory budget
+            // pauses the partitions. A hand-off in progress still collects (from the moment the
+            // callback starts), so it can cover everything polled without waiting for a window.
+            if (full && !pending.empty() && handoffRequested_.load() == handoffDone_.load() &&
+                !handoffActive_.load()) {
+                if (inputClosed_.load()) {
+                    // shutting down: unflushed rows stay uncommitted and are replayed
+                    stop_.store(true);
+                    break;
+                }
+                if (!atLimit) {
+                    auto wait = std::max(flusher.nextSlot() - std::chrono::steady_clock::now(),
+                                         std::chrono::steady_clock::duration::zero());
+                    spdlog::info("Batch reached limit ({} rows, {} bytes). Waiting {} ms for next flush window...",
+                                 pending.rows, pending.bytes(),
+                                 std::chrono::duration_cast<std::chrono::milliseconds>(wait).count());
+                    atLimit = true;
+                }
+                if (flusher.transferring()) flusher.poll(10ms);
+                else std::this_thread::sleep_for(10ms);
+                continue;
+            }
+            atLimit = false;
+
+            // blocks are taken in dispatch order, which keeps rows and offsets in poll order;
+            // shards keep each partition in order themselves, so any shard with a block goes
+            std::size_t from = next;
+            bool got = workers_[from]->out.try_pop(block);
+            for (std::size_t k = 1; !got && config_.partitionShards && k < workers_.size(); ++k) {
+                from = (next + k) % workers_.size();
+                got = workers_[from]->out.try_pop(block);
+            }
+            if (!got) {
+                const bool drained = std::all_of(workers_.begin(), workers_.end(),
+                                                 [](auto const& w) { return w->out.empty(); });
+                if (workersDone_.load() && (config_.partitionShards ? drained : workers_[next]->out.empty()))
+                    break;
+                idle(1ms);
+                continue;
+            }
+            backoff.reset();
+            next = (from + 1) % workers_.size();
+            ++collected[from];
+            blockBytes_.fetch_sub(static_cast<std::int64_t>(block->bytes()), std::memory_order_relaxed);
+            pending.append(std::move(*block));
+        }
+
+        // let an insert already on the wire finish so its offsets get committed
+        while (flusher.transferring()) flusher.poll(100ms);
+        // park what is left on disk so the next run replays it instead of re-consuming
+        if (config_.spill.commitOnWrite) spillPending();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
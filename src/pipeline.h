@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "anonymizer.h"
+#include "buffer.h"
+#include "deadletter.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "flusher.h"
+#include "offsets.h"
+#include "queue.h"
+#include "spill.h"
+#include "transform.h"
+
+// ---------------------------------------------------------------------------
+// Staged consumer: poll (calling thread) -> N decode/anonymize/encode workers -> sink.
+//
+// The poll stage hands blocks of messages to the workers round-robin; the sink stage
+// collects the encoded blocks in the same round-robin order, so rows and offsets reach
+// it in poll order. With PIPELINE_SHARDING=partition each worker is a shard instead: it
+// reads the partitions librdkafka forwards to its own queue (KafkaConsumer::shard), with
+// its own decoder and blocks, and the sink takes blocks from whichever shard has one;
+// order only matters per partition, and a partition stays on one shard. The poll stage
+// then just serves the group (rebalances, pause/resume).
+//
+// The sink stage fills the next batch while the Flusher owns the ones in flight (one per
+// sink lane); offsets are committed only after the batch covering them, and every batch
+// submitted before it, was accepted by ClickHouse (at-least-once, as before).
+//
+// With SPILL_DIR set, a batch that outgrows SPILL_MEMORY_MB (or BATCH_MAX) while the
+// Flusher is busy is appended to the on-disk SpillLog instead of stalling the consumer;
+// spilled records are replayed ahead of newer rows. SPILL_COMMIT=on_write commits their
+// offsets once they are on disk, on_insert keeps the old commit-after-insert rule.
+//
+// Memory is bounded in bytes: payloads waiting for a worker, encoded blocks waiting for
+// the sink, the pending batch and the Flusher's batches count against MEMORY_BUDGET_MB.
+// Over the budget, or while the workers cannot take the next block, the poll stage
+// pauses the assigned partitions and keeps calling consume() (rebalance callbacks,
+// max.poll.interval.ms); it resumes them once a flush brings usage under 3/4 of the budget.
+//
+// A message that does not decode or fails validation goes to DeadLetters instead of
+// failing its worker; its offset is committed with the batch it arrived in (after the
+// dead letters are flushed), so a poison message is neither fatal nor replayed forever.
+
+struct PipelineConfig {
+    std::size_t workers = 1;
+    bool partitionShards = false;                     // workers consume their own partitions
+    std::size_t blockMessages = 1024;                 // messages per work item
+    std::chrono::milliseconds blockLinger{20};        // max time spent filling a work item
+    std::size_t queueDepth = 64;                      // work items per queue
+    std::size_t batchMax = 50'000;                    // rows
+    std::chrono::seconds flushEvery{60};              // per sink lane
+    std::size_t batchMaxBytes = 512ull << 20;         // BatchSizer bounds and latency goal
+    std::size_t batchMinBytes = 1ull << 20;
+    std::chrono::milliseconds insertTarget{10'000};
+    std::size_t memoryBudget = 1024ull << 20;         // bytes held before fetching pauses
+    SpillConfig spill;                                // disabled unless SPILL_DIR is set
+    DeadLetterConfig deadLetter;                      // undecodable / invalid records
+    std::chrono::seconds handoffTimeout{60};          // max time a revocation waits for its rows
+    IpMask ipMask;                                    // remote_addr anonymization
+
+    /// PIPELINE_WORKERS, PIPELINE_SHARDING, PIPELINE_BLOCK, PIPELINE_LINGER_MS, PIPELINE_QUEUE, BATCH_MAX,
+    /// BATCH_MAX_MB, BATCH_MIN_MB, INSERT_TARGET_SECONDS, FLUSH_SECONDS, MEMORY_BUDGET_MB,
+    /// REBALANCE_TIMEOUT_SECONDS, SPILL_*, DEAD_LETTER_*, ANONYMIZE_IPV6_PREFIX
+    static PipelineConfig fromEnv();
+};
+
+class Pipeline {
+public:
+    Pipeline(KafkaConsumer& consumer, ClickHouseSink& sink, PipelineConfig config);
+    ~Pipeline();
+
+    /// Runs the stages until `running` turns false; rethrows the first stage failure.
+    void run(const std::atomic<bool>& running);
+
+private:
+    struct WorkItem {
+        MessageBatch messages;
+    };
+    struct Worker {
+        Worker(std::size_t index, std::size_t depth) : index(index), in(depth), out(depth) {}
+        std::size_t index;
+        SpscQueue<std::unique_ptr<WorkItem>> in;
+        SpscQueue<std::unique_ptr<Batch>> out;
+        std::thread thread;
+        std::size_t dispatched = 0;             // items put on `in` (poll thread)
+        std::size_t pushed = 0;                 // blocks put on `out` (worker thread)
+        // shards: last revocation barrier seen, and `pushed` at that point
+        std::atomic<std::uint64_t> barrier{0};
+        std::size_t pushedAtBarrier = 0;
+    };
+
+    void pollStage(const std::atomic<bool>& running);
+    void pollShards(const std::atomic<bool>& running); // PIPELINE_SHARDING=partition
+    void workerStage(Worker& w);
+    void sinkStage();
+
+    // hands the poll stage's current item to the next worker; false if stopping or past `deadline`
+    bool dispatch(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    bool tryDispatch(); // same, false instead of waiting if that worker is full
+    void backpressure(bool blocked); // pauses / resumes fetching
+    std::size_t memoryUsed() const;
+    void handOff(const std::vector<OffsetTracker::Key>& revoked); // from the rebalance callback
+
+    template <typename Q, typename T>
+    bool pushWait(Q& queue, T& item); // false if the pipeline is stopping
+
+    void fail(std::exception_ptr e);
+
+    KafkaConsumer& consumer_;
+    ClickHouseSink& sink_;
+    PipelineConfig config_;
+    DeadLetters deadLetters_;               // written by the workers, flushed before commits
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::thread sinkThread_;
+
+    // poll stage state (the rebalance callback runs on the poll thread too)
+    std::unique_ptr<WorkItem> pollItem_;
+    std::size_t pollNext_ = 0;
+    std::atomic<std::uint64_t> shardBarrier_{0}; // raised by handOff, acknowledged by shards
+
+    // bytes held per stage (MEMORY_BUDGET_MB); each counter is updated where data moves on
+    std::atomic<std::int64_t> payloadBytes_{0}; // polled, not yet encoded
+    std::atomic<std::int64_t> blockBytes_{0};   // encoded, not yet collected by the sink
+    std::atomic<std::int64_t> sinkBytes_{0};    // pending batch plus the Flusher's
+
+    // revocation hand-off: requested by the poll stage, performed by the sink stage
+    std::mutex handoffMutex_;
+    std::vector<OffsetTracker::Key> handoffRevoked_;
+    std::vector<std::size_t> handoffBlocks_; // per worker, blocks the sink must collect first
+    std::chrono::steady_clock::time_point handoffDeadline_;
+    std::atomic<std::uint64_t> handoffRequested_{0};
+    std::atomic<std::uint64_t> handoffDone_{0};
+    std::atomic<bool> handoffActive_{false}; // set for the whole callback: the sink keeps collecting
+
+    std::atomic<bool> inputClosed_{false};  // poll stage finished
+    std::atomic<bool> workersDone_{false};  // all workers drained their input
+    std::atomic<bool> stop_{false};         // a stage failed: everyone bails out
+    std::mutex failureMutex_;
+    std::exception_ptr failure_;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring buffer, lock-free.
+// T must be default-constructible and movable (slots are pre-allocated).
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(std::size_t capacity) {
+        std::size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        slots_.resize(cap);
+        mask_ = cap - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /// Producer side. Moves from `v` only on success.
+    bool try_push(T& v) {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size()) return false;
+        slots_[tail & mask_] = std::move(v);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer side.
+    bool try_pop(T& out) {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        out = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer side: the next element without removing it (nullptr if empty).
+    T* front() {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return nullptr;
+        return &slots_[head & mask_];
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const { return slots_.size(); }
+
+private:
+    std::vector<T> slots_;
+    std::size_t mask_ = 0;
+    alignas(64) std::atomic<std::size_t> head_{0}; // consumer position
+    alignas(64) std::atomic<std::size_t> tail_{0}; // producer position
+};
+
+// Waiting strategy for stages polling an empty/full queue: spin briefly, then sleep.
+class IdleBackoff {
+public:
+    void idle() {
+        if (++spins_ < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    void reset() { spins_ = 0; }
+
+private:
+    unsigned spins_ = 0;
+};
@@ -0,0 +1,199 @@
+#include "replay.h"
+#include "aggregate.h"
+#include "anonymizer.h"
+#include "batch.h"
+#include "deadletter.h"
+#include "flusher.h"
+#include "transform.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include <sys/stat.h>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+bool parseArgs(int argc, char* argv[], ReplayOptions& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error("missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--framing") opt.framing = parseFraming(value());
+        else if (arg == "--out") opt.output = value();
+        else if (arg == "--batch") opt.batchRows = std::stoul(value());
+        else if (opt.input.empty() && !arg.empty() && arg[0] != '-') opt.input = arg;
+        else return false;
+    }
+    return !opt.input.empty() && opt.batchRows > 0;
+}
+
+// Source name in the dedup tokens: the file name, plus a digest of its canonical path, size
+// and mtime, so archives that share a name (one directory per day) do not share tokens
+std::string sourceIdentity(const std::string& path) {
+    char resolved[PATH_MAX];
+    struct stat st{};
+    if (!::realpath(path.c_str(), resolved) || ::stat(resolved, &st) != 0)
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    const std::string key = std::string(resolved) + '\n' + std::to_string(st.st_size) + '\n' +
+                            std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec);
+    std::string name = path.substr(path.find_last_of('/') + 1) + '@' + sha256_hex(key).substr(0, 16);
+    std::replace(name.begin(), name.end(), ',', '_'); // separates the ranges of an identity
+    return name;
+}
+
+// Encoded batches go either to a file or to ClickHouse
+class ReplayOutput {
+public:
+    explicit ReplayOutput(const std::string& target) {
+        if (target == "clickhouse") {
+            sink_ = std::make_unique<ClickHouseSink>();
+            const auto flushEvery = std::chrono::seconds(std::stoull(getEnvOrDefault("FLUSH_SECONDS", "60")));
+            flusher_ = std::make_unique<Flusher>(*sink_, flushEvery, [this](const Batch& b) { inserted_ += b.rows; });
+            format_ = sink_->format();
+            kafkaColumns_ = sink_->kafkaColumns();
+            aggregate_ = sink_->aggregate();
+            return;
+        }
+        format_ = parseInsertFormat(getEnvOrDefault("INSERT_FORMAT", "JSONEachRow"));
+        aggregate_ = getEnvOrDefault("INSERT_AGGREGATE", "0") == "1";
+        kafkaColumns_ = !aggregate_ && getEnvOrDefault("INSERT_KAFKA_COLUMNS", "0") == "1";
+        file_ = target == "-" ? stdout : std::fopen(target.c_str(), "wb");
+        if (!file_) throw std::runtime_error("cannot open " + target);
+    }
+
+    ~ReplayOutput() {
+        if (file_ && file_ != stdout) std::fclose(file_);
+    }
+
+    /// Encoder for the configured output: raw rows, or rows summed per batch (INSERT_AGGREGATE)
+    std::unique_ptr<BatchEncoder> makeEncoder() const {
+        if (aggregate_) return std::make_unique<AggregatingEncoder>(format_);
+        return ::makeEncoder(format_, kafkaColumns_);
+    }
+
+    void write(Batch&& batch) {
+        if (!flusher_) {
+            batch.body.forEachChunk([&](const char* p, std::size_t n) {
+                if (std::fwrite(p, 1, n, file_) != n) throw std::runtime_error("replay output write failed");
+            });
+            return;
+        }
+        // one batch in flight, one being encoded: the backfill runs at the insert cadence
+        while (!flusher_->ready(std::chrono::steady_clock::now())) flusher_->poll(100ms);
+        flusher_->submit(std::move(batch));
+    }
+
+    void finish() {
+        if (flusher_) {
+            while (!flusher_->idle()) flusher_->poll(100ms);
+        } else if (std::fflush(file_) != 0) {
+            throw std::runtime_error("replay output flush failed");
+        }
+    }
+
+    bool toClickHouse() const { return flusher_ != nullptr; }
+
+    /// Rows ClickHouse accepted (summed rows with INSERT_AGGREGATE); clickhouse output only.
+    std::size_t inserted() const { return inserted_; }
+
+private:
+    InsertFormat format_{InsertFormat::JSONEachRow};
+    bool kafkaColumns_{false};
+    bool aggregate_{false};
+    std::FILE* file_{nullptr};
+    std::unique_ptr<ClickHouseSink> sink_;
+    std::unique_ptr<Flusher> flusher_;
+    std::size_t inserted_ = 0;
+};
+
+} // namespace
+
+int run_replay(int argc, char* argv[]) {
+    ReplayOptions opt;
+    try {
+        if (!parseArgs(argc, argv, opt)) {
+            spdlog::error("usage: anonymizer replay <file> [--framing capnp|length] "
+                          "[--out -|path|clickhouse] [--batch rows]");
+            return 2;
+        }
+    } catch (const std::exception& e) {
+        spdlog::error("{}", e.what());
+        return 2;
+    }
+
+    try {
+        const auto started = std::chrono::steady_clock::now();
+        MappedFile file(opt.input);
+        FrameReader frames(file.data(), file.size(), opt.framing);
+        ReplayOutput output(opt.output);
+        RecordDecoder decoder;
+        const IpMask mask = IpMask::fromEnv();
+        auto encoder = output.makeEncoder();
+        DeadLetters deadLetters(DeadLetterConfig::fromEnv()); // bad records are skipped
+        std::string error;
+
+        // message index as the offset: "<file>@<digest>:-1:first-last" names each batch for
+        // dedup; the same batches again only with the same --batch
+        const std::string source = sourceIdentity(opt.input);
+        constexpr std::int32_t kReplayPartition = -1;
+        Batch batch;
+        std::int64_t index = 0;
+        std::size_t records = 0;
+        std::string_view payload;
+        while (frames.next(payload)) {
+            records += transformPayload(payload.data(), payload.size(), decoder, *encoder, mask, kReplayPartition,
+                                        index, &error);
+            if (!error.empty()) {
+                DeadLetter letter;
+                letter.topic = source;
+                letter.partition = kReplayPartition;
+                letter.offset = index;
+                letter.payload = payload;
+                letter.error = error;
+                deadLetters.write(letter);
+            }
+            batch.offsets.add(source, kReplayPartition, index);
+            ++index;
+            if (encoder->rows() >= opt.batchRows) {
+                batch.rows = encoder->rows();
+                batch.body = encoder->finish();
+                output.write(std::exchange(batch, Batch()));
+            }
+        }
+        if (encoder->rows() > 0) {
+            batch.rows = encoder->rows();
+            batch.body = encoder->finish();
+            output.write(std::move(batch));
+        }
+        output.finish();
+        deadLetters.flush();
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        spdlog::info("Replayed {} records from {} messages ({} dead letters, {} bytes, {} copied for alignment, "
+                     "{} packed) from {} in {:.2f}s ({:.0f} records/s)",
+                     records, index, deadLetters.written(), file.size(), decoder.copies(),
+                     decoder.packedPayloads(), opt.input, seconds,
+                     seconds > 0 ? static_cast<double>(records) / seconds : 0.0);
+        if (output.toClickHouse())
+            spdlog::info("ClickHouse confirmed {} rows for the {} records decoded", output.inserted(), records);
+    } catch (const std::exception& e) {
+        spdlog::critical("replay failed: {}", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "frames.h"
+
+// Offline mode: runs an archived dump through the same decode -> anonymize -> encode path
+// as the Kafka pipeline, for backfills and broker-less profiling.
+
+struct ReplayOptions {
+    std::string input;
+    Framing framing = Framing::Capnp;
+    std::string output = "-";    // "-" (stdout), a file path, or "clickhouse"
+    std::size_t batchRows = 50'000;
+};
+
+/// `anonymizer replay <file> [--framing capnp|length] [--out -|path|clickhouse] [--batch rows]`
+/// File output uses INSERT_FORMAT; "clickhouse" inserts through ClickHouseSink at the
+/// FLUSH_SECONDS cadence, with deduplication tokens naming the file (canonical path, size,
+/// mtime) and payload range, so re-running the same unmodified file with the same --batch
+/// is a no-op. Returns the process exit code.
+int run_replay(int argc, char* argv[]);
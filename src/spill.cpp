@@ -0,0 +1,257 @@
+#include "spill.h"
+#include "util.h"
+
+#include <spdlog/spdlog.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::uint32_t kRecordMagic = 0x4C505341;   // "ASPL"
+constexpr std::uint32_t kReleasedMagic = 0x4C504552; // "REPL": inserted, skipped on recovery
+
+// On-disk record: header, `len` body bytes, then the batch's offset identity (`metaLen`
+// bytes), padded to 8 bytes. The header is written last, so a torn write leaves a zero
+// magic and ends the segment on recovery. The CRC covers body and identity.
+struct RecordHeader {
+    std::uint32_t magic;
+    std::uint32_t crc;
+    std::uint64_t rows;
+    std::uint64_t len;
+    std::uint64_t metaLen;
+};
+
+std::size_t align8(std::size_t n) { return (n + 7) & ~std::size_t{7}; }
+
+std::runtime_error sysError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+std::string segmentName(std::uint64_t seq) {
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), "segment-%020" PRIu64 ".spill", seq);
+    return buf;
+}
+
+} // namespace
+
+SpillConfig SpillConfig::fromEnv() {
+    SpillConfig c;
+    c.dir = getEnvOrDefault("SPILL_DIR", "");
+    auto mb = [](const char* name, std::size_t fallback) {
+        return static_cast<std::size_t>(std::stoull(getEnvOrDefault(name, std::to_string(fallback >> 20).c_str()))) << 20;
+    };
+    c.segmentBytes = mb("SPILL_SEGMENT_MB", c.segmentBytes);
+    c.maxBytes = mb("SPILL_MAX_MB", c.maxBytes);
+    c.memoryBytes = mb("SPILL_MEMORY_MB", c.memoryBytes);
+    c.replayBytes = mb("SPILL_REPLAY_MB", c.replayBytes);
+    const std::string policy = getEnvOrDefault("SPILL_COMMIT", "on_write");
+    if (policy == "on_write") c.commitOnWrite = true;
+    else if (policy == "on_insert") c.commitOnWrite = false;
+    else throw std::runtime_error("Unknown SPILL_COMMIT: " + policy);
+    return c;
+}
+
+SpillLog::SpillLog(SpillConfig config) : config_(std::move(config)) {
+    // mkdir -p
+    for (std::size_t pos = 1; pos != std::string::npos;) {
+        pos = config_.dir.find('/', pos + 1);
+        const std::string part = config_.dir.substr(0, pos);
+        if (::mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+            throw sysError("spill mkdir " + part);
+    }
+    recover();
+    spdlog::info("Spill log at {}: {} records recovered ({} bytes on disk)", config_.dir,
+                 records_.size(), diskBytes_);
+}
+
+SpillLog::~SpillLog() {
+    for (auto& seg : segments_)
+        closeSegment(*seg, false);
+}
+
+SpillLog::Segment* SpillLog::openSegment(std::uint64_t seq, std::size_t size, bool create) {
+    auto seg = std::make_unique<Segment>();
+    seg->seq = seq;
+    seg->path = config_.dir + "/" + segmentName(seq);
+    seg->fd = ::open(seg->path.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0644);
+    if (seg->fd < 0)
+        throw sysError("spill open " + seg->path);
+    if (create) {
+        // zero-filled preallocation: an unwritten header reads as end-of-segment
+        if (::ftruncate(seg->fd, static_cast<off_t>(size)) != 0)
+            throw sysError("spill ftruncate " + seg->path);
+        if (int dfd = ::open(config_.dir.c_str(), O_RDONLY | O_DIRECTORY); dfd >= 0) {
+            ::fsync(dfd); // make the new file's directory entry durable
+            ::close(dfd);
+        }
+    } else {
+        struct stat st {};
+        if (::fstat(seg->fd, &st) != 0)
+            throw sysError("spill stat " + seg->path);
+        size = static_cast<std::size_t>(st.st_size);
+    }
+    seg->size = size;
+    if (size > 0) {
+        void* map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if (map == MAP_FAILED)
+            throw sysError("spill mmap " + seg->path);
+        seg->map = static_cast<char*>(map);
+    }
+    diskBytes_ += size;
+    segments_.push_back(std::move(seg));
+    return segments_.back().get();
+}
+
+void SpillLog::closeSegment(Segment& seg, bool remove) {
+    if (seg.map) ::munmap(seg.map, seg.size);
+    if (seg.fd >= 0) ::close(seg.fd);
+    seg.map = nullptr;
+    seg.fd = -1;
+    if (remove) {
+        ::unlink(seg.path.c_str());
+        diskBytes_ -= seg.size;
+    }
+}
+
+void SpillLog::recover() {
+    std::vector<std::uint64_t> seqs;
+    if (DIR* d = ::opendir(config_.dir.c_str())) {
+        while (dirent* e = ::readdir(d)) {
+            std::uint64_t seq = 0;
+            char tail[8] = {};
+            if (std::sscanf(e->d_name, "segment-%" SCNu64 ".%7s", &seq, tail) == 2 &&
+                std::strcmp(tail, "spill") == 0)
+                seqs.push_back(seq);
+        }
+        ::closedir(d);
+    }
+    std::sort(seqs.begin(), seqs.end());
+
+    for (auto seq : seqs) {
+        Segment* seg = openSegment(seq, 0, false);
+        std::size_t pos = 0;
+        while (pos + sizeof(RecordHeader) <= seg->size) {
+            RecordHeader h;
+            std::memcpy(&h, seg->map + pos, sizeof(h));
+            const std::size_t body = pos + sizeof(RecordHeader);
+            if ((h.magic != kRecordMagic && h.magic != kReleasedMagic) || h.len > seg->size - body ||
+                h.metaLen > seg->size - body - h.len)
+                break;
+            const std::size_t next = align8(body + h.len + h.metaLen);
+            if (h.magic == kReleasedMagic) {
+                pos = next;
+                continue;
+            }
+            const auto crc = static_cast<std::uint32_t>(crc32(
+                0L, reinterpret_cast<const Bytef*>(seg->map + body), static_cast<uInt>(h.len + h.metaLen)));
+            if (crc != h.crc) {
+                spdlog::warn("Spill segment {}: checksum mismatch at {}, ignoring the rest", seg->path, pos);
+                break;
+            }
+            OffsetTracker offsets;
+            try {
+                offsets = OffsetTracker::fromIdentity(
+                    std::string_view(seg->map + body + h.len, static_cast<std::size_t>(h.metaLen)));
+            } catch (const std::exception& e) {
+                spdlog::warn("Spill segment {}: {}", seg->path, e.what());
+            }
+            records_.push_back(Record{seg, body, static_cast<std::size_t>(h.len),
+                                      static_cast<std::size_t>(h.rows), std::move(offsets)});
+            ++seg->liveRecords;
+            pos = next;
+        }
+        seg->writePos = pos;
+        if (seg->liveRecords == 0) {
+            closeSegment(*seg, true);
+            segments_.pop_back();
+        }
+        nextSeq_ = seq + 1;
+    }
+}
+
+bool SpillLog::append(const Batch& batch) {
+    const std::string identity = batch.offsets.identity();
+    const std::size_t need = align8(sizeof(RecordHeader) + batch.body.size() + identity.size());
+    Segment* seg = (activeWritable_ && !segments_.empty()) ? segments_.back().get() : nullptr;
+    if (!seg || seg->writePos + need > seg->size) {
+        const std::size_t size = std::max(config_.segmentBytes, need);
+        if (diskBytes_ + size > config_.maxBytes) return false;
+        seg = openSegment(nextSeq_++, size, true);
+        activeWritable_ = true;
+    }
+
+    const std::size_t start = seg->writePos;
+    char* out = seg->map + start + sizeof(RecordHeader);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    auto put = [&](const char* p, std::size_t n) {
+        std::memcpy(out, p, n);
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(p), static_cast<uInt>(n));
+        out += n;
+    };
+    batch.body.forEachChunk(put);
+    put(identity.data(), identity.size());
+    RecordHeader h{kRecordMagic, static_cast<std::uint32_t>(crc), batch.rows, batch.body.size(),
+                   identity.size()};
+    std::memcpy(seg->map + start, &h, sizeof(h));
+
+    // msync wants a page-aligned start
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const std::size_t syncFrom = start & ~(page - 1);
+    if (::msync(seg->map + syncFrom, start + need - syncFrom, MS_SYNC) != 0)
+        throw sysError("spill msync " + seg->path);
+
+    records_.push_back(Record{seg, start + sizeof(RecordHeader), batch.body.size(), batch.rows,
+                              batch.offsets});
+    ++seg->liveRecords;
+    seg->writePos = start + need;
+    return true;
+}
+
+Batch SpillLog::peek(std::size_t maxBytes, std::size_t skip) const {
+    Batch out;
+    std::size_t bytes = 0;
+    for (auto it = records_.begin() + static_cast<std::ptrdiff_t>(std::min(skip, records_.size()));
+         it != records_.end(); ++it) {
+        auto const& rec = *it;
+        if (out.spilled > 0 && bytes + rec.len > maxBytes) break;
+        if (!out.body.empty()) out.cuts.push_back(Batch::Cut{out.body.size(), out.rows});
+        out.body.append(rec.segment->map + rec.pos, rec.len);
+        out.rows += rec.rows;
+        out.offsets.merge(rec.offsets);
+        ++out.spilled;
+        bytes += rec.len;
+    }
+    return out;
+}
+
+void SpillLog::release(std::size_t count) {
+    for (; count > 0 && !records_.empty(); --count) {
+        auto& rec = records_.front();
+        // tombstone so a restart does not replay it; losing this write only means a duplicate
+        std::memcpy(rec.segment->map + rec.pos - sizeof(RecordHeader), &kReleasedMagic,
+                    sizeof(kReleasedMagic));
+        --rec.segment->liveRecords;
+        records_.pop_front();
+    }
+    while (!segments_.empty() && segments_.front()->liveRecords == 0) {
+        const bool active = activeWritable_ && segments_.size() == 1;
+        closeSegment(*segments_.front(), true);
+        segments_.pop_front();
+        if (active) activeWritable_ = false;
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "batch.h"
+#include "offsets.h"
+
+// ---------------------------------------------------------------------------
+// Disk spill for encoded batches: an append-only log of memory-mapped segment files.
+// When the in-memory batch passes a threshold (or ClickHouse is unreachable long enough
+// to hit BATCH_MAX) it is written here and replayed oldest-first once inserts succeed,
+// so memory stays bounded and an outage becomes a sequential-I/O backlog.
+
+struct SpillConfig {
+    std::string dir;                                  // empty: spilling disabled
+    std::size_t segmentBytes = 64ull << 20;           // preallocated size of one segment
+    std::size_t maxBytes = 4ull << 30;                // cap for all segments on disk
+    std::size_t memoryBytes = 256ull << 20;           // in-memory batch size that triggers a spill
+    std::size_t replayBytes = 256ull << 20;           // max bytes replayed per insert
+    bool commitOnWrite = true;                        // commit offsets once written (vs. once inserted)
+
+    bool enabled() const { return !dir.empty(); }
+
+    /// SPILL_DIR, SPILL_SEGMENT_MB, SPILL_MAX_MB, SPILL_MEMORY_MB, SPILL_REPLAY_MB,
+    /// SPILL_COMMIT (on_write|on_insert)
+    static SpillConfig fromEnv();
+};
+
+class SpillLog {
+public:
+    /// Opens (creating if needed) `config.dir` and recovers segments left by a previous run.
+    explicit SpillLog(SpillConfig config);
+    ~SpillLog();
+
+    SpillLog(const SpillLog&) = delete;
+    SpillLog& operator=(const SpillLog&) = delete;
+
+    /// Durably appends the batch (msync before returning). Returns false without writing
+    /// anything if it would exceed the size cap.
+    bool append(const Batch& batch);
+
+    bool empty() const { return records_.empty(); }
+
+    /// Records waiting for replay and the bytes they occupy on disk.
+    std::size_t records() const { return records_.size(); }
+    std::size_t bytesOnDisk() const { return diskBytes_; }
+
+    /// Copies the oldest records after the first `skip` (at least one, up to `maxBytes`)
+    /// into a batch for replay; they stay in the log until release(). `skip` passes over
+    /// records already in flight on another lane. Sets `Batch::spilled` to the record count.
+    /// The grouping is deterministic, so a replay after a restart carries the same offsets
+    /// (and insert deduplication token) as the attempt before it.
+    Batch peek(std::size_t maxBytes, std::size_t skip = 0) const;
+
+    /// Drops the `count` oldest records once inserted; fully replayed segments are deleted.
+    void release(std::size_t count);
+
+    const SpillConfig& config() const { return config_; }
+
+private:
+    struct Segment {
+        std::uint64_t seq = 0;
+        std::string path;
+        int fd = -1;
+        char* map = nullptr;
+        std::size_t size = 0;      // mapped/file size
+        std::size_t writePos = 0;  // next record position
+        std::size_t liveRecords = 0;
+    };
+    struct Record {
+        Segment* segment;
+        std::size_t pos;           // of the body
+        std::size_t len;
+        std::size_t rows;
+        OffsetTracker offsets;     // persisted as the batch identity
+    };
+
+    void recover();
+    Segment* openSegment(std::uint64_t seq, std::size_t size, bool create);
+    void closeSegment(Segment& seg, bool remove);
+
+    SpillConfig config_;
+    std::deque<std::unique_ptr<Segment>> segments_; // oldest first; back() is written to
+    std::deque<Record> records_;
+    std::uint64_t nextSeq_ = 0;
+    std::size_t diskBytes_ = 0;
+    bool activeWritable_ = false;   // recovered segments are never appended to
+};
@@ -0,0 +1,175 @@
+#include "transform.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <capnp/any.h>
+#include <capnp/serialize.h>
+#include <kj/exception.h>
+#include "http_log.capnp.h"
+
+#include <array>
+#include <chrono>
+#include <string_view>
+#include <vector>
+
+static std::string_view textView(capnp::Text::Reader t) {
+    return std::string_view(t.cStr(), t.size());
+}
+
+const char* validateRow(const LogRow& row, std::uint64_t nowMillis) {
+    constexpr std::uint64_t kMinTimestamp = 946'684'800'000; // 2000-01-01
+    constexpr std::uint64_t kClockSkew = 24ull * 3600 * 1000;
+    if (row.timestampEpochMilli < kMinTimestamp) return "timestamp before 2000";
+    if (row.timestampEpochMilli > nowMillis + kClockSkew) return "timestamp in the future";
+    if (row.responseStatus < 100 || row.responseStatus > 599) return "response status out of range";
+    if (row.method.empty()) return "empty method";
+    if (row.remoteAddr.empty()) return "empty remote address";
+    if (row.url.empty()) return "empty url";
+    return nullptr;
+}
+
+// Validation clock (epoch ms), refreshed every 1024 calls.
+static std::uint64_t validationNow() {
+    thread_local std::uint32_t calls = 0;
+    thread_local std::uint64_t nowMillis = 0;
+    if (nowMillis == 0 || (++calls & 1023) == 0)
+        nowMillis = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   std::chrono::system_clock::now().time_since_epoch())
+                                                   .count());
+    return nowMillis;
+}
+
+// One decoded record, checked only: why it would be rejected, nullptr if it is fine;
+// throws if the record is corrupt.
+static const char* checkRecord(HttpLogRecord::Reader r) {
+    LogRow row;
+    rowgen::readRow(r, row, textView);
+    return validateRow(row, validationNow());
+}
+
+// One decoded record: validated (unless checkRecord() passed it already), anonymized,
+// appended. Returns why it was rejected, nullptr once appended; throws if the record is
+// corrupt.
+static const char* transformRecord(HttpLogRecord::Reader r, BatchEncoder& encoder, const IpMask& mask,
+                                   std::int32_t partition, std::int64_t offset, bool checked) {
+    // stage timings for 1 record in 64 keep the clock reads off the hot path
+    thread_local std::uint32_t sample = 0;
+    const bool timed = (++sample & 63) == 0;
+    std::chrono::steady_clock::time_point t0, t1, t2;
+    if (timed) t0 = std::chrono::steady_clock::now();
+
+    LogRow row;
+    rowgen::readRow(r, row, textView);
+    if (!checked)
+        if (const char* invalid = validateRow(row, validationNow())) return invalid;
+    row.kafkaPartition = partition;
+    row.kafkaOffset = offset;
+    if (timed) t1 = std::chrono::steady_clock::now();
+
+    // anonymization of the $anonymize fields (addresses) + encoding in the insert format
+    std::array<AnonymizedIp, rowgen::kAnonymizedFields> anonymized;
+    std::size_t next = 0;
+    rowgen::anonymizeRow(row, [&](std::string_view raw) {
+        AnonymizedIp& addr = anonymized[next++];
+        addr = anonymize_ip_fixed(raw, mask);
+        if (!addr.valid) metrics().invalidAddresses.inc();
+        return addr.view();
+    });
+    if (timed) t2 = std::chrono::steady_clock::now();
+    encoder.append(row);
+
+    if (timed) {
+        using Seconds = std::chrono::duration<double>;
+        auto& m = metrics();
+        m.decodeSeconds.observe(Seconds(t1 - t0).count());
+        m.anonymizeSeconds.observe(Seconds(t2 - t1).count());
+        m.encodeSeconds.observe(Seconds(std::chrono::steady_clock::now() - t2).count());
+    }
+    return nullptr;
+}
+
+std::size_t transformPayload(const void* payload, std::size_t len, RecordDecoder& decoder,
+                             BatchEncoder& encoder, const IpMask& mask, std::int32_t partition,
+                             std::int64_t offset, std::string* error) {
+    if (error) error->clear();
+    const std::vector<kj::ArrayPtr<const capnp::word>>* messages;
+    try {
+        messages = &decoder.messages(payload, len);
+    } catch (const std::exception& e) {
+        if (error) *error = std::string("decode: ") + e.what();
+        return 0;
+    }
+
+    // a record message, or an envelope: a root struct with no data and one pointer
+    auto envelope = [](capnp::AnyStruct::Reader root) {
+        return root.getDataSection().size() == 0 && root.getPointerSection().size() == 1;
+    };
+
+    std::size_t appended = 0;
+    std::size_t records = 0;
+    std::size_t rejected = 0;
+    std::size_t firstRejected = 0;
+    auto reject = [&](std::string why) {
+        if (error && error->empty()) {
+            *error = std::move(why);
+            firstRejected = records;
+        }
+        ++rejected;
+        ++records;
+    };
+    // the getters throw on a corrupt message; nothing reaches the encoder before validation
+    auto decoding = [&](auto&& fn) {
+        try {
+            fn();
+        } catch (const kj::Exception& e) {
+            reject(std::string("decode: ") + e.getDescription().cStr());
+        } catch (const std::exception& e) {
+            reject(std::string("decode: ") + e.what());
+        }
+    };
+    auto forEachRecord = [&](auto&& visit) {
+        for (const auto& message : *messages) {
+            decoding([&] {
+                capnp::FlatArrayMessageReader reader(message, decoder.options(message));
+                const capnp::AnyStruct::Reader root = reader.getRoot<capnp::AnyStruct>();
+                if (envelope(root)) {
+                    for (HttpLogRecord::Reader r : root.as<HttpLogBatch>().getRecords()) decoding([&] { visit(r); });
+                } else {
+                    decoding([&] { visit(root.as<HttpLogRecord>()); });
+                }
+            });
+        }
+    };
+
+    // A message with a rejected record is dead-lettered whole, so it is inserted all or
+    // nothing (reprocessing the letter must not add rows twice): with more than one record,
+    // every one is decoded and validated before any reaches the encoder.
+    bool several = messages->size() > 1;
+    if (messages->size() == 1) {
+        try {
+            capnp::FlatArrayMessageReader reader(messages->front(), decoder.options(messages->front()));
+            several = envelope(reader.getRoot<capnp::AnyStruct>());
+        } catch (...) {
+            // corrupt: the single pass below rejects it
+        }
+    }
+    if (several) {
+        forEachRecord([&](HttpLogRecord::Reader r) {
+            if (const char* invalid = checkRecord(r)) return reject(invalid);
+            ++records;
+        });
+        if (rejected) {
+            if (error)
+                *error = std::to_string(rejected) + " of " + std::to_string(records) +
+                         " records rejected (none inserted), first #" + std::to_string(firstRejected) + ": " + *error;
+            return 0;
+        }
+        records = 0;
+    }
+    forEachRecord([&](HttpLogRecord::Reader r) {
+        if (const char* invalid = transformRecord(r, encoder, mask, partition, offset, several)) return reject(invalid);
+        ++appended;
+        ++records;
+    });
+    return appended;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "util.h"
+
+// Per-record hot path shared by the pipeline workers and the benchmarks (no Kafka deps)
+
+// Checks what ClickHouse and the dashboards rely on: a timestamp between 2000 and a day
+// past `nowMillis` (epoch ms), an HTTP status, and non-empty method, address and URL.
+// Returns why the row is rejected, nullptr if it is fine.
+const char* validateRow(const LogRow& row, std::uint64_t nowMillis);
+
+// Decodes one Kafka payload, validates, anonymizes and appends its records to `encoder`.
+// A payload is one or more capnp messages, packed or not (RecordDecoder::messages), each
+// an HttpLogRecord or an HttpLogBatch envelope. `mask` configures the address
+// anonymization; `partition`/`offset` identify the message for the optional Kafka columns
+// (shared by all its records). Returns the records appended. A payload is all or nothing:
+// if one of its records does not decode (traversal limits included) or fails validateRow(),
+// or it does not split into messages, none is appended, so the dead letter holding the
+// whole payload is the only copy of its rows. `error` is cleared, and gets why if any was
+// rejected (how many of how many, and the index of the first).
+std::size_t transformPayload(const void* payload, std::size_t len, RecordDecoder& decoder,
+                             BatchEncoder& encoder, const IpMask& mask = {}, std::int32_t partition = 0,
+                             std::int64_t offset = 0, std::string* error = nullptr);
@@ -1,13 +1,231 @@
 #include "util.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 
-std::string anonymize_ip(std::string_view ip) {
-    auto dot = ip.rfind('.');
-    return (dot == std::string_view::npos) ? std::string(ip)
-                                           : std::string(ip.substr(0, dot)) + ".X";
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// anonymize_ip: strict parsers into binary form, then the masked text is written
+// straight into AnonymizedIp::data
+
+namespace {
+
+// Exactly four decimal octets, no leading zeros (inet_pton rules)
+bool parseIpv4(std::string_view s, std::uint8_t out[4]) {
+    std::size_t i = 0;
+    for (int part = 0; part < 4; ++part) {
+        if (part > 0) {
+            if (i == s.size() || s[i] != '.') return false;
+            ++i;
+        }
+        const std::size_t start = i;
+        unsigned v = 0;
+        while (i < s.size() && i - start < 3 && s[i] >= '0' && s[i] <= '9') v = v * 10 + (s[i++] - '0');
+        const std::size_t digits = i - start;
+        if (digits == 0 || v > 255 || (digits > 1 && s[start] == '0')) return false;
+        out[part] = static_cast<std::uint8_t>(v);
+    }
+    return i == s.size();
+}
+
+#if defined(__SSE2__)
+// Same rules as parseIpv4 checked on all bytes at once: one bit per byte for dots,
+// digits, '0', '2', '5' and "> 2"/"> 5", so random octet widths cost no mispredicts.
+bool isIpv4(std::string_view s) {
+    if (s.size() < 7 || s.size() > 15) return false;
+    alignas(16) char buf[16] = {};
+    std::memcpy(buf, s.data(), s.size());
+    const __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(buf));
+    auto bits = [](__m128i m) { return static_cast<unsigned>(_mm_movemask_epi8(m)); };
+    const __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    const unsigned digit = bits(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d));
+    const unsigned dot = bits(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    const unsigned zero = bits(_mm_cmpeq_epi8(v, _mm_set1_epi8('0')));
+    const unsigned two = bits(_mm_cmpeq_epi8(v, _mm_set1_epi8('2')));
+    const unsigned five = bits(_mm_cmpeq_epi8(v, _mm_set1_epi8('5')));
+    const unsigned aboveTwo = bits(_mm_cmpgt_epi8(v, _mm_set1_epi8('2')));
+    const unsigned aboveFive = bits(_mm_cmpgt_epi8(v, _mm_set1_epi8('5')));
+
+    const unsigned all = (1u << s.size()) - 1;
+    const unsigned start = digit & ~(digit << 1);       // first digit of each octet
+    const unsigned three = start & (digit >> 1) & (digit >> 2);
+    unsigned bad = (digit | dot) ^ all;                 // other bytes
+    bad |= digit & (digit >> 1) & (digit >> 2) & (digit >> 3); // 4+ digits
+    bad |= dot & ((dot >> 1) | 1 | (all ^ (all >> 1))); // "..", leading or trailing dot
+    bad |= start & zero & (digit >> 1);                 // leading zero
+    bad |= three & (aboveTwo | (two & ((aboveFive >> 1) | (five >> 1 & aboveFive >> 2)))); // > 255
+    return bad == 0 && __builtin_popcount(dot) == 3;
+}
+#else
+bool isIpv4(std::string_view s) {
+    std::uint8_t unused[4];
+    return parseIpv4(s, unused);
+}
+#endif
+
+constexpr auto kHexValue = [] {
+    std::array<std::int8_t, 256> t{};
+    for (auto& v : t) v = -1;
+    for (int c = '0'; c <= '9'; ++c) t[c] = static_cast<std::int8_t>(c - '0');
+    for (int c = 'a'; c <= 'f'; ++c) t[c] = t[c - 'a' + 'A'] = static_cast<std::int8_t>(c - 'a' + 10);
+    return t;
+}();
+
+// RFC 4291 text form: up to 8 groups, at most one "::", optional trailing dotted quad
+// and "%zone" (ignored)
+bool parseIpv6(std::string_view s, std::uint8_t out[16]) {
+    if (auto zone = s.find('%'); zone != std::string_view::npos) {
+        if (zone + 1 == s.size()) return false;
+        s = s.substr(0, zone);
+    }
+    if (s.size() < 2) return false;
+
+    std::uint16_t groups[8];
+    int n = 0;
+    int gap = -1; // index where "::" expands
+    std::size_t i = 0;
+    if (s[0] == ':') {
+        if (s[1] != ':') return false;
+        gap = 0;
+        i = 2;
+    }
+    while (i < s.size()) {
+        if (n == 8) return false;
+        const std::size_t start = i;
+        unsigned v = 0;
+        for (int h; i < s.size() && i - start < 4 && (h = kHexValue[static_cast<unsigned char>(s[i])]) >= 0; ++i)
+            v = v * 16 + h;
+        if (i < s.size() && s[i] == '.') {
+            // embedded IPv4 ends the address and fills two groups
+            std::uint8_t v4[4];
+            if (n > 6 || !parseIpv4(s.substr(start), v4)) return false;
+            groups[n++] = static_cast<std::uint16_t>(v4[0] << 8 | v4[1]);
+            groups[n++] = static_cast<std::uint16_t>(v4[2] << 8 | v4[3]);
+            break;
+        }
+        if (i == start) return false;
+        groups[n++] = static_cast<std::uint16_t>(v);
+        if (i == s.size()) break;
+        if (s[i++] != ':') return false;
+        if (i < s.size() && s[i] == ':') {
+            if (gap >= 0) return false;
+            gap = n;
+            ++i;
+        } else if (i == s.size()) {
+            return false; // trailing single ':'
+        }
+    }
+    if (gap < 0 ? n != 8 : n > 7) return false;
+
+    const int zeros = 8 - n;
+    for (int g = 0, src = 0; g < 8; ++g) {
+        const bool filler = gap >= 0 && g >= gap && g < gap + zeros;
+        const std::uint16_t v = filler ? 0 : groups[src++];
+        out[2 * g] = static_cast<std::uint8_t>(v >> 8);
+        out[2 * g + 1] = static_cast<std::uint8_t>(v);
+    }
+    return true;
+}
+
+// Writers return the end of what they wrote
+
+char* writeMaskedIpv4(char* p, const std::uint8_t* v4) {
+    for (int i = 0; i < 3; ++i) {
+        const unsigned v = v4[i];
+        if (v >= 100) *p++ = static_cast<char>('0' + v / 100);
+        if (v >= 10) *p++ = static_cast<char>('0' + v / 10 % 10);
+        *p++ = static_cast<char>('0' + v % 10);
+        *p++ = '.';
+    }
+    *p++ = 'X';
+    return p;
+}
+
+// RFC 5952: lowercase, no leading zeros, longest run of two or more zero groups
+// (first on ties) as "::"
+char* writeIpv6(char* p, const std::uint8_t* a) {
+    std::uint16_t g[8];
+    for (int i = 0; i < 8; ++i) g[i] = static_cast<std::uint16_t>(a[2 * i] << 8 | a[2 * i + 1]);
+    int bestStart = -1, bestLen = 1;
+    for (int i = 0; i < 8;) {
+        if (g[i] != 0) {
+            ++i;
+            continue;
+        }
+        int j = i;
+        while (j < 8 && g[j] == 0) ++j;
+        if (j - i > bestLen) {
+            bestStart = i;
+            bestLen = j - i;
+        }
+        i = j;
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (i == bestStart) {
+            *p++ = ':';
+            if (i == 0) *p++ = ':';
+            i += bestLen - 1;
+            continue;
+        }
+        const unsigned v = g[i];
+        const int digits = v >= 0x1000 ? 4 : v >= 0x100 ? 3 : v >= 0x10 ? 2 : 1;
+        for (int k = digits - 1; k >= 0; --k) *p++ = "0123456789abcdef"[(v >> (4 * k)) & 0xf];
+        if (i < 7) *p++ = ':';
+    }
+    return p;
+}
+
+} // namespace
+
+IpMask IpMask::fromEnv() {
+    IpMask m;
+    m.ipv6Prefix = std::stoi(getEnvOrDefault("ANONYMIZE_IPV6_PREFIX", "48"));
+    if (m.ipv6Prefix < 0 || m.ipv6Prefix > 128)
+        throw std::runtime_error("ANONYMIZE_IPV6_PREFIX must be between 0 and 128");
+    return m;
+}
+
+AnonymizedIp anonymize_ip_fixed(std::string_view ip, const IpMask& mask) {
+    AnonymizedIp out;
+    char* end = out.data;
+    std::uint8_t a[16];
+    if (isIpv4(ip)) {
+        // validated text is already canonical: keep it up to the last dot
+        const std::size_t keep = ip.rfind('.') + 1;
+        std::memcpy(end, ip.data(), keep);
+        end += keep;
+        *end++ = 'X';
+        out.valid = true;
+    } else if (parseIpv6(ip, a)) {
+        static constexpr std::uint8_t kMappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (std::memcmp(a, kMappedPrefix, sizeof(kMappedPrefix)) == 0) {
+            // ::ffff:a.b.c.d carries an IPv4 client: mask it like one
+            std::memcpy(end, "::ffff:", 7);
+            end = writeMaskedIpv4(end + 7, a + 12);
+        } else {
+            for (int byte = 0; byte < 16; ++byte) {
+                const int keep = std::clamp(mask.ipv6Prefix - 8 * byte, 0, 8);
+                a[byte] &= static_cast<std::uint8_t>(0xff00u >> keep);
+            }
+            end = writeIpv6(end, a);
+        }
+        out.valid = true;
+    } else {
+        *end++ = 'X';
+    }
+    out.size = static_cast<std::uint8_t>(end - out.data);
+    return out;
+}
+
+std::string anonymize_ip(std::string_view ip, const IpMask& mask) {
+    return std::string(anonymize_ip_fixed(ip, mask).view());
 }
 
 std::string join_rows(const std::vector<std::string> &rows) {
@@ -30,28 +248,160 @@ std::string getRequiredEnv(const char* name) {
     throw std::runtime_error(std::string("Required env var not set: ") + name);
 }
 
+// ---------------------------------------------------------------------------
+// escape_json: the scan kernels return the index of the first byte at or after `i`
+// that needs escaping ('"', '\\' or < 0x20), or `n` if there is none.
+
+namespace {
+
+inline bool needsEscape(unsigned char c) { return c == '"' || c == '\\' || c < 0x20; }
+
+std::size_t findEscapeScalar(const char* p, std::size_t n, std::size_t i) {
+    while (i < n && !needsEscape(static_cast<unsigned char>(p[i]))) ++i;
+    return i;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define ANONYMIZER_X86_SIMD 1
+
+__attribute__((target("sse2")))
+std::size_t findEscapeSse2(const char* p, std::size_t n, std::size_t i) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v)); // v <= 0x1f
+        if (int mask = _mm_movemask_epi8(hit)) return i + static_cast<std::size_t>(__builtin_ctz(mask));
+    }
+    return findEscapeScalar(p, n, i);
+}
+
+__attribute__((target("avx2")))
+std::size_t findEscapeAvx2(const char* p, std::size_t n, std::size_t i) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+        if (auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hit)))
+            return i + static_cast<std::size_t>(__builtin_ctz(mask));
+    }
+    // clean upper state before legacy SSE code (the compiler skips it on tail calls)
+    _mm256_zeroupper();
+    return findEscapeSse2(p, n, i);
+}
+#endif
+
+using FindEscapeFn = std::size_t (*)(const char*, std::size_t, std::size_t);
+
+struct Kernel {
+    const char* name;
+    FindEscapeFn fn;
+};
+
+Kernel bestKernel() {
+#ifdef ANONYMIZER_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) return {"avx2", findEscapeAvx2};
+    if (__builtin_cpu_supports("sse2")) return {"sse2", findEscapeSse2};
+#endif
+    return {"scalar", findEscapeScalar};
+}
+
+Kernel g_kernel = bestKernel();
+
+} // namespace
+
+const char* escape_json_kernel() { return g_kernel.name; }
+
+bool set_escape_json_kernel(std::string_view name) {
+    if (name == "scalar") {
+        g_kernel = {"scalar", findEscapeScalar};
+        return true;
+    }
+#ifdef ANONYMIZER_X86_SIMD
+    if (name == "sse2" && __builtin_cpu_supports("sse2")) {
+        g_kernel = {"sse2", findEscapeSse2};
+        return true;
+    }
+    if (name == "avx2" && __builtin_cpu_supports("avx2")) {
+        g_kernel = {"avx2", findEscapeAvx2};
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::size_t escape_json_scan(const char* p, std::size_t n, std::size_t i) {
+    return g_kernel.fn(p, n, i);
+}
+
+void escape_json_append(std::string& out, std::string_view s) {
+    escape_json_to(s, [&](const char* p, std::size_t n) { out.append(p, n); });
+}
+
 std::string escape_json(std::string_view s) {
     std::string out;
     out.reserve(s.size() + 8);
-    for (char c : s) {
-        switch (c) {
-            case '"': out += "\\\""; break;
-            case '\\': out += "\\\\"; break;
-            case '\b': out += "\\b"; break;
-            case '\f': out += "\\f"; break;
-            case '\n': out += "\\n"; break;
-            case '\r': out += "\\r"; break;
-            case '\t': out += "\\t"; break;
-            default:
-                if (static_cast<unsigned char>(c) < 0x20) {
-                    char buf[7];
-                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
-                    out += buf;
-                } else {
-                    out += c;
-                }
+    escape_json_append(out, s);
+    return out;
+}
+
+std::string sha256_hex(std::string_view data) {
+    static constexpr std::uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    std::uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    // message + 0x80 + zero padding + 64-bit big-endian bit length, in 64-byte blocks
+    std::string m(data);
+    const std::uint64_t bits = static_cast<std::uint64_t>(data.size()) * 8;
+    m += static_cast<char>(0x80);
+    while (m.size() % 64 != 56) m += '\0';
+    for (int i = 7; i >= 0; --i) m += static_cast<char>(bits >> (8 * i));
+
+    for (std::size_t block = 0; block < m.size(); block += 64) {
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            const auto* p = reinterpret_cast<const unsigned char*>(m.data() + block + 4 * i);
+            w[i] = (std::uint32_t{p[0]} << 24) | (std::uint32_t{p[1]} << 16) | (std::uint32_t{p[2]} << 8) | p[3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
         }
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            const std::uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
     }
+
+    static constexpr char kHex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(64);
+    for (std::uint32_t v : h)
+        for (int shift = 28; shift >= 0; shift -= 4) out += kHex[(v >> shift) & 0xf];
     return out;
 }
-
@@ -1,13 +1,39 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <vector>
 
 // Lightweight helpers (no heavy deps) used across the project
 
-// Masks last IPv4 octet: 1.2.3.4 -> 1.2.3.X ; returns input if not IPv4 dotted
-std::string anonymize_ip(std::string_view ip);
+// How anonymize_ip masks addresses
+struct IpMask {
+    int ipv6Prefix = 48; // leading IPv6 bits kept, 0..128
+
+    /// ANONYMIZE_IPV6_PREFIX; throws when out of range
+    static IpMask fromEnv();
+};
+
+// Anonymized address in a fixed buffer (no heap); longest output is a full IPv6 address
+struct AnonymizedIp {
+    char data[40];
+    std::uint8_t size = 0;
+    bool valid = false; // false: input was not an IP address and is fully masked
+
+    std::string_view view() const { return std::string_view(data, size); }
+};
+
+// Validates and masks a client address:
+//   IPv4 dotted quad      1.2.3.4          -> 1.2.3.X
+//   IPv4-mapped IPv6      ::ffff:1.2.3.4   -> ::ffff:1.2.3.X
+//   IPv6 (zone dropped)   2001:db8:1:2::3  -> 2001:db8:1:: (RFC 5952 form, /48)
+// Anything else becomes "X".
+AnonymizedIp anonymize_ip_fixed(std::string_view ip, const IpMask& mask = {});
+
+// anonymize_ip_fixed as a string
+std::string anonymize_ip(std::string_view ip, const IpMask& mask = {});
 
 // Joins lines with trailing newline per row (ClickHouse JSONEachRow expects newline-separated rows)
 std::string join_rows(const std::vector<std::string>& rows);
@@ -18,6 +44,52 @@ std::string getEnvOrDefault(const char* name, const char* fallback);
 // Reads env var or throws if unset/empty. Use for required config.
 std::string getRequiredEnv(const char* name);
 
+// SHA-256 of `data` as 64 lowercase hex digits; fixed-length names for long identities
+std::string sha256_hex(std::string_view data);
+
 // Escapes a string for safe JSON emission
 std::string escape_json(std::string_view s);
 
+// Appends the JSON-escaped `s` to `out` (no temporary string). Clean runs are found
+// 16/32 bytes at a time (SSE2/AVX2, picked at startup) and copied in bulk.
+void escape_json_append(std::string& out, std::string_view s);
+
+// Index of the first byte at or after `i` that JSON needs escaped, or `n` (active kernel)
+std::size_t escape_json_scan(const char* p, std::size_t n, std::size_t i);
+
+// Escapes `s` for any output: calls `emit(const char*, std::size_t)` for each clean run
+// and each escape sequence, in order.
+template <typename Emit>
+void escape_json_to(std::string_view s, Emit&& emit) {
+    static constexpr char kHex[] = "0123456789abcdef";
+    const char* p = s.data();
+    const std::size_t n = s.size();
+    std::size_t i = 0;
+    while (i < n) {
+        const std::size_t j = escape_json_scan(p, n, i);
+        if (j > i) emit(p + i, j - i);
+        if (j == n) break;
+        const auto c = static_cast<unsigned char>(p[j]);
+        switch (c) {
+            case '"': emit("\\\"", 2); break;
+            case '\\': emit("\\\\", 2); break;
+            case '\b': emit("\\b", 2); break;
+            case '\f': emit("\\f", 2); break;
+            case '\n': emit("\\n", 2); break;
+            case '\r': emit("\\r", 2); break;
+            case '\t': emit("\\t", 2); break;
+            default: {
+                const char u[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+                emit(u, sizeof(u));
+            }
+        }
+        i = j + 1;
+    }
+}
+
+// Active escape_json scan kernel: "avx2", "sse2" or "scalar"
+const char* escape_json_kernel();
+
+// Forces a kernel (tests, benchmarks); false if the CPU or build lacks it
+bool set_escape_json_kernel(std::string_view name);
+
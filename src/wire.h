@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer.h"
+#include "util.h"
+
+// ClickHouse JSONEachRow/RowBinary/Native building blocks shared by the encoders
+
+// ClickHouse binary formats are little-endian; so are all our targets (x86_64, aarch64).
+template <typename T>
+inline void putFixed(ChunkedBuffer& out, T v) {
+    char buf[sizeof(T)];
+    std::memcpy(buf, &v, sizeof(T));
+    out.append(buf, sizeof(T));
+}
+
+inline void putVarUInt(ChunkedBuffer& out, std::uint64_t v) {
+    char buf[10];
+    std::size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = static_cast<char>(static_cast<std::uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = static_cast<char>(v);
+    out.append(buf, n);
+}
+
+inline void putString(ChunkedBuffer& out, std::string_view s) {
+    putVarUInt(out, s.size());
+    out.append(s);
+}
+
+// JSON pieces write into a ChunkedBuffer::prepare() span and return the new end
+
+template <std::size_t N>
+inline char* putLiteral(char* p, const char (&s)[N]) {
+    std::memcpy(p, s, N - 1);
+    return p + N - 1;
+}
+
+// Integers are at most 20 characters (UINT64_MAX, INT64_MIN)
+template <typename T>
+inline char* putDecimal(char* p, T v) {
+    return std::to_chars(p, p + 20, v).ptr;
+}
+
+// Escapes `s` straight into `out`, chunk by chunk
+inline void putJsonString(ChunkedBuffer& out, std::string_view s) {
+    escape_json_to(s, [&](const char* p, std::size_t n) { out.append(p, n); });
+}
+
+// Dictionary-encoded LowCardinality(String) column
+class LowCardinalityColumn {
+public:
+    void append(std::string_view v) {
+        auto it = index_.find(v);
+        if (it == index_.end()) {
+            keys_.emplace_back(v);
+            auto pos = static_cast<std::uint32_t>(keys_.size() - 1);
+            it = index_.emplace(std::string_view(keys_.back()), pos).first;
+        }
+        positions_.push_back(it->second);
+    }
+
+    // SerializationLowCardinality with a per-block dictionary ("additional keys")
+    void serialize(ChunkedBuffer& out) const {
+        constexpr std::uint64_t kSharedDictionariesWithAdditionalKeys = 1;
+        constexpr std::uint64_t kHasAdditionalKeysBit = 1ULL << 9;
+        constexpr std::uint64_t kNeedUpdateDictionary = 1ULL << 10;
+
+        std::uint64_t keyType = 0; // UInt8
+        if (keys_.size() > std::numeric_limits<std::uint8_t>::max()) keyType = 1;
+        if (keys_.size() > std::numeric_limits<std::uint16_t>::max()) keyType = 2;
+
+        putFixed<std::uint64_t>(out, kSharedDictionariesWithAdditionalKeys);
+        putFixed<std::uint64_t>(out, keyType | kHasAdditionalKeysBit | kNeedUpdateDictionary);
+        putFixed<std::uint64_t>(out, keys_.size());
+        for (auto const& k : keys_) putString(out, k);
+        putFixed<std::uint64_t>(out, positions_.size());
+        for (auto p : positions_) {
+            switch (keyType) {
+                case 0: putFixed<std::uint8_t>(out, static_cast<std::uint8_t>(p)); break;
+                case 1: putFixed<std::uint16_t>(out, static_cast<std::uint16_t>(p)); break;
+                default: putFixed<std::uint32_t>(out, p); break;
+            }
+        }
+    }
+
+    // index width is decided at serialize time; count the widest case
+    std::size_t bytes() const { return positions_.size() * sizeof(std::uint32_t); }
+
+    void clear() {
+        index_.clear();
+        keys_.clear();
+        positions_.clear();
+    }
+
+private:
+    std::deque<std::string> keys_; // stable addresses: index_ borrows views into it
+    std::unordered_map<std::string_view, std::uint32_t> index_;
+    std::vector<std::uint32_t> positions_;
+};
@@ -0,0 +1,104 @@
+#include "aggregate.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+
+using Key = std::tuple<std::uint64_t, std::uint16_t, std::string, std::string>;
+using Sums = std::map<Key, std::pair<std::uint64_t, std::uint64_t>>;
+
+static Sums collect(const AggregateMap& m) {
+    Sums out;
+    m.forEach([&](const AggregateRow& r) {
+        auto& s = out[Key(r.resourceId, r.responseStatus, std::string(r.cacheStatus), std::string(r.remoteAddr))];
+        assert(s.second == 0); // each key appears once
+        s = {r.bytesSentSum, r.requestsCount};
+    });
+    return out;
+}
+
+static LogRow row(std::uint64_t resource, std::uint16_t status, const char* cache, const char* addr,
+                  std::uint64_t bytes) {
+    LogRow r;
+    r.resourceId = resource;
+    r.responseStatus = status;
+    r.cacheStatus = cache;
+    r.remoteAddr = addr;
+    r.bytesSent = bytes;
+    r.method = "GET";
+    r.url = "/ignored";
+    return r;
+}
+
+int main() {
+    // sums match a std::map reference through several growths and a merge
+    {
+        static const char* caches[] = {"HIT", "MISS", "EXPIRED"};
+        std::string addrs[50];
+        for (int i = 0; i < 50; ++i) addrs[i] = "10.0." + std::to_string(i) + ".X";
+
+        AggregateMap a(4), b(4);
+        Sums expected;
+        for (std::uint64_t i = 0; i < 20000; ++i) {
+            const auto r = row(i % 37, i % 3 ? 200 : 404, caches[i % 3], addrs[i % 50].c_str(), i);
+            (i % 2 ? a : b).add(r);
+            auto& s = expected[Key(r.resourceId, r.responseStatus, std::string(r.cacheStatus),
+                                   std::string(r.remoteAddr))];
+            s.first += r.bytesSent;
+            s.second += 1;
+        }
+        a.merge(b);
+        assert(a.size() == expected.size());
+        assert(collect(a) == expected);
+    }
+
+    // the key includes both strings: "AB"+"C" and "A"+"BC" stay apart
+    {
+        AggregateMap m;
+        m.add(row(1, 200, "AB", "C", 1));
+        m.add(row(1, 200, "A", "BC", 2));
+        m.add(row(1, 200, "AB", "C", 3));
+        assert(m.size() == 2);
+        const Sums s = collect(m);
+        assert((s.at(Key(1, 200, "AB", "C")) == std::pair<std::uint64_t, std::uint64_t>(4, 2)));
+        assert((s.at(Key(1, 200, "A", "BC")) == std::pair<std::uint64_t, std::uint64_t>(2, 1)));
+    }
+
+    // encoder: rows() counts source records; finish() emits one row per key and resets
+    {
+        AggregatingEncoder enc(InsertFormat::JSONEachRow);
+        enc.append(row(42, 200, "HIT", "1.2.3.X", 100));
+        enc.append(row(42, 200, "HIT", "1.2.3.X", 50));
+        assert(enc.rows() == 2);
+        assert(enc.finish().toString() ==
+               R"({"resource_id":42,"response_status":200,"cache_status":"HIT","remote_addr":"1.2.3.X",)"
+               R"("bytes_sent_sum":150,"requests_count":2})" "\n");
+        assert(enc.rows() == 0 && enc.finish().empty());
+    }
+
+    // RowBinary: u64, u16, two strings, u64, u64
+    {
+        AggregateMap m;
+        m.add(row(7, 304, "MISS", "::ffff:1.2.3.X", 9));
+        const std::string body = encodeAggregates(m, InsertFormat::RowBinary).toString();
+        assert(body.size() == 8 + 2 + 1 + 4 + 1 + 14 + 8 + 8);
+        std::uint64_t count = 0;
+        std::memcpy(&count, body.data() + body.size() - 8, 8);
+        assert(count == 1);
+    }
+
+    // Native: 6 columns with a LowCardinality cache_status
+    {
+        AggregateMap m;
+        m.add(row(1, 200, "HIT", "a", 1));
+        m.add(row(2, 200, "HIT", "b", 1));
+        const std::string body = encodeAggregates(m, InsertFormat::Native).toString();
+        assert(body[0] == 6 && body[1] == 2);
+        assert(body.find("\x0c" "cache_status\x16LowCardinality(String)") != std::string::npos);
+        assert(body.find("\x0erequests_count\x06UInt64") != std::string::npos);
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "buffer.h"
+
+#include <cassert>
+#include <string>
+
+int main() {
+    // appends spanning several small chunks
+    ChunkedBuffer buf(4);
+    buf.append("hello");
+    buf.push_back(' ');
+    buf.append(std::string_view("world"));
+    assert(buf.size() == 11);
+    assert(buf.toString() == "hello world");
+
+    // splice moves chunks without copying and empties the source
+    ChunkedBuffer tail(4);
+    tail.append("!!");
+    buf.splice(std::move(tail));
+    assert(tail.empty());
+    assert(buf.toString() == "hello world!!");
+    buf.append("?");
+    assert(buf.toString() == "hello world!!?");
+
+    // reader: partial reads, end of stream, seek/rewind
+    ChunkedBufferReader reader(buf);
+    char out[32];
+    assert(reader.read(out, 3) == 3 && std::string(out, 3) == "hel");
+    std::size_t n = reader.read(out, sizeof(out));
+    assert(n == buf.size() - 3 && std::string(out, n) == "lo world!!?");
+    assert(reader.read(out, sizeof(out)) == 0);
+    assert(reader.seek(6));
+    assert(reader.read(out, 5) == 5 && std::string(out, 5) == "world");
+    assert(reader.seek(0) && reader.position() == 0);
+    assert(!reader.seek(buf.size() + 1));
+
+    // next(): zero-copy views that stop at chunk boundaries
+    assert(reader.seek(0));
+    std::string joined;
+    for (auto v = reader.next(3); !v.empty(); v = reader.next(3)) {
+        assert(v.size() <= 3);
+        joined += v;
+    }
+    assert(joined == buf.toString());
+
+    buf.clear();
+    assert(buf.empty() && buf.toString().empty());
+    return 0;
+}
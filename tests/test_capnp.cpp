@@ -2,11 +2,17 @@
 #include <capnp/serialize.h>
 #include <capnp/serialize-packed.h>
 #include <kj/array.h>
+#include <kj/io.h>
 #include "http_log.capnp.h"
+#include "decoder.h"
+#include "frames.h"
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 int main() {
     // Build a sample HttpLogRecord
@@ -40,6 +46,72 @@ int main() {
     assert(r.getRemoteAddr() == kj::StringPtr("192.168.1.10"));
     assert(r.getUrl() == kj::StringPtr("/index.html"));
 
+    // RecordDecoder: aligned payloads are read in place, misaligned ones via the arena
+    RecordDecoder decoder;
+    const auto* bytes = reinterpret_cast<const unsigned char*>(flat.begin());
+    const std::size_t len = flat.size() * sizeof(capnp::word);
+    auto inPlace = decoder.words(bytes, len);
+    assert(static_cast<const void*>(inPlace.begin()) == static_cast<const void*>(flat.begin()));
+    assert(decoder.copies() == 0);
+
+    std::vector<unsigned char> shifted(len + 1);
+    std::memcpy(shifted.data() + 1, bytes, len);
+    for (int i = 0; i < 2; ++i) {
+        auto copied = decoder.words(shifted.data() + 1, len);
+        capnp::FlatArrayMessageReader reader2(copied, decoder.options());
+        auto r2 = reader2.getRoot<HttpLogRecord>();
+        assert(r2.getResourceId() == 42);
+        assert(r2.getUrl() == kj::StringPtr("/index.html"));
+    }
+    assert(decoder.copies() == 2);
+
+    // FrameReader splits a dump of standard-framed messages back into whole messages
+    std::string dump(reinterpret_cast<const char*>(bytes), len);
+    root.setUrl("/a/much/longer/url/that/changes/the/message/size");
+    kj::Array<capnp::word> second = capnp::messageToFlatArray(message);
+    dump.append(reinterpret_cast<const char*>(second.begin()), second.size() * sizeof(capnp::word));
+    FrameReader frames(dump.data(), dump.size(), Framing::Capnp);
+    std::string_view payload;
+    assert(frames.next(payload) && payload.size() == len);
+    assert(frames.next(payload) && payload.size() == second.size() * sizeof(capnp::word));
+    assert(!frames.next(payload));
+
+    // RecordDecoder::messages: framed messages back to back, as is or packed
+    const auto& split = decoder.messages(dump.data(), dump.size());
+    assert(split.size() == 2 && split[0].size() == flat.size() && split[1].size() == second.size());
+    {
+        capnp::FlatArrayMessageReader reader3(split[1], decoder.options(split[1]));
+        assert(reader3.getRoot<HttpLogRecord>().getResourceId() == 42);
+    }
+    kj::VectorOutputStream packed;
+    capnp::writePackedMessage(packed, message);
+    assert(packed.getArray().size() < second.size() * sizeof(capnp::word));
+    const auto& unpacked = decoder.messages(packed.getArray().begin(), packed.getArray().size());
+    assert(unpacked.size() == 1 && decoder.packedPayloads() == 1);
+    {
+        capnp::FlatArrayMessageReader reader4(unpacked[0], decoder.options(unpacked[0]));
+        assert(reader4.getRoot<HttpLogRecord>().getUrl() ==
+               kj::StringPtr("/a/much/longer/url/that/changes/the/message/size"));
+    }
+    bool threw = false;
+    try {
+        decoder.messages(packed.getArray().begin(), packed.getArray().size() - 1); // cut mid-word
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // zero runs that would unpack to 2 KiB per 2 bytes are refused, not allocated
+    std::string bomb;
+    for (int i = 0; i < (1 << 19); ++i) bomb += std::string("\x00\xff", 2);
+    threw = false;
+    try {
+        decoder.messages(bomb.data(), bomb.size());
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    assert(threw);
+
     return 0;
 }
 
@@ -0,0 +1,134 @@
+#include "compress.h"
+
+#include <zlib.h>
+#ifdef ANONYMIZER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ANONYMIZER_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <algorithm>
+
+#include <cassert>
+#include <string>
+
+static std::string gunzip(const std::string& in) {
+    z_stream zs{};
+    int rc = inflateInit2(&zs, 15 + 16);
+    assert(rc == Z_OK);
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = static_cast<uInt>(in.size());
+    std::string out;
+    char buf[4096];
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(buf);
+        zs.avail_out = sizeof(buf);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        assert(rc == Z_OK || rc == Z_STREAM_END);
+        out.append(buf, sizeof(buf) - zs.avail_out);
+    } while (rc != Z_STREAM_END);
+    inflateEnd(&zs);
+    return out;
+}
+
+#ifdef ANONYMIZER_WITH_ZSTD
+static std::string unzstd(const std::string& in) {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    assert(dctx);
+    ZSTD_inBuffer ib{in.data(), in.size(), 0};
+    std::string out;
+    std::string buf(ZSTD_DStreamOutSize(), '\0');
+    std::size_t rc = 1; // 0 once the frame is complete and flushed
+    while (rc != 0) {
+        ZSTD_outBuffer ob{&buf[0], buf.size(), 0};
+        const std::size_t before = ib.pos;
+        rc = ZSTD_decompressStream(dctx, &ob, &ib);
+        assert(!ZSTD_isError(rc));
+        assert(ob.pos > 0 || ib.pos > before || rc == 0); // no progress: truncated frame
+        out.append(buf.data(), ob.pos);
+    }
+    assert(ib.pos == ib.size);
+    ZSTD_freeDCtx(dctx);
+    return out;
+}
+#endif
+
+#ifdef ANONYMIZER_WITH_LZ4
+static std::string unlz4(const std::string& in) {
+    LZ4F_dctx* dctx = nullptr;
+    const std::size_t created = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    assert(!LZ4F_isError(created));
+    std::string out;
+    char buf[4096];
+    std::size_t pos = 0;
+    std::size_t rc = 1; // 0 once the frame is complete
+    while (rc != 0) {
+        assert(pos < in.size()); // truncated frame
+        std::size_t dstSize = sizeof(buf);
+        std::size_t srcSize = in.size() - pos;
+        rc = LZ4F_decompress(dctx, buf, &dstSize, in.data() + pos, &srcSize, nullptr);
+        assert(!LZ4F_isError(rc));
+        out.append(buf, dstSize);
+        pos += srcSize;
+    }
+    assert(pos == in.size());
+    LZ4F_freeDecompressionContext(dctx);
+    return out;
+}
+#endif
+
+static std::string drain(CompressingReader& reader, std::size_t step) {
+    std::string out;
+    char buf[512];
+    for (std::size_t n; (n = reader.read(buf, std::min(step, sizeof(buf)))) > 0;)
+        out.append(buf, n);
+    return out;
+}
+
+int main() {
+    assert(parseCodec("none") == Codec::None);
+    assert(parseCodec("gzip") == Codec::Gzip);
+    assert(contentEncoding(Codec::Gzip) == std::string("gzip"));
+    assert(contentEncoding(Codec::None) == nullptr);
+    bool threw = false;
+    try { parseCodec("brotli"); } catch (const std::exception&) { threw = true; }
+    assert(threw);
+
+    // repetitive rows spanning many chunks compress well and round-trip exactly
+    ChunkedBuffer body(1000);
+    for (int i = 0; i < 5000; ++i)
+        body.append("{\"method\":\"GET\",\"url\":\"/media/video/segment-" + std::to_string(i % 50) + ".ts\"}\n");
+    const std::string plain = body.toString();
+
+    auto roundTrip = [&](Codec codec, std::string (*decompress)(const std::string&)) {
+        CompressingReader reader(body, codec, -1);
+        const std::string packed = drain(reader, 7);
+        assert(reader.consumed() == plain.size());
+        assert(reader.produced() == packed.size());
+        assert(packed.size() * 5 < plain.size());
+        assert(decompress(packed) == plain);
+
+        // rewind restarts the stream from scratch (curl resend)
+        reader.rewind();
+        assert(drain(reader, 512) == packed);
+
+        // empty body still yields a valid (empty) stream
+        ChunkedBuffer empty;
+        CompressingReader emptyReader(empty, codec, 1);
+        assert(decompress(drain(emptyReader, 64)).empty());
+    };
+    roundTrip(Codec::Gzip, gunzip);
+#ifdef ANONYMIZER_WITH_ZSTD
+    assert(parseCodec("zstd") == Codec::Zstd);
+    assert(contentEncoding(Codec::Zstd) == std::string("zstd"));
+    roundTrip(Codec::Zstd, unzstd);
+#endif
+#ifdef ANONYMIZER_WITH_LZ4
+    assert(parseCodec("lz4") == Codec::Lz4);
+    assert(contentEncoding(Codec::Lz4) == std::string("lz4"));
+    roundTrip(Codec::Lz4, unlz4);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include "http_log.capnp.h"
+
+#include "deadletter.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "transform.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+static void fill(HttpLogRecord::Builder root, std::uint64_t timestamp, std::uint16_t status, const char* addr) {
+    root.setTimestampEpochMilli(timestamp);
+    root.setResourceId(42);
+    root.setBytesSent(1000);
+    root.setRequestTimeMilli(12);
+    root.setResponseStatus(status);
+    root.setCacheStatus("HIT");
+    root.setMethod("GET");
+    root.setRemoteAddr(addr);
+    root.setUrl("/index.html");
+}
+
+static kj::Array<capnp::word> record(std::uint64_t timestamp, std::uint16_t status, const char* addr) {
+    capnp::MallocMessageBuilder message;
+    fill(message.initRoot<HttpLogRecord>(), timestamp, status, addr);
+    return capnp::messageToFlatArray(message);
+}
+
+int main() {
+    const std::uint64_t now = 1710000000000ULL;
+
+    // validation
+    {
+        LogRow row;
+        row.timestampEpochMilli = now;
+        row.responseStatus = 200;
+        row.method = "GET";
+        row.remoteAddr = "10.0.0.1";
+        row.url = "/";
+        assert(validateRow(row, now) == nullptr);
+        row.timestampEpochMilli = 0;
+        assert(validateRow(row, now) != nullptr);
+        row.timestampEpochMilli = now + 2ull * 24 * 3600 * 1000;
+        assert(validateRow(row, now) != nullptr);
+        row.timestampEpochMilli = now;
+        row.responseStatus = 42;
+        assert(validateRow(row, now) != nullptr);
+        row.responseStatus = 599;
+        row.url = {};
+        assert(validateRow(row, now) != nullptr);
+    }
+
+    // rejected records never reach the encoder
+    {
+        RecordDecoder decoder;
+        auto encoder = makeEncoder(InsertFormat::JSONEachRow);
+        std::string error;
+
+        auto good = record(now, 200, "192.168.1.10");
+        assert(transformPayload(good.begin(), good.size() * sizeof(capnp::word), decoder, *encoder, {}, 0, 0,
+                                &error) == 1);
+        assert(error.empty() && encoder->rows() == 1);
+
+        auto invalid = record(now, 0, "192.168.1.10");
+        assert(transformPayload(invalid.begin(), invalid.size() * sizeof(capnp::word), decoder, *encoder, {}, 0, 1,
+                                &error) == 0);
+        assert(error.find("status") != std::string::npos);
+
+        // garbage: a root pointer far outside the message
+        const unsigned char garbage[] = {0, 0, 0, 0, 2, 0, 0, 0, 0xfc, 0xff, 0xff, 0x7f, 0, 0, 1, 0};
+        assert(transformPayload(garbage, sizeof(garbage), decoder, *encoder, {}, 0, 2, &error) == 0);
+        assert(error.rfind("decode: ", 0) == 0);
+        assert(transformPayload(garbage, 3, decoder, *encoder, {}, 0, 3, &error) == 0);
+        assert(encoder->rows() == 1);
+    }
+
+    // an envelope with one bad record is dead-lettered whole: none of it is appended
+    {
+        RecordDecoder decoder;
+        auto encoder = makeEncoder(InsertFormat::JSONEachRow);
+        std::string error;
+
+        capnp::MallocMessageBuilder message;
+        auto records = message.initRoot<HttpLogBatch>().initRecords(3);
+        fill(records[0], now, 200, "10.0.0.1");
+        fill(records[1], now, 200, "");
+        fill(records[2], now, 404, "10.0.0.2");
+        auto batch = capnp::messageToFlatArray(message);
+        assert(transformPayload(batch.begin(), batch.size() * sizeof(capnp::word), decoder, *encoder, {}, 0, 4,
+                                &error) == 0);
+        assert(encoder->rows() == 0);
+        assert(error == "1 of 3 records rejected (none inserted), first #1: empty remote address");
+
+        fill(records[1], now, 200, "10.0.0.3");
+        auto fixed = capnp::messageToFlatArray(message);
+        assert(transformPayload(fixed.begin(), fixed.size() * sizeof(capnp::word), decoder, *encoder, {}, 0, 5,
+                                &error) == 3);
+        assert(error.empty() && encoder->rows() == 3);
+    }
+
+    // DEAD_LETTER_FILE: one JSON line per letter, key and payload base64
+    {
+        char path[] = "/tmp/test_deadletter_XXXXXX";
+        const int fd = ::mkstemp(path);
+        assert(fd >= 0);
+        ::close(fd);
+
+        DeadLetterConfig config;
+        config.path = path;
+        {
+            DeadLetters letters(config);
+            DeadLetter letter;
+            letter.topic = "http_log";
+            letter.partition = 3;
+            letter.offset = 17;
+            letter.key = "k";
+            letter.payload = std::string_view("foo\0", 4);
+            letter.error = "decode: \"bad\"";
+            letters.write(letter);
+            letters.flush();
+            assert(letters.written() == 1);
+        }
+
+        std::ifstream in(path);
+        std::string line;
+        assert(std::getline(in, line));
+        assert(line == "{\"topic\":\"http_log\",\"partition\":3,\"offset\":17,\"error\":\"decode: \\\"bad\\\"\","
+                       "\"key_base64\":\"aw==\",\"payload_base64\":\"Zm9vAA==\"}");
+        assert(!std::getline(in, line));
+        std::remove(path);
+    }
+
+    // DEAD_LETTER_TOPIC, no broker: the letter times out once, and flush() keeps failing
+    // after that so the offsets it came from are never committed
+    {
+        DeadLetterConfig config;
+        config.topic = "http_log_dead";
+        config.brokers = "127.0.0.1:1";
+        config.deliveryTimeout = std::chrono::milliseconds(500);
+        DeadLetters letters(config);
+        DeadLetter letter;
+        letter.topic = "http_log";
+        letter.payload = "foo";
+        letter.error = "decode: bad";
+        letters.write(letter);
+        auto throws = [&] {
+            try {
+                letters.flush();
+            } catch (const std::runtime_error& e) {
+                return std::string(e.what()).find("1 dead letter(s) not delivered") != std::string::npos;
+            }
+            return false;
+        };
+        assert(throws());
+        assert(throws());
+    }
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "encoder.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static LogRow sampleRow() {
+    LogRow r;
+    r.timestampEpochMilli = 1710000123456ULL;
+    r.resourceId = 42;
+    r.bytesSent = 123456;
+    r.requestTimeMilli = 789;
+    r.responseStatus = 200;
+    r.cacheStatus = "HIT";
+    r.method = "GET";
+    r.remoteAddr = "192.168.1.X";
+    r.url = "/index.html?q=\"x\"";
+    return r;
+}
+
+// The original ostringstream row builder, kept as the golden reference for JSONEachRow
+static std::string referenceEscape(std::string_view s) {
+    std::string out;
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[7];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+static std::string referenceRow(const LogRow& r, bool kafkaColumns) {
+    std::ostringstream oss;
+    oss << R"({"timestamp":)" << (r.timestampEpochMilli / 1000)
+        << R"(,"resource_id":)" << r.resourceId
+        << R"(,"bytes_sent":)" << r.bytesSent
+        << R"(,"request_time_milli":)" << r.requestTimeMilli
+        << R"(,"response_status":)" << r.responseStatus
+        << R"(,"cache_status":")" << referenceEscape(r.cacheStatus)
+        << R"(","method":")" << referenceEscape(r.method)
+        << R"(","remote_addr":")" << referenceEscape(r.remoteAddr)
+        << R"(","url":")" << referenceEscape(r.url) << '"';
+    if (kafkaColumns)
+        oss << R"(,"kafka_partition":)" << r.kafkaPartition << R"(,"kafka_offset":)" << r.kafkaOffset;
+    oss << "}\n";
+    return std::move(oss).str();
+}
+
+int main() {
+    // parseInsertFormat
+    assert(parseInsertFormat("native") == InsertFormat::Native);
+    assert(parseInsertFormat("RowBinary") == InsertFormat::RowBinary);
+    assert(parseInsertFormat("JSONEachRow") == InsertFormat::JSONEachRow);
+    bool threw = false;
+    try { parseInsertFormat("csv"); } catch (const std::exception&) { threw = true; }
+    assert(threw);
+
+    // JSONEachRow keeps the historical row layout
+    {
+        auto enc = makeEncoder(InsertFormat::JSONEachRow);
+        enc->append(sampleRow());
+        enc->append(sampleRow());
+        assert(enc->rows() == 2);
+        const std::string row =
+            R"({"timestamp":1710000123,"resource_id":42,"bytes_sent":123456,"request_time_milli":789,)"
+            R"("response_status":200,"cache_status":"HIT","method":"GET","remote_addr":"192.168.1.X",)"
+            R"("url":"/index.html?q=\"x\""})";
+        assert(enc->finish().toString() == row + "\n" + row + "\n");
+        assert(enc->rows() == 0);
+        assert(enc->finish().empty());
+    }
+
+    // JSONEachRow is byte-identical to the ostringstream builder on edge-case rows,
+    // including rows that straddle chunk boundaries
+    {
+        std::string controls;
+        for (int c = 0; c < 0x20; ++c) controls += static_cast<char>(c);
+        const std::string longUrl = "/" + std::string(300000, 'a') + "\"\\\x01" + std::string(100, 'z');
+        const std::string utf8 = "/caf\xc3\xa9/\xe2\x82\xac?\x7f";
+
+        std::vector<LogRow> rows;
+        auto add = [&](auto&& mutate) {
+            LogRow r = sampleRow();
+            mutate(r);
+            rows.push_back(r);
+        };
+        add([](LogRow&) {});
+        add([](LogRow& r) {
+            r.timestampEpochMilli = r.resourceId = r.bytesSent = r.requestTimeMilli = 0;
+            r.responseStatus = 0;
+            r.cacheStatus = r.method = r.remoteAddr = r.url = {};
+        });
+        add([](LogRow& r) {
+            r.timestampEpochMilli = r.resourceId = r.bytesSent = r.requestTimeMilli =
+                std::numeric_limits<std::uint64_t>::max();
+            r.responseStatus = std::numeric_limits<std::uint16_t>::max();
+            r.kafkaPartition = std::numeric_limits<std::int32_t>::min();
+            r.kafkaOffset = std::numeric_limits<std::int64_t>::min();
+        });
+        add([&](LogRow& r) { r.url = controls; r.method = "\"\\/"; });
+        add([&](LogRow& r) { r.url = utf8; r.cacheStatus = "\t"; });
+        for (int i = 0; i < 3; ++i) add([&](LogRow& r) { r.url = longUrl; r.kafkaOffset = -1; });
+
+        auto check = [&](bool kafka) {
+            auto enc = makeEncoder(InsertFormat::JSONEachRow, kafka);
+            std::string expected;
+            for (auto const& r : rows) {
+                enc->append(r);
+                expected += referenceRow(r, kafka);
+            }
+            assert(enc->bytes() == expected.size());
+            assert(enc->finish().toString() == expected);
+        };
+        for (const char* kernel : {"scalar", "sse2", "avx2"}) {
+            if (!set_escape_json_kernel(kernel)) continue;
+            check(false);
+            check(true);
+        }
+    }
+
+    // RowBinary: 4 + 3*8 + 2 fixed bytes, then varint-prefixed strings
+    {
+        auto enc = makeEncoder(InsertFormat::RowBinary);
+        enc->append(sampleRow());
+        std::string body = enc->finish().toString();
+        auto r = sampleRow();
+        std::size_t expected = 4 + 3 * 8 + 2 + (1 + r.cacheStatus.size()) + (1 + r.method.size()) +
+                               (1 + r.remoteAddr.size()) + (1 + r.url.size());
+        assert(body.size() == expected);
+        std::uint32_t ts = 0;
+        std::memcpy(&ts, body.data(), 4);
+        assert(ts == 1710000123u);
+        assert(body[30] == 3 && body.compare(31, 3, "HIT") == 0);
+    }
+
+    // Native: block header and LowCardinality dictionary shared by repeated values
+    {
+        auto enc = makeEncoder(InsertFormat::Native);
+        auto r = sampleRow();
+        enc->append(r);
+        r.cacheStatus = "MISS";
+        enc->append(r);
+        enc->append(sampleRow());
+        std::string body = enc->finish().toString();
+        assert(body[0] == 9 && body[1] == 3);
+        assert(body.compare(2, 10, "\x09timestamp") == 0);
+        assert(body.compare(12, 9, "\x08" "DateTime") == 0);
+
+        auto pos = body.find("LowCardinality(String)");
+        assert(pos != std::string::npos);
+        const char* p = body.data() + pos + std::strlen("LowCardinality(String)");
+        std::uint64_t version = 0, flags = 0, keys = 0, rows = 0;
+        std::memcpy(&version, p, 8);
+        std::memcpy(&flags, p + 8, 8);
+        std::memcpy(&keys, p + 16, 8);
+        assert(version == 1);
+        assert((flags & 0xff) == 0 && (flags & (1u << 9)) && (flags & (1u << 10)));
+        assert(keys == 2);
+        p += 24;
+        assert(p[0] == 3 && std::memcmp(p + 1, "HIT", 3) == 0);
+        assert(p[4] == 4 && std::memcmp(p + 5, "MISS", 4) == 0);
+        p += 9;
+        std::memcpy(&rows, p, 8);
+        assert(rows == 3);
+        assert(p[8] == 0 && p[9] == 1 && p[10] == 0);
+        assert(enc->rows() == 0);
+    }
+
+    // Kafka identity columns are appended when enabled
+    {
+        auto r = sampleRow();
+        r.kafkaPartition = 3;
+        r.kafkaOffset = 123456789012LL;
+
+        auto json = makeEncoder(InsertFormat::JSONEachRow, true);
+        json->append(r);
+        const std::string line = json->finish().toString();
+        const std::string tail = R"(","kafka_partition":3,"kafka_offset":123456789012})" "\n";
+        assert(line.size() > tail.size() && line.compare(line.size() - tail.size(), tail.size(), tail) == 0);
+
+        auto rb = makeEncoder(InsertFormat::RowBinary, true);
+        rb->append(r);
+        std::string body = rb->finish().toString();
+        std::int32_t partition = 0;
+        std::int64_t offset = 0;
+        std::memcpy(&partition, body.data() + body.size() - 12, 4);
+        std::memcpy(&offset, body.data() + body.size() - 8, 8);
+        assert(partition == 3 && offset == 123456789012LL);
+
+        auto native = makeEncoder(InsertFormat::Native, true);
+        native->append(r);
+        body = native->finish().toString();
+        assert(body[0] == 11 && body[1] == 1);
+        assert(body.find("\x0fkafka_partition\x05Int32") != std::string::npos);
+        assert(body.compare(body.size() - 8, 8, std::string(reinterpret_cast<const char*>(&offset), 8)) == 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "frames.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+template <typename Fn>
+static bool throws(Fn&& fn) {
+    try {
+        fn();
+    } catch (const std::exception&) {
+        return true;
+    }
+    return false;
+}
+
+static void putU32Le(std::string& out, std::uint32_t v) {
+    for (int i = 0; i < 4; ++i) out += static_cast<char>(v >> (8 * i));
+}
+
+static void putU32Be(std::string& out, std::uint32_t v) {
+    for (int i = 3; i >= 0; --i) out += static_cast<char>(v >> (8 * i));
+}
+
+// standard capnp framing: segment table padded to a word, then `words` words per segment
+static std::string capnpMessage(std::initializer_list<std::uint32_t> words, char fill) {
+    std::string m;
+    putU32Le(m, static_cast<std::uint32_t>(words.size() - 1));
+    for (auto w : words) putU32Le(m, w);
+    if (m.size() % 8) putU32Le(m, 0);
+    for (auto w : words) m.append(w * 8, fill);
+    return m;
+}
+
+int main() {
+    assert(parseFraming("capnp") == Framing::Capnp);
+    assert(parseFraming("Length") == Framing::LengthPrefixed);
+    assert(throws([] { parseFraming("csv"); }));
+
+    // length-prefixed: big-endian u32 length, empty payloads allowed
+    {
+        std::string dump;
+        putU32Be(dump, 3);
+        dump += "abc";
+        putU32Be(dump, 0);
+        putU32Be(dump, 300);
+        dump.append(300, 'x');
+        FrameReader r(dump.data(), dump.size(), Framing::LengthPrefixed);
+        std::string_view p;
+        assert(r.next(p) && p == "abc");
+        assert(r.next(p) && p.empty());
+        assert(r.next(p) && p.size() == 300 && p[0] == 'x');
+        assert(!r.next(p) && r.position() == dump.size());
+
+        FrameReader cut(dump.data(), dump.size() - 1, Framing::LengthPrefixed);
+        assert(cut.next(p) && cut.next(p));
+        assert(throws([&] { cut.next(p); }));
+    }
+
+    // capnp: the payload is the whole message, segment table included
+    {
+        const std::string one = capnpMessage({2}, 'a');         // 8-byte table
+        const std::string three = capnpMessage({1, 0, 3}, 'b'); // 16-byte padded table
+        assert(one.size() == 8 + 16 && three.size() == 16 + 32);
+        const std::string dump = one + three + one;
+        FrameReader r(dump.data(), dump.size(), Framing::Capnp);
+        std::string_view p;
+        assert(r.next(p) && p == one);
+        assert(r.next(p) && p == three);
+        assert(r.next(p) && p == one);
+        assert(!r.next(p));
+
+        FrameReader cut(dump.data(), dump.size() - 8, Framing::Capnp);
+        assert(cut.next(p) && cut.next(p));
+        assert(throws([&] { cut.next(p); }));
+
+        std::string bad;
+        putU32Le(bad, 0xffffffffu); // segment count overflows
+        putU32Le(bad, 0);
+        FrameReader garbage(bad.data(), bad.size(), Framing::Capnp);
+        assert(throws([&] { garbage.next(p); }));
+
+        assert(capnpMessageSize(dump.data(), dump.size()) == one.size());
+        assert(capnpMessageSize(three.data(), three.size()) == three.size());
+        assert(capnpMessageSize(three.data(), three.size() - 1) == 0);
+        assert(capnpMessageSize(bad.data(), bad.size()) == 0);
+    }
+
+    // packed capnp: the encoding spec's example, then zero runs and literal runs
+    {
+        std::vector<std::uint64_t> out;
+        const std::string example("\x51\x08\x03\x02\x31\x19\xaa\x01", 8);
+        assert(unpackCapnp(example.data(), example.size(), out, 1024) && out.size() == 2);
+        assert(std::string(reinterpret_cast<const char*>(out.data()), 16) ==
+               std::string("\x08\0\0\0\x03\0\x02\0\x19\0\0\0\xaa\x01\0\0", 16));
+
+        // tag 0x00 + 7 more zero words, tag 0xff + word + 1 literal word
+        const std::string runs("\x00\x07\xff" "12345678" "\x01" "abcdefgh", 20);
+        assert(unpackCapnp(runs.data(), runs.size(), out, 1024) && out.size() == 10);
+        for (int i = 0; i < 8; ++i) assert(out[i] == 0);
+        assert(std::string(reinterpret_cast<const char*>(out.data() + 8), 16) == "12345678abcdefgh");
+
+        assert(unpackCapnp("", 0, out, 1024) && out.empty());
+        assert(!unpackCapnp(example.data(), example.size() - 1, out, 1024)); // literal byte missing
+        assert(!unpackCapnp(runs.data(), 1, out, 1024));                     // zero-run count missing
+        assert(!unpackCapnp(runs.data(), runs.size() - 1, out, 1024));       // literal run cut
+        assert(!unpackCapnp(runs.data(), runs.size(), out, 9));              // one word too many
+
+        // zero runs: 2 bytes -> 256 words each; refused at the limit, not allocated past it
+        std::string bomb;
+        for (int i = 0; i < 100000; ++i) bomb += std::string("\x00\xff", 2);
+        assert(!unpackCapnp(bomb.data(), bomb.size(), out, 1024));
+        assert(out.size() <= 1024 && out.capacity() <= 2048);
+    }
+
+    // MappedFile: mapped contents match, empty files map to nothing
+    {
+        char path[] = "/tmp/test_frames_XXXXXX";
+        const int fd = mkstemp(path);
+        assert(fd >= 0);
+        {
+            MappedFile empty(path);
+            assert(empty.size() == 0);
+            FrameReader r(empty.data(), empty.size(), Framing::Capnp);
+            std::string_view p;
+            assert(!r.next(p));
+        }
+        const std::string dump = capnpMessage({4}, 'z');
+        assert(write(fd, dump.data(), dump.size()) == static_cast<ssize_t>(dump.size()));
+        close(fd);
+        {
+            MappedFile file(path);
+            assert(file.size() == dump.size() && std::string(file.data(), file.size()) == dump);
+            assert(reinterpret_cast<std::uintptr_t>(file.data()) % 8 == 0);
+        }
+        std::remove(path);
+        assert(throws([&] { MappedFile missing(path); }));
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "lanes.h"
+
+#include <cassert>
+#include <chrono>
+
+using namespace std::chrono_literals;
+using Clock = LaneSchedule::Clock;
+
+static InsertResult result(InsertStatus status, std::optional<std::chrono::seconds> retryAfter = {}) {
+    InsertResult r;
+    r.status = status;
+    r.retryAfter = retryAfter;
+    return r;
+}
+
+int main() {
+    const Clock::time_point t0 = Clock::now();
+    const InsertResult ok;
+
+    // one lane keeps the old cadence: first insert one interval after start
+    {
+        LaneSchedule s(1, 60s, t0);
+        assert(!s.pick(t0 + 59s));
+        assert(s.pick(t0 + 60s) == 0u);
+        assert(s.nextSlot() == t0 + 60s);
+        s.assign(0, t0 + 60s);
+        assert(s.busy(0) && !s.pick(t0 + 200s));
+        s.completed(0, t0 + 61s, ok);
+        assert(!s.busy(0));
+        assert(!s.pick(t0 + 119s) && s.pick(t0 + 120s) == 0u);
+    }
+
+    // four lanes open 15s apart and take turns: four inserts per interval, none early
+    {
+        LaneSchedule s(4, 60s, t0);
+        assert(!s.pick(t0 + 14s));
+        Clock::time_point now = t0 + 15s;
+        for (int round = 0; round < 3; ++round) {
+            for (std::size_t lane = 0; lane < 4; ++lane) {
+                auto picked = s.pick(now);
+                assert(picked == lane);
+                s.assign(lane, now);
+                assert(!s.pick(now + 14s)); // stagger holds the other lanes back
+                s.completed(lane, now + 1s, ok);
+                now += 15s;
+            }
+        }
+    }
+
+    // idle lanes bunched up by a quiet period are spread out again
+    {
+        LaneSchedule s(2, 60s, t0);
+        const auto late = t0 + 600s;
+        assert(s.pick(late) == 0u);
+        s.assign(0, late);
+        assert(!s.pick(late + 1s));
+        assert(s.nextSlot() == late + 30s);
+        assert(s.pick(late + 30s) == 1u);
+    }
+
+    // 503 before any accepted insert: phase unknown, wait a full interval
+    {
+        LaneSchedule s(2, 60s, t0);
+        s.assign(0, t0 + 30s);
+        assert(s.due(0, t0 + 30s));
+        const auto retry = s.completed(0, t0 + 31s, result(InsertStatus::RateLimited));
+        assert(retry == t0 + 91s);
+        assert(!s.due(0, t0 + 90s) && s.due(0, t0 + 91s));
+        assert(s.margin(0) == Clock::duration::zero());
+        assert(s.pick(t0 + 60s) == 1u); // the other lane keeps going
+        s.assign(1, t0 + 60s);
+
+        s.attempt(0, t0 + 91s);
+        s.completed(0, t0 + 92s, ok);
+        assert(s.attemptStarted(0) == t0 + 91s);
+        assert(!s.pick(t0 + 150s) && s.pick(t0 + 151s) == 0u);
+
+        // other failures back off exponentially
+        assert(s.completed(1, t0 + 200s, result(InsertStatus::NetworkError)) == t0 + 201s);
+        assert(s.completed(1, t0 + 201s, result(InsertStatus::ServerError)) == t0 + 203s);
+        assert(s.completed(1, t0 + 203s, result(InsertStatus::ServerError)) == t0 + 207s);
+        s.completed(1, t0 + 208s, ok);
+        s.assign(1, t0 + 300s);
+        assert(s.completed(1, t0 + 300s, result(InsertStatus::NetworkError)) == t0 + 301s);
+    }
+
+    // a bare 503 right at the window edge teaches the lane to wait a little longer
+    {
+        LaneSchedule s(1, 60s, t0);
+        s.assign(0, t0 + 60s);
+        s.completed(0, t0 + 60s, ok); // window now restarts at t0 + 60s
+        const auto edge = t0 + 120s;
+        assert(s.pick(edge) == 0u);
+        s.assign(0, edge);
+        assert(s.completed(0, edge, result(InsertStatus::RateLimited)) == edge + 250ms);
+        s.attempt(0, edge + 250ms);
+        assert(s.completed(0, edge + 250ms, result(InsertStatus::RateLimited)) == edge + 500ms);
+        s.attempt(0, edge + 500ms);
+        s.completed(0, edge + 500ms, ok);
+        // the learned margin shrinks slowly while inserts go through
+        assert(s.margin(0) > 400ms && s.margin(0) < 500ms);
+        assert(!s.pick(edge + 60s + 400ms) && s.pick(edge + 60s + 500ms + s.margin(0)) == 0u);
+    }
+
+    // Retry-After sets the retry time (and the margin, when rejected at the edge)
+    {
+        LaneSchedule s(1, 60s, t0);
+        s.assign(0, t0 + 60s);
+        s.completed(0, t0 + 60s, ok);
+        s.assign(0, t0 + 120s);
+        assert(s.completed(0, t0 + 120s, result(InsertStatus::RateLimited, 3s)) == t0 + 123s);
+        assert(s.margin(0) == 3s);
+
+        // a rejection long after the edge is someone else's request: margin untouched
+        s.attempt(0, t0 + 123s);
+        s.completed(0, t0 + 123s, ok);
+        const auto margin = s.margin(0);
+        s.assign(0, t0 + 600s);
+        assert(s.completed(0, t0 + 600s, result(InsertStatus::RateLimited, 20s)) == t0 + 620s);
+        assert(s.margin(0) == margin);
+        assert(s.completed(0, t0 + 620s, result(InsertStatus::RateLimited)) == t0 + 680s);
+    }
+
+    // a client error waits for the lane's next window; so does the rest of a split batch
+    {
+        LaneSchedule s(1, 60s, t0);
+        s.assign(0, t0 + 60s);
+        assert(s.completed(0, t0 + 61s, result(InsertStatus::ClientError)) == t0 + 120s);
+        s.attempt(0, t0 + 120s);
+        s.completed(0, t0 + 121s, ok);
+        s.proceed(0);
+        assert(s.busy(0) && !s.pick(t0 + 180s));
+        assert(!s.due(0, t0 + 179s) && s.due(0, t0 + 180s));
+    }
+
+    // Retry-After / RateLimit-Reset values
+    {
+        const std::time_t now = 784111777 - 30; // 30s before Sun, 06 Nov 1994 08:49:37 GMT
+        assert(parseRetryAfter("120", now) == 120s);
+        assert(parseRetryAfter(" 7\r\n", now) == 7s);
+        assert(parseRetryAfter("Sun, 06 Nov 1994 08:49:37 GMT", now) == 30s);
+        assert(parseRetryAfter("Sun, 06 Nov 1994 08:49:00 GMT", now + 3600) == 0s);
+        assert(parseRetryAfter("1700000100", 1700000000) == 100s); // epoch reset
+        assert(!parseRetryAfter("soon", now));
+        assert(!parseRetryAfter("", now));
+        assert(!parseRetryAfter("-5", now));
+    }
+
+    // batch size follows insert latency
+    {
+        BatchSizer sizer(1 << 20, 64 << 20, 10s);
+        assert(sizer.limit() == 64u << 20);
+        sizer.observe(64 << 20, 20s); // too slow: shrink to what fits in 10s
+        assert(sizer.limit() == 32u << 20);
+        sizer.observe(1 << 10, 50ms); // small and fast: says nothing
+        assert(sizer.limit() == 32u << 20);
+        sizer.observe(32 << 20, 2s);  // fast at the limit: grow, at most 2x
+        assert(sizer.limit() == 64u << 20);
+        sizer.timedOut(64 << 20);
+        assert(sizer.limit() == 32u << 20);
+        sizer.observe(2 << 20, 30s);
+        assert(sizer.limit() == 1u << 20);
+
+        // 413: the cap drops below the refused size, under BATCH_MIN_MB if need be, for good
+        sizer.tooLarge(1 << 20);
+        assert(sizer.limit() == 512u << 10);
+        sizer.observe(512 << 10, 1s);
+        assert(sizer.limit() == 512u << 10);
+
+        BatchSizer unlimited;
+        unlimited.observe(1 << 30, 100s);
+        assert(unlimited.limit() == static_cast<std::size_t>(-1));
+        unlimited.tooLarge(8 << 20);
+        assert(unlimited.limit() == 4u << 20);
+    }
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include "metrics.h"
+
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static std::string fetch(std::uint16_t port, const char* path) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    assert(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    const std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: x\r\n\r\n";
+    assert(send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+    std::string response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) response.append(buf, static_cast<std::size_t>(n));
+    close(fd);
+    return response;
+}
+
+int main() {
+    // histogram buckets are rendered cumulatively, le is inclusive
+    Histogram h({1, 10});
+    h.observe(0.5);
+    h.observe(1);
+    h.observe(5);
+    h.observe(100);
+    assert(h.bucket(0) == 2 && h.bucket(1) == 1 && h.bucket(2) == 1);
+    assert(h.count() == 4 && h.sum() == 106.5);
+
+    Metrics m;
+    m.records.inc(3);
+    m.batchRows.observe(250);
+    m.setLag({{{"http_log", 1}, 42}});
+    const std::string text = m.render();
+    assert(text.find("# TYPE anonymizer_records_total counter\nanonymizer_records_total 3\n") != std::string::npos);
+    assert(text.find("anonymizer_batch_rows_bucket{le=\"100\"} 0\n") != std::string::npos);
+    assert(text.find("anonymizer_batch_rows_bucket{le=\"1000\"} 1\n") != std::string::npos);
+    assert(text.find("anonymizer_batch_rows_bucket{le=\"+Inf\"} 1\n") != std::string::npos);
+    assert(text.find("anonymizer_batch_rows_count 1\n") != std::string::npos);
+    assert(text.find("anonymizer_partition_lag{topic=\"http_log\",partition=\"1\"} 42\n") != std::string::npos);
+    assert(text.find("process_resident_memory_bytes ") != std::string::npos);
+
+    // endpoint on an ephemeral port
+    MetricsServer server(0, [] { return std::string("up 1\n"); });
+    assert(server.port() != 0);
+    std::string response = fetch(server.port(), "/metrics");
+    assert(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+    assert(response.find("\r\n\r\nup 1\n") != std::string::npos);
+    assert(fetch(server.port(), "/").rfind("HTTP/1.1 404", 0) == 0);
+    return 0;
+}
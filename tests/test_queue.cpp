@@ -0,0 +1,72 @@
+#include "offsets.h"
+#include "queue.h"
+
+#include <cassert>
+#include <memory>
+#include <thread>
+
+int main() {
+    // capacity rounds up to a power of two; full/empty edges
+    SpscQueue<int> q(3);
+    assert(q.capacity() == 4);
+    int v = 0;
+    assert(!q.try_pop(v) && q.empty());
+    for (int i = 0; i < 4; ++i) {
+        int x = i;
+        assert(q.try_push(x));
+    }
+    int extra = 99;
+    assert(!q.try_push(extra) && extra == 99);
+    assert(*q.front() == 0);
+    assert(q.try_pop(v) && v == 0);
+
+    // producer/consumer threads see every element once, in order
+    SpscQueue<std::unique_ptr<int>> pipe(64);
+    constexpr int kCount = 200000;
+    std::thread producer([&] {
+        IdleBackoff backoff;
+        for (int i = 0; i < kCount; ++i) {
+            auto p = std::make_unique<int>(i);
+            while (!pipe.try_push(p)) backoff.idle();
+        }
+    });
+    IdleBackoff backoff;
+    for (int expected = 0; expected < kCount;) {
+        std::unique_ptr<int> p;
+        if (!pipe.try_pop(p)) { backoff.idle(); continue; }
+        assert(p && *p == expected);
+        ++expected;
+    }
+    producer.join();
+    assert(pipe.empty());
+
+    // OffsetTracker keeps the offset range per partition
+    OffsetTracker a, b;
+    a.add("http_log", 0, 10);
+    a.add("http_log", 0, 7);
+    a.add("http_log", 1, 3);
+    b.add("http_log", 1, 5);
+    b.add("http_log", 2, 0);
+    a.merge(b);
+    assert(a.ranges().size() == 3);
+    assert(a.ranges().at({"http_log", 0}).last == 10);
+    assert(a.ranges().at({"http_log", 0}).first == 7);
+    assert(a.ranges().at({"http_log", 1}).first == 3 && a.ranges().at({"http_log", 1}).last == 5);
+    assert(a.ranges().at({"http_log", 2}).last == 0);
+    OffsetTracker ahead = b.newerThan(a);
+    assert(ahead.empty());
+    b.add("http_log", 0, 11);
+    ahead = b.newerThan(a);
+    assert(ahead.ranges().size() == 1 && ahead.ranges().at({"http_log", 0}).last == 11);
+    assert(ahead.ranges().at({"http_log", 0}).first == 11);
+    assert(a.identity() == "http_log:0:7-10,http_log:1:3-5,http_log:2:0-0");
+    OffsetTracker back = OffsetTracker::fromIdentity(a.identity());
+    assert(back.identity() == a.identity());
+    assert(OffsetTracker::fromIdentity("my-topic:3:5-9").ranges().at({"my-topic", 3}).first == 5);
+    assert(OffsetTracker().identity().empty() && OffsetTracker::fromIdentity("").empty());
+    a.erase({"http_log", 0});
+    assert(a.ranges().size() == 2);
+    a.clear();
+    assert(a.empty());
+    return 0;
+}
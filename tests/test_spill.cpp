@@ -0,0 +1,134 @@
+#include "spill.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static Batch makeBatch(const std::string& body, std::size_t rows, std::int64_t offset) {
+    Batch b;
+    b.body.append(body);
+    b.rows = rows;
+    b.offsets.add("http_log", 0, offset);
+    return b;
+}
+
+static std::size_t segmentFiles(const std::string& dir) {
+    std::size_t n = 0;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d))
+            if (std::string(e->d_name).rfind("segment-", 0) == 0) ++n;
+        closedir(d);
+    }
+    return n;
+}
+
+int main() {
+    char tmpl[] = "/tmp/test_spill_XXXXXX";
+    const std::string dir = mkdtemp(tmpl);
+
+    SpillConfig cfg;
+    cfg.dir = dir;
+    cfg.segmentBytes = 4096;
+    cfg.maxBytes = 3 * 4096;
+    cfg.commitOnWrite = false;
+
+    {
+        SpillLog log(cfg);
+        assert(log.empty());
+        assert(log.append(makeBatch("first\n", 1, 10)));
+        assert(log.append(makeBatch("second\n", 1, 11)));
+        assert(log.records() == 2 && log.bytesOnDisk() == 4096);
+
+        // peek merges oldest records up to the byte budget and keeps them in the log
+        Batch replay = log.peek(1024);
+        assert(replay.body.toString() == "first\nsecond\n");
+        assert(replay.rows == 2 && replay.spilled == 2);
+        assert(replay.offsets.ranges().at({"http_log", 0}).last == 11);
+        Batch one = log.peek(1);
+        assert(one.spilled == 1 && one.body.toString() == "first\n");
+        // records in flight on another lane are skipped
+        Batch next = log.peek(1, 1);
+        assert(next.spilled == 1 && next.body.toString() == "second\n");
+        assert(log.peek(1024, 2).empty());
+        assert(log.records() == 2);
+
+        // a replay splits between records; offsets and spill records go with the tail
+        Batch tail = replay.split();
+        assert(replay.body.toString() == "first\n" && replay.rows == 1);
+        assert(replay.spilled == 0 && replay.offsets.empty());
+        assert(tail.body.toString() == "second\n" && tail.rows == 1 && tail.spilled == 2);
+        assert(tail.offsets.ranges().at({"http_log", 0}).last == 11);
+        assert(replay.split().body.empty() && tail.split().body.empty());
+
+        // a record larger than a segment gets a segment of its own; the cap is enforced
+        assert(log.append(makeBatch(std::string(6000, 'x'), 100, 12)));
+        assert(log.records() == 3 && segmentFiles(dir) == 2);
+        assert(!log.append(makeBatch(std::string(6000, 'y'), 100, 13)));
+        assert(log.records() == 3);
+
+        log.release(1);
+        assert(log.records() == 2 && segmentFiles(dir) == 2);
+    }
+
+    // batches split at the part boundary nearest the middle, again and again
+    {
+        Batch b = makeBatch("a\n", 1, 1);
+        b.append(makeBatch("bb\nbb\n", 2, 2));
+        b.append(Batch()); // dead letters only: no boundary
+        b.append(makeBatch("ccc\nccc\nccc\n", 3, 3));
+        b.append(makeBatch("d\n", 1, 4));
+        assert(b.cuts.size() == 3 && b.rows == 7);
+        Batch tail = b.split();
+        assert(b.body.toString() == "a\nbb\nbb\n" && b.rows == 3 && b.offsets.empty());
+        assert(tail.body.toString() == "ccc\nccc\nccc\nd\n" && tail.rows == 4);
+        assert(tail.offsets.ranges().at({"http_log", 0}).first == 1);
+        assert(tail.offsets.ranges().at({"http_log", 0}).last == 4);
+        Batch last = tail.split();
+        assert(tail.body.toString() == "ccc\nccc\nccc\n" && tail.rows == 3 && tail.offsets.empty());
+        assert(last.body.toString() == "d\n" && last.rows == 1 && !last.offsets.empty());
+        Batch second = b.split();
+        assert(b.body.toString() == "a\n" && second.rows == 2 && b.cuts.empty());
+    }
+
+    // restart: records and their offsets survive, replayed in order
+    {
+        SpillLog log(cfg);
+        assert(log.records() == 2);
+        Batch replay = log.peek(1 << 20);
+        assert(replay.rows == 101);
+        assert(replay.offsets.identity() == "http_log:0:11-12");
+        assert(replay.body.toString() == "second\n" + std::string(6000, 'x'));
+        log.release(1);
+        assert(segmentFiles(dir) == 1);
+        log.release(1);
+        assert(log.empty() && segmentFiles(dir) == 0 && log.bytesOnDisk() == 0);
+
+        // recovered segments are not appended to; a new one is started
+        assert(log.append(makeBatch("third\n", 1, 14)));
+        assert(segmentFiles(dir) == 1);
+    }
+
+    // a corrupted body ends recovery of that segment at the bad record
+    {
+        std::string path;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d))
+                if (std::string(e->d_name).rfind("segment-", 0) == 0) path = dir + "/" + e->d_name;
+            closedir(d);
+        }
+        int fd = open(path.c_str(), O_WRONLY);
+        assert(fd >= 0);
+        assert(pwrite(fd, "T", 1, 32) == 1);
+        close(fd);
+        SpillLog log(cfg);
+        assert(log.empty() && segmentFiles(dir) == 0);
+    }
+
+    rmdir(dir.c_str());
+    return 0;
+}
@@ -9,11 +9,75 @@ int main() {
     // anonymize_ip
     assert(anonymize_ip("1.2.3.4") == std::string("1.2.3.X"));
     assert(anonymize_ip("10.0.0.1") == std::string("10.0.0.X"));
-    assert(anonymize_ip("not-an-ip") == std::string("not-an-ip"));
+    assert(anonymize_ip("255.255.255.255") == std::string("255.255.255.X"));
+
+    // anything that is not an address is masked entirely
+    for (const char* bad : {"not-an-ip", "", "1.2.3", "1.2.3.4.5", "1.2.3.256", "01.2.3.4", "1.2.3.4:80",
+                            " 1.2.3.4", "a.b.c.d", "1..3.4", ":", ":::", "1:2", "1::2::3", "12345::",
+                            "1:2:3:4:5:6:7:8:9", "1:2:3:4:5:6:7", "::1%", "fe80::1:", "::ffff:1.2.3"}) {
+        const AnonymizedIp r = anonymize_ip_fixed(bad);
+        assert(!r.valid && r.view() == "X");
+    }
+
+    // IPv6: masked to the prefix, RFC 5952 output, zone dropped
+    assert(anonymize_ip("2001:db8:abcd:12:34:56:78:9a") == std::string("2001:db8:abcd::"));
+    assert(anonymize_ip("2001:0DB8:ABCD:0012::1") == std::string("2001:db8:abcd::"));
+    assert(anonymize_ip("fe80::1%eth0") == std::string("fe80::"));
+    assert(anonymize_ip("::1") == std::string("::"));
+    assert(anonymize_ip("::") == std::string("::"));
+    assert(anonymize_ip("1:2:3:4:5:6:7::") == std::string("1:2:3::"));
+    assert(anonymize_ip("2001:db8:abcd:1234::1", IpMask{64}) == std::string("2001:db8:abcd:1234::"));
+    assert(anonymize_ip("2001:db8:abcd:1234::1", IpMask{52}) == std::string("2001:db8:abcd:1000::"));
+    assert(anonymize_ip("1:0:0:2:0:0:3:4", IpMask{128}) == std::string("1::2:0:0:3:4"));
+    assert(anonymize_ip("1:2:3:4:5:6:7:8", IpMask{128}) == std::string("1:2:3:4:5:6:7:8"));
+    assert(anonymize_ip("2001:db8::1", IpMask{0}) == std::string("::"));
+    const AnonymizedIp widest = anonymize_ip_fixed("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", IpMask{128});
+    assert(widest.valid && widest.view().size() == 39);
+
+    // IPv4-mapped addresses (dotted or hex) are masked as IPv4, whatever the IPv6 prefix
+    assert(anonymize_ip("::ffff:1.2.3.4") == std::string("::ffff:1.2.3.X"));
+    assert(anonymize_ip("::FFFF:0102:0304", IpMask{128}) == std::string("::ffff:1.2.3.X"));
+    assert(anonymize_ip("0:0:0:0:0:ffff:10.0.0.1") == std::string("::ffff:10.0.0.X"));
 
     // escape_json
     std::string escaped = escape_json("a\"b\\c\n\t");
     assert(escaped == std::string("a\\\"b\\\\c\\n\\t"));
+    assert(escape_json(std::string_view("\x01\x1f\x7f\xc3\xa9", 5)) == "\\u0001\\u001f\x7f\xc3\xa9");
+
+    // every kernel agrees with a byte-at-a-time reference, at every position around
+    // the 16/32-byte block boundaries; appends keep what is already in the buffer
+    auto reference = [](const std::string& in) {
+        std::string out;
+        for (unsigned char c : in) {
+            if (c == '"') out += "\\\"";
+            else if (c == '\\') out += "\\\\";
+            else if (c == '\n') out += "\\n";
+            else if (c == '\t') out += "\\t";
+            else if (c == '\r') out += "\\r";
+            else if (c == '\b') out += "\\b";
+            else if (c == '\f') out += "\\f";
+            else if (c < 0x20) { const char* hex = "0123456789abcdef"; out += "\\u00"; out += hex[c >> 4]; out += hex[c & 15]; }
+            else out += static_cast<char>(c);
+        }
+        return out;
+    };
+    const std::string initial = escape_json_kernel();
+    for (const char* kernel : {"scalar", "sse2", "avx2"}) {
+        if (!set_escape_json_kernel(kernel)) continue;
+        for (std::size_t len = 0; len <= 70; ++len) {
+            for (std::size_t pos = 0; pos <= len; ++pos) {
+                for (char special : {'"', '\\', '\x01', '\n'}) {
+                    std::string in(len, 'a');
+                    if (pos < len) in[pos] = special;
+                    std::string out = "prefix";
+                    escape_json_append(out, in);
+                    assert(out == "prefix" + reference(in));
+                }
+            }
+        }
+    }
+    assert(!set_escape_json_kernel("neon-nope"));
+    set_escape_json_kernel(initial);
 
     // join_rows
     std::vector<std::string> rows{"row1", "row2"};
@@ -28,6 +92,13 @@ int main() {
     assert(getEnvOrDefault("UTIL_TEST_FOO", "x") == std::string("bar"));
     assert(getEnvOrDefault("UTIL_TEST_MISSING", "fallback") == std::string("fallback"));
 
+    // sha256_hex: FIPS 180-2 examples, and a message whose padding needs a second block
+    assert(sha256_hex("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    assert(sha256_hex("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    assert(sha256_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+           "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    assert(sha256_hex(std::string(1000, 'a')) == "41edece42d63e8d9bf515a9ba6932e1c20cbc9f5a5d134645adb5db1b9737ea3");
+
     return 0;
 }
 